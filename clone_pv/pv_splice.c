@@ -1,49 +1,995 @@
 #define _GNU_SOURCE
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <fcntl.h>
+#include "telemetry.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 
+/* Used if the maximum can't be read from PIPE_MAX_SIZE_PATH */
 #define PIPESIZE (1 * 1024 * 1024)
+#define PIPE_MAX_SIZE_PATH "/proc/sys/fs/pipe-max-size"
+#define PIPE_MIN_SIZE (64 * 1024)
+
+/* See 'chunk_tune()' */
+#define TUNE_PERIOD_NS (100 * 1000 * 1000)
+#define TUNE_CHECK_TRANSFERS 16
+
+#define DEFAULT_INTERVAL 1.0
+#define DEFAULT_WINDOW 10.0
+
+/* Usage: pv_splice [-i interval] [-a window] [-p path] [-o output]... [-B pipe size]
+ *                  [-C chunk length] [-s size] [-T target] [-F json|csv] [-H] [-q]
+ * Moves stdin to stdout without passing the data through user space, if possible. The path is
+ * picked by the types of stdin and stdout (or forced with '-p'):
+ * - splice: Either side is a pipe
+ * - copy_file_range: Both sides are regular files
+ * - splice_pipe: Anything else, spliced through an intermediate pipe (e.g. file -> socket)
+ * - mmap: The input file is mapped and written out
+ * - read: Plain read and write, which works for everything
+ * A path that fails before the first byte got through falls back to the next one.
+ * With '-o', the input is duplicated to stdout and every given output (see 'transfer_tee()').
+ * Every 'interval' seconds, the status is printed on stderr:
+ *   <total> [<current rate>] [avg <rate>] [total avg <rate>] <elapsed time> [<percent> ETA <time>]
+ * The current rate covers the last interval, 'avg' the last 'window' seconds and 'total avg'
+ * everything since the start. The progress is shown, if stdin is a regular file or its size is
+ * given with '-s'.
+ * The pipes are as large as allowed ('-B' asks for a specific size) and the length of every
+ * transfer is tuned by the throughput it achieves, unless it is fixed with '-C'. Sizes take the
+ * same suffixes as head(1): K, M, G and T are powers of 1024, KB, MB, GB and TB powers of 1000.
+ * '-T' additionally writes every sample as a JSON line or CSV row to a file, "unix:<socket>" or
+ * "-" for stderr (see 'telemetry.h'). '-H' prints a histogram of the time spent in every transfer
+ * at the end, '-q' hides the status line.
+ * The splice loop only counts bytes. A separate thread samples the counter whenever a timerfd
+ * expires and does all of the formatting. */
+
+typedef enum {
+    PATH_SPLICE,
+    PATH_COPY_FILE_RANGE,
+    PATH_SPLICE_PIPE,
+    PATH_MMAP,
+    PATH_READ,
+    PATH_TEE,
+
+    PATH_COUNT,
+} Path;
+
+static const char *path_names[PATH_COUNT] = {
+    [PATH_SPLICE] = "splice",
+    [PATH_COPY_FILE_RANGE] = "copy_file_range",
+    [PATH_SPLICE_PIPE] = "splice_pipe",
+    [PATH_MMAP] = "mmap",
+    [PATH_READ] = "read",
+    [PATH_TEE] = "tee",
+};
+
+typedef struct {
+    const char *name;
+    int fd;
+    /* Everything teed for this output goes through its own pipe first */
+    int pipe_fds[2];
+    size_t pending;
+    /* Outputs that can't be spliced to (e.g. files opened with O_APPEND) read the pipe instead */
+    char *buffer;
+
+    _Atomic uint64_t bytes;
+    /* Time spent in splice for this output, mostly waiting for the consumer */
+    _Atomic uint64_t wait_ns;
+    /* The reporter's last sample */
+    uint64_t sample_bytes;
+    uint64_t sample_wait_ns;
+} TeeOutput;
+
+/* Who a direct splice had to wait for */
+typedef enum {
+    STALL_PRODUCER,
+    STALL_CONSUMER,
+
+    STALL_COUNT,
+} Stall;
+
+typedef struct {
+    uint64_t time_ns;
+    uint64_t bytes;
+    uint64_t call_ns;
+    uint64_t stall_ns[STALL_COUNT];
+} Sample;
+
+static struct {
+    _Atomic uint64_t bytes_total;
+    uint64_t start_ns;
+
+    /* Written by the transfer loop only, see 'pv_run()' */
+    _Atomic uint64_t call_ns;
+    _Atomic uint64_t stall_ns[STALL_COUNT];
+    Histogram histogram;
+
+    Telemetry telemetry;
+    uint8_t is_quiet;
+
+    /* Ring of the last 'sample_capacity' samples, the first one is taken at the start */
+    Sample *samples;
+    uint32_t sample_capacity;
+    uint64_t sample_count;
+
+    int timer_fd;
+    /* Tells the reporter to stop */
+    int stop_fd;
+
+    Path path;
+    /* PATH_SPLICE_PIPE: The intermediate pipe and what is left in it after a failed splice */
+    int pipe_fds[2];
+    size_t pipe_pending;
+    /* PATH_MMAP: The whole input file */
+    char *mapping;
+    size_t mapping_size;
+    size_t mapping_offset;
+    /* PATH_READ */
+    char *buffer;
+    /* PATH_TEE */
+    TeeOutput *outputs;
+    uint32_t output_count;
+
+    /* The size of stdin, or of whatever pipe is in use */
+    size_t pipe_size;
+    /* The length of every single transfer, see 'chunk_tune()' */
+    size_t chunk_size;
+    uint8_t is_chunk_fixed;
+    /* Zero if unknown */
+    uint64_t input_size;
+} state = {.pipe_fds = {-1, -1}, .telemetry = {.fd = -1}};
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+/* Formats 'value' with the largest binary unit, that keeps it above 1 */
+static void format_size(char *output, size_t output_size, double value, const char *suffix) {
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+    uint32_t unit = 0;
 
-// Currently, the throughput is measured for every second
-// individually, instead of calculating an average value
+    while (value >= 1024 && unit < sizeof(units) / sizeof(units[0]) - 1) {
+        value /= 1024;
+        unit++;
+    }
 
-void print_status(size_t bytes, size_t duration) {
-    size_t gbytes_per_second = bytes / (1024 * 1024 * 1024);
-    fprintf(stderr, "\33[2K\r%zu GiB/s TIme: %zu", gbytes_per_second, duration);
+    snprintf(output, output_size, unit == 0 ? "%.0f %s%s" : "%.2f %s%s", value, units[unit],
+             suffix);
 }
 
-size_t pv_run(void) {
-    size_t time_passed = 0,
-           time_since_last = 0,
-           time_start = time(NULL);
+static double sample_rate(Sample *from, Sample *to) {
+    if (to->time_ns <= from->time_ns)
+        return 0;
 
-    size_t status = 0,
-           bytes_total = 0,
-           bytes_since_last = 0;
+    return (double)(to->bytes - from->bytes) / ((double)(to->time_ns - from->time_ns) / 1e9);
+}
 
-    fcntl(0, F_SETPIPE_SZ, PIPESIZE);
+static void print_time(uint64_t seconds) {
+    fprintf(stderr, "%llu:%02u:%02u", (unsigned long long)(seconds / 3600),
+            (uint32_t)(seconds / 60 % 60), (uint32_t)(seconds % 60));
+}
 
-    while((status = splice(0, NULL, 1, NULL, PIPESIZE, 0 | SPLICE_F_MORE)) ) {
-        bytes_total += status;
-        time_passed = time(NULL) - time_start;
+/* The ETA is based on the moving average */
+static void print_progress(uint64_t bytes, double rate) {
+    if (state.input_size == 0)
+        return;
+
+    fprintf(stderr, " %.1f%% ETA ", (double)bytes / (double)state.input_size * 100);
+
+    if (bytes >= state.input_size)
+        print_time(0);
+    else if (rate > 0)
+        print_time((uint64_t)((double)(state.input_size - bytes) / rate));
+    else
+        fprintf(stderr, "-:--:--");
+}
 
-        if(time_since_last < time_passed) {
-            print_status(bytes_total - bytes_since_last, time_passed);
+/* The rate and the share of the time spent waiting for every output of PATH_TEE. These tell
+ * which consumer holds back the others. */
+static void print_outputs(uint8_t is_final, uint64_t interval_ns) {
+    if (state.path != PATH_TEE || interval_ns == 0)
+        return;
 
-            time_since_last = time_passed;
-            bytes_since_last = bytes_total;
+    for (uint32_t i = 0; i < state.output_count; i++) {
+        TeeOutput *output = &state.outputs[i];
+        uint64_t bytes = atomic_load_explicit(&output->bytes, memory_order_relaxed);
+        uint64_t wait_ns = atomic_load_explicit(&output->wait_ns, memory_order_relaxed);
+
+        char rate[32];
+        format_size(rate, sizeof(rate),
+                    (double)(bytes - output->sample_bytes) / ((double)interval_ns / 1e9), "/s");
+
+        if (!is_final) {
+            fprintf(stderr, " | %s %s %.0f%%", output->name, rate,
+                    (double)(wait_ns - output->sample_wait_ns) / (double)interval_ns * 100);
         }
+
+        output->sample_bytes = bytes;
+        output->sample_wait_ns = wait_ns;
+    }
+}
+
+/* Once everything is done, every output gets a line with its totals. The one that was waited for
+ * the longest is the bottleneck. */
+static void print_output_totals(void) {
+    if (state.path != PATH_TEE)
+        return;
+
+    uint64_t elapsed_ns = now_ns() - state.start_ns;
+    uint32_t slowest = 0;
+
+    for (uint32_t i = 1; i < state.output_count; i++) {
+        if (atomic_load(&state.outputs[i].wait_ns) > atomic_load(&state.outputs[slowest].wait_ns))
+            slowest = i;
+    }
+
+    for (uint32_t i = 0; i < state.output_count; i++) {
+        TeeOutput *output = &state.outputs[i];
+        uint64_t bytes = atomic_load(&output->bytes);
+
+        char total[32], rate[32];
+        format_size(total, sizeof(total), (double)bytes, "");
+        format_size(rate, sizeof(rate), (double)bytes / ((double)elapsed_ns / 1e9), "/s");
+
+        fprintf(stderr, "  %s: %s [%s] waited %.1f%% of the time%s\n", output->name, total, rate,
+                (double)atomic_load(&output->wait_ns) / (double)elapsed_ns * 100,
+                i == slowest && state.output_count > 1 ? " (slowest)" : "");
+    }
+}
+
+static void record_sample(Sample *previous, Sample *sample) {
+    if (state.telemetry.fd == -1)
+        return;
+
+    struct timespec timestamp;
+    clock_gettime(CLOCK_REALTIME, &timestamp);
+
+    double interval = (double)(sample->time_ns - previous->time_ns) / 1e9;
+    double elapsed = (double)(sample->time_ns - state.start_ns) / 1e9;
+
+    TelemetryRecord record = {
+        .timestamp = (double)timestamp.tv_sec + (double)timestamp.tv_nsec / 1e9,
+        .elapsed = elapsed,
+        .bytes = sample->bytes,
+        .rate = interval > 0 ? (double)(sample->bytes - previous->bytes) / interval : 0,
+        .average = elapsed > 0 ? (double)sample->bytes / elapsed : 0,
+        .call_time = (double)(sample->call_ns - previous->call_ns) / 1e9,
+        .producer_stall =
+            (double)(sample->stall_ns[STALL_PRODUCER] - previous->stall_ns[STALL_PRODUCER]) / 1e9,
+        .consumer_stall =
+            (double)(sample->stall_ns[STALL_CONSUMER] - previous->stall_ns[STALL_CONSUMER]) / 1e9,
+    };
+
+    telemetry_record(&state.telemetry, &record);
+}
+
+/* Takes a new sample and prints the status line, which is finished with a newline at the end */
+static void print_status(uint8_t is_final) {
+    Sample sample = {
+        .time_ns = now_ns(),
+        .bytes = atomic_load_explicit(&state.bytes_total, memory_order_relaxed),
+        .call_ns = atomic_load_explicit(&state.call_ns, memory_order_relaxed),
     };
+    for (uint32_t i = 0; i < STALL_COUNT; i++)
+        sample.stall_ns[i] = atomic_load_explicit(&state.stall_ns[i], memory_order_relaxed);
 
-    return status;
+    Sample *previous = &state.samples[(state.sample_count - 1) % state.sample_capacity];
+    Sample *oldest = &state.samples[state.sample_count < state.sample_capacity
+                                        ? 0
+                                        : state.sample_count % state.sample_capacity];
+    Sample start = {.time_ns = state.start_ns, .bytes = 0};
+
+    record_sample(previous, &sample);
+    if (state.is_quiet)
+        goto done;
+
+    char total[32], current[32], average[32], total_average[32];
+    format_size(total, sizeof(total), (double)sample.bytes, "");
+    format_size(current, sizeof(current), sample_rate(previous, &sample), "/s");
+    format_size(average, sizeof(average), sample_rate(oldest, &sample), "/s");
+    format_size(total_average, sizeof(total_average), sample_rate(&start, &sample), "/s");
+
+    uint64_t seconds = (sample.time_ns - state.start_ns) / 1000000000ULL;
+    fprintf(stderr, "\33[2K\r%s [%s] [avg %s] [total avg %s] ", total, current, average,
+            total_average);
+    print_time(seconds);
+    print_progress(sample.bytes, sample_rate(oldest, &sample));
+    print_outputs(is_final, sample.time_ns - previous->time_ns);
+    if (is_final) {
+        char pipe_size[32], chunk_size[32];
+        format_size(pipe_size, sizeof(pipe_size), (double)state.pipe_size, "");
+        format_size(chunk_size, sizeof(chunk_size), (double)state.chunk_size, "");
+        fprintf(stderr, " (%s, pipe %s, chunk %s)\n", path_names[state.path], pipe_size,
+                chunk_size);
+    }
+
+done:
+    state.samples[state.sample_count % state.sample_capacity] = sample;
+    state.sample_count++;
+}
+
+static void *reporter_run(void *argument) {
+    struct pollfd fds[2] = {
+        {.fd = state.timer_fd, .events = POLLIN},
+        {.fd = state.stop_fd, .events = POLLIN},
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents != 0)
+            break;
+
+        /* Missed expirations are simply covered by the next sample */
+        uint64_t expirations;
+        if (read(state.timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            print_status(0);
+    }
+
+    return NULL;
+}
+
+/* Unprivileged processes can't make a pipe larger than this */
+static size_t pipe_size_max(void) {
+    FILE *file = fopen(PIPE_MAX_SIZE_PATH, "r");
+    unsigned long long size = 0;
+
+    if (file != NULL) {
+        if (fscanf(file, "%llu", &size) != 1)
+            size = 0;
+        fclose(file);
+    }
+
+    return size >= PIPE_MIN_SIZE ? (size_t)size : PIPESIZE;
+}
+
+/* F_SETPIPE_SZ also fails, if the pipe already holds more than 'size' or the user ran out of pipe
+ * pages (see pipe(7)). Each failure halves the size. Returns the size the pipe ended up with. */
+static size_t pipe_resize(int fd, size_t size) {
+    while (size >= PIPE_MIN_SIZE && fcntl(fd, F_SETPIPE_SZ, (int)size) == -1)
+        size /= 2;
+
+    int actual = fcntl(fd, F_GETPIPE_SZ);
+    return actual > 0 ? (size_t)actual : size;
+}
+
+static void setup_pipes(size_t size) {
+    struct stat input_stat, output_stat;
+    size_t size_max = pipe_size_max();
+
+    if (size == 0) {
+        size = size_max;
+    } else if (size > size_max) {
+        fprintf(stderr, "warning: Pipes are limited to %zu bytes, see %s\n", size_max,
+                PIPE_MAX_SIZE_PATH);
+        size = size_max;
+    }
+
+    int has_input_stat = fstat(0, &input_stat) == 0;
+    if (has_input_stat && S_ISFIFO(input_stat.st_mode))
+        size = pipe_resize(0, size);
+    else if (fstat(1, &output_stat) == 0 && S_ISFIFO(output_stat.st_mode))
+        size = pipe_resize(1, size);
+
+    state.pipe_size = size;
+    if (state.chunk_size == 0 || state.chunk_size > size)
+        state.chunk_size = size;
+
+    /* Without '-s', the rest of an input file is all there is to transfer */
+    if (state.input_size == 0 && has_input_stat && S_ISREG(input_stat.st_mode)) {
+        off_t offset = lseek(0, 0, SEEK_CUR);
+        if (offset >= 0 && offset < input_stat.st_size)
+            state.input_size = (uint64_t)(input_stat.st_size - offset);
+    }
+}
+
+/* Hill climbing on the chunk length: Every TUNE_PERIOD_NS, the throughput of the last period is
+ * compared with the one before. If it got worse, the direction changes. The chunk length is
+ * doubled or halved within PIPE_MIN_SIZE and the pipe size. */
+static void chunk_tune(uint64_t bytes_total) {
+    static struct {
+        uint64_t start_ns;
+        uint64_t start_bytes;
+        double last_rate;
+        int direction;
+        uint32_t transfers;
+    } tune = {.direction = -1};
+
+    /* Not every transfer has to look at the clock */
+    if (state.is_chunk_fixed || ++tune.transfers % TUNE_CHECK_TRANSFERS != 0)
+        return;
+
+    uint64_t now = now_ns();
+    if (tune.start_ns == 0) {
+        tune.start_ns = now;
+        tune.start_bytes = bytes_total;
+        return;
+    }
+
+    if (now - tune.start_ns < TUNE_PERIOD_NS)
+        return;
+
+    double rate = (double)(bytes_total - tune.start_bytes) / (double)(now - tune.start_ns);
+    if (rate < tune.last_rate)
+        tune.direction = -tune.direction;
+
+    size_t chunk_size = tune.direction > 0 ? state.chunk_size * 2 : state.chunk_size / 2;
+    if (chunk_size >= PIPE_MIN_SIZE && chunk_size <= state.pipe_size)
+        state.chunk_size = chunk_size;
+    else
+        tune.direction = -tune.direction;
+
+    tune.last_rate = rate;
+    tune.start_ns = now;
+    tune.start_bytes = bytes_total;
+}
+
+static Path path_pick(void) {
+    struct stat input_stat, output_stat;
+
+    if (fstat(0, &input_stat) == -1 || fstat(1, &output_stat) == -1)
+        return PATH_READ;
+
+    if (S_ISFIFO(input_stat.st_mode) || S_ISFIFO(output_stat.st_mode))
+        return PATH_SPLICE;
+    if (S_ISREG(input_stat.st_mode) && S_ISREG(output_stat.st_mode))
+        return PATH_COPY_FILE_RANGE;
+
+    return PATH_SPLICE_PIPE;
+}
+
+/* The next path to try, if 'path' does not work for stdin and stdout */
+static Path path_fallback(Path path) {
+    /* The data stuck in the intermediate pipe has to go out first */
+    if (state.pipe_pending != 0)
+        return PATH_READ;
+
+    switch (path) {
+    case PATH_COPY_FILE_RANGE:
+        return PATH_SPLICE_PIPE;
+    case PATH_SPLICE:
+    case PATH_SPLICE_PIPE:
+        return PATH_MMAP;
+    default:
+        return PATH_READ;
+    }
 }
 
-int main(void) {
-    size_t status_code = pv_run();
+static ssize_t transfer_splice_pipe(void) {
+    if (state.pipe_fds[0] == -1) {
+        if (pipe2(state.pipe_fds, O_CLOEXEC) == -1)
+            return -1;
+        pipe_resize(state.pipe_fds[1], state.pipe_size);
+    }
+
+    ssize_t filled = splice(0, NULL, state.pipe_fds[1], NULL, state.chunk_size, SPLICE_F_MOVE);
+    if (filled <= 0)
+        return filled;
+
+    /* The input is consumed already, so everything in the pipe has to get out */
+    state.pipe_pending = (size_t)filled;
+    while (state.pipe_pending > 0) {
+        ssize_t drained = splice(state.pipe_fds[0], NULL, 1, NULL, state.pipe_pending,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (drained == -1 && errno == EINTR)
+            continue;
+        if (drained <= 0)
+            return -1;
+
+        state.pipe_pending -= (size_t)drained;
+    }
+
+    return filled;
+}
+
+static ssize_t transfer_mmap(void) {
+    if (state.mapping == NULL) {
+        struct stat input_stat;
+        if (fstat(0, &input_stat) == -1)
+            return -1;
+        if (!S_ISREG(input_stat.st_mode)) {
+            errno = ENODEV;
+            return -1;
+        }
+
+        /* Continue wherever the input currently is */
+        off_t start = lseek(0, 0, SEEK_CUR);
+        state.mapping_offset = start > 0 ? (size_t)start : 0;
+        state.mapping_size = (size_t)input_stat.st_size;
+        if (state.mapping_offset >= state.mapping_size)
+            return 0;
+
+        state.mapping = mmap(NULL, state.mapping_size, PROT_READ, MAP_SHARED, 0, 0);
+        if (state.mapping == MAP_FAILED) {
+            state.mapping = NULL;
+            return -1;
+        }
+        madvise(state.mapping, state.mapping_size, MADV_SEQUENTIAL);
+    }
+
+    size_t length = state.mapping_size - state.mapping_offset;
+    if (length > state.chunk_size)
+        length = state.chunk_size;
+    if (length == 0)
+        return 0;
+
+    ssize_t written = write(1, state.mapping + state.mapping_offset, length);
+    if (written > 0)
+        state.mapping_offset += (size_t)written;
+
+    return written;
+}
+
+static ssize_t transfer_read(void) {
+    if (state.buffer == NULL)
+        state.buffer = malloc(state.pipe_size);
+
+    /* Leftovers of a failed PATH_SPLICE_PIPE come first */
+    int input = state.pipe_pending != 0 ? state.pipe_fds[0] : 0;
+    size_t capacity = state.pipe_pending != 0 ? state.pipe_pending : state.chunk_size;
+
+    ssize_t length = read(input, state.buffer, capacity);
+    if (length <= 0)
+        return length;
+
+    for (ssize_t offset = 0; offset < length;) {
+        ssize_t written = write(1, state.buffer + offset, (size_t)(length - offset));
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+
+        offset += written;
+    }
+
+    if (input != 0)
+        state.pipe_pending -= (size_t)length;
+
+    return length;
+}
+
+static ssize_t tee_drain_read(TeeOutput *output) {
+    ssize_t length = read(output->pipe_fds[0], output->buffer, output->pending);
+    if (length <= 0)
+        return length;
+
+    for (ssize_t offset = 0; offset < length;) {
+        ssize_t written = write(output->fd, output->buffer + offset, (size_t)(length - offset));
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+
+        offset += written;
+    }
+
+    return length;
+}
+
+/* Moves everything left in the output's pipe to the output */
+static int tee_drain(TeeOutput *output) {
+    while (output->pending > 0) {
+        uint64_t start = now_ns();
+        ssize_t drained = output->buffer != NULL
+                              ? tee_drain_read(output)
+                              : splice(output->pipe_fds[0], NULL, output->fd, NULL,
+                                       output->pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+        atomic_store_explicit(&output->wait_ns, output->wait_ns + (now_ns() - start),
+                              memory_order_relaxed);
+
+        if (drained == -1 && errno == EINTR)
+            continue;
+
+        if (drained == -1 && output->buffer == NULL && output->bytes == 0 &&
+            (errno == EINVAL || errno == EBADF)) {
+            output->buffer = malloc(state.pipe_size);
+            continue;
+        }
+
+        if (drained <= 0) {
+            fprintf(stderr, "\nerror: Failed to write to '%s': %s\n", output->name,
+                    drained == 0 ? "No progress" : strerror(errno));
+            return -1;
+        }
+
+        output->pending -= (size_t)drained;
+        atomic_store_explicit(&output->bytes, output->bytes + (uint64_t)drained,
+                              memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+/* tee(2) duplicates the contents of stdin without consuming them, but only into another pipe.
+ * Every output gets its own pipe of the same size as stdin: Once it's empty again, it can always
+ * take a full copy of whatever the first tee got. The last output consumes the data with a
+ * splice instead. The outputs are drained one after another, so a slow consumer holds back all
+ * of them. This shows up as the time waited for it.
+ * NOTE: The outputs get references to the very same pages. A producer that reuses the pages it
+ * passed to vmsplice (e.g. 'yes_vmsplice -n') can change them while they are still queued. */
+static ssize_t transfer_tee(void) {
+    size_t length = 0;
+
+    for (uint32_t i = 0; i < state.output_count; i++) {
+        TeeOutput *output = &state.outputs[i];
+        if (tee_drain(output) == -1)
+            return -1;
+
+        ssize_t status;
+        do {
+            if (i + 1 < state.output_count)
+                status = tee(0, output->pipe_fds[1], length ? length : state.chunk_size, 0);
+            else
+                status = splice(0, NULL, output->pipe_fds[1], NULL,
+                                length ? length : state.chunk_size, SPLICE_F_MOVE);
+        } while (status == -1 && errno == EINTR);
+
+        if (status == -1) {
+            fprintf(stderr, "\nerror: Failed to duplicate the input: %s\n", strerror(errno));
+            return -1;
+        }
+
+        /* At the end of the input, whatever is still in the pipes has to get out */
+        if (status == 0) {
+            for (uint32_t j = 0; j < state.output_count; j++) {
+                if (tee_drain(&state.outputs[j]) == -1)
+                    return -1;
+            }
+
+            return 0;
+        }
+
+        if (length != 0 && (size_t)status != length) {
+            fprintf(stderr, "\nerror: '%s' only got %zd of %zu bytes\n", output->name, status,
+                    length);
+            return -1;
+        }
+
+        length = (size_t)status;
+        output->pending = length;
+    }
+
+    return (ssize_t)length;
+}
+
+/* Splices without blocking, so every wait can be put down to either side: An empty stdin means
+ * waiting for the producer, a full stdout waiting for the consumer. */
+static ssize_t transfer_splice(void) {
+    while (1) {
+        ssize_t status =
+            splice(0, NULL, 1, NULL, state.chunk_size, SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (status != -1 || errno != EAGAIN)
+            return status;
+
+        struct pollfd fds[STALL_COUNT] = {
+            [STALL_PRODUCER] = {.fd = 0, .events = POLLIN},
+            [STALL_CONSUMER] = {.fd = 1, .events = POLLOUT},
+        };
+
+        if (poll(fds, STALL_COUNT, 0) == -1)
+            return -1;
+
+        /* Both sides might be ready by now, then we simply try again */
+        Stall stall = fds[STALL_PRODUCER].revents == 0 ? STALL_PRODUCER : STALL_CONSUMER;
+        if (fds[stall].revents != 0)
+            continue;
+
+        uint64_t start = now_ns();
+        if (poll(&fds[stall], 1, -1) == -1)
+            return -1;
+
+        atomic_store_explicit(&state.stall_ns[stall],
+                              state.stall_ns[stall] + (now_ns() - start), memory_order_relaxed);
+    }
+}
+
+/* Moves the next chunk, returns the number of bytes moved, 0 at the end of the input or -1 */
+static ssize_t transfer(void) {
+    switch (state.path) {
+    case PATH_SPLICE:
+        return transfer_splice();
+    case PATH_COPY_FILE_RANGE:
+        return copy_file_range(0, NULL, 1, NULL, state.chunk_size, 0);
+    case PATH_SPLICE_PIPE:
+        return transfer_splice_pipe();
+    case PATH_MMAP:
+        return transfer_mmap();
+    case PATH_TEE:
+        return transfer_tee();
+    default:
+        return transfer_read();
+    }
+}
+
+static int pv_run(void) {
+    uint64_t bytes_total = 0;
+
+    while (1) {
+        uint64_t start = now_ns();
+        ssize_t status = transfer();
+        uint64_t duration = now_ns() - start;
+
+        histogram_add(&state.histogram, duration);
+        atomic_store_explicit(&state.call_ns, state.call_ns + duration, memory_order_relaxed);
+
+        if (status == 0)
+            return 0;
+
+        if (status == -1) {
+            if (errno == EINTR)
+                continue;
+
+            /* These tell us, that the path does not work for stdin and stdout at all */
+            if (bytes_total == 0 && state.path != PATH_READ && state.path != PATH_TEE &&
+                (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+                 errno == EBADF || errno == ESPIPE || errno == ENODEV)) {
+                state.path = path_fallback(state.path);
+                continue;
+            }
+
+            /* PATH_TEE has its own, more detailed, messages */
+            if (state.path != PATH_TEE)
+                fprintf(stderr, "\nerror: %s failed: %s\n", path_names[state.path],
+                        strerror(errno));
+            return 1;
+        }
+
+        /* The reporter only ever reads the counter, there is no need for an atomic add */
+        bytes_total += (uint64_t)status;
+        atomic_store_explicit(&state.bytes_total, bytes_total, memory_order_relaxed);
+        chunk_tune(bytes_total);
+    }
+}
+
+static void tee_add_output(const char *name, int fd) {
+    state.outputs = realloc(state.outputs, (state.output_count + 1) * sizeof(*state.outputs));
+
+    TeeOutput *output = &state.outputs[state.output_count++];
+    memset(output, 0, sizeof(*output));
+    output->name = name;
+    output->fd = fd;
+}
+
+/* The pipes of all outputs need the same size as stdin, see 'transfer_tee()' */
+static void tee_setup(void) {
+    struct stat input_stat;
+    if (fstat(0, &input_stat) == -1 || !S_ISFIFO(input_stat.st_mode)) {
+        fprintf(stderr, "error: Duplicating the input requires stdin to be a pipe\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < state.output_count; i++) {
+        TeeOutput *output = &state.outputs[i];
+
+        if (pipe2(output->pipe_fds, O_CLOEXEC) == -1 ||
+            pipe_resize(output->pipe_fds[1], state.pipe_size) < state.pipe_size) {
+            fprintf(stderr, "error: Failed to set up a pipe of %zu bytes for '%s': %s\n",
+                    state.pipe_size, output->name, strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+/* Parses sizes like '2G' or '1.5MB', see the usage above. Returns -1 for anything else. */
+static double parse_size(const char *text) {
+    static const char units[] = "KMGT";
+    char *end;
+    double size = strtod(text, &end);
+
+    if (end == text || size < 0)
+        return -1;
+
+    if (*end != '\0') {
+        const char *unit = strchr(units, toupper((unsigned char)*end++));
+        if (unit == NULL)
+            return -1;
+
+        double base = 1024;
+        if (*end == 'B') {
+            base = 1000;
+            end++;
+        }
+
+        for (const char *power = units; power <= unit; power++)
+            size *= base;
+    }
+
+    return *end == '\0' ? size : -1;
+}
+
+static size_t parse_option_size(const char *name, const char *text) {
+    double size = parse_size(text);
+    if (size <= 0) {
+        fprintf(stderr, "error: Invalid %s '%s'\n", name, text);
+        exit(1);
+    }
+
+    return (size_t)size;
+}
+
+static double parse_seconds(const char *name, const char *text) {
+    char *end;
+    double seconds = strtod(text, &end);
+
+    if (end == text || *end != '\0' || seconds <= 0) {
+        fprintf(stderr, "error: Invalid %s '%s'\n", name, text);
+        exit(1);
+    }
+
+    return seconds;
+}
+
+int main(int argc, char **argv) {
+    double interval = DEFAULT_INTERVAL, window = DEFAULT_WINDOW;
+    size_t pipe_size = 0;
+    const char *telemetry_target = NULL;
+    TelemetryFormat telemetry_format = TELEMETRY_JSON;
+    uint8_t print_histogram = 0;
+    int option;
+
+    state.path = PATH_COUNT;
+
+    tee_add_output("stdout", 1);
+
+    while ((option = getopt(argc, argv, "i:a:p:o:B:C:s:T:F:Hq")) != -1) {
+        switch (option) {
+        case 'i':
+            interval = parse_seconds("interval", optarg);
+            break;
+        case 'a':
+            window = parse_seconds("window", optarg);
+            break;
+        case 'p':
+            for (state.path = 0; state.path < PATH_COUNT; state.path++) {
+                if (strcmp(path_names[state.path], optarg) == 0)
+                    break;
+            }
+
+            if (state.path == PATH_COUNT) {
+                fprintf(stderr, "error: Unknown path '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o': {
+            int fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "error: Failed to open '%s': %s\n", optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+
+            tee_add_output(optarg, fd);
+            break;
+        }
+        case 'B':
+            pipe_size = parse_option_size("pipe size", optarg);
+            break;
+        case 'C':
+            state.chunk_size = parse_option_size("chunk length", optarg);
+            state.is_chunk_fixed = 1;
+            break;
+        case 's':
+            state.input_size = parse_option_size("size", optarg);
+            break;
+        case 'T':
+            telemetry_target = optarg;
+            break;
+        case 'F':
+            for (telemetry_format = 0; telemetry_format < TELEMETRY_FORMAT_COUNT;
+                 telemetry_format++) {
+                if (strcmp(telemetry_format_names[telemetry_format], optarg) == 0)
+                    break;
+            }
+
+            if (telemetry_format == TELEMETRY_FORMAT_COUNT) {
+                fprintf(stderr, "error: Unknown format '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            print_histogram = 1;
+            break;
+        case 'q':
+            state.is_quiet = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-i interval] [-a window] [-p path] [-o output]... [-B pipe size] "
+                    "[-C chunk length] [-s size] [-T target] [-F json|csv] [-H] [-q]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* A closed stdout shows up as EPIPE, so we still get to report */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (telemetry_target != NULL &&
+        telemetry_open(&state.telemetry, telemetry_target, telemetry_format) == -1) {
+        fprintf(stderr, "error: Failed to open '%s': %s\n", telemetry_target, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    setup_pipes(pipe_size);
+
+    if (state.output_count > 1)
+        state.path = PATH_TEE;
+    else if (state.path == PATH_COUNT || state.path == PATH_TEE)
+        state.path = path_pick();
+
+    if (state.path == PATH_TEE)
+        tee_setup();
+
+    /* The moving average needs one more sample than it covers intervals */
+    state.sample_capacity = (uint32_t)ceil(window / interval) + 1;
+    state.samples = calloc(state.sample_capacity, sizeof(*state.samples));
+    state.start_ns = now_ns();
+    state.samples[0].time_ns = state.start_ns;
+    state.sample_count = 1;
+
+    /* A zero interval would disarm the timer */
+    uint64_t interval_ns = (uint64_t)(interval * 1e9);
+    if (interval_ns < 1000000)
+        interval_ns = 1000000;
+    struct itimerspec timer = {
+        .it_interval = {.tv_sec = (time_t)(interval_ns / 1000000000ULL),
+                        .tv_nsec = (long)(interval_ns % 1000000000ULL)},
+    };
+    timer.it_value = timer.it_interval;
+
+    state.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    state.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (state.timer_fd == -1 || state.stop_fd == -1 ||
+        timerfd_settime(state.timer_fd, 0, &timer, NULL) == -1) {
+        fprintf(stderr, "error: Failed to set up the timer: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    pthread_t reporter;
+    pthread_create(&reporter, NULL, reporter_run, NULL);
+
+    int status_code = pv_run();
+
+    uint64_t stop = 1;
+    write(state.stop_fd, &stop, sizeof(stop));
+    pthread_join(reporter, NULL);
+    print_status(1);
+    if (!state.is_quiet)
+        print_output_totals();
+    if (print_histogram)
+        histogram_print(&state.histogram, stderr);
+
+    telemetry_histogram(&state.telemetry, &state.histogram);
+    telemetry_close(&state.telemetry);
+
+    close(state.timer_fd);
+    close(state.stop_fd);
+    free(state.samples);
+    free(state.buffer);
+    for (uint32_t i = 0; i < state.output_count; i++)
+        free(state.outputs[i].buffer);
+    free(state.outputs);
 
     return status_code;
 }
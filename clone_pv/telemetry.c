@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include "telemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UNIX_PREFIX "unix:"
+#define HISTOGRAM_BAR_WIDTH 40
+
+const char *telemetry_format_names[TELEMETRY_FORMAT_COUNT] = {
+    [TELEMETRY_JSON] = "json",
+    [TELEMETRY_CSV] = "csv",
+};
+
+/* Lines are written with a single call, so they don't get torn apart on a socket */
+static void telemetry_write(Telemetry *telemetry, const char *line, size_t length) {
+    if (telemetry->fd == -1)
+        return;
+
+    for (size_t offset = 0; offset < length;) {
+        ssize_t written = write(telemetry->fd, line + offset, length - offset);
+        if (written == -1 && errno == EINTR)
+            continue;
+
+        if (written <= 0) {
+            fprintf(stderr, "\nwarning: Telemetry disabled, write failed: %s\n", strerror(errno));
+            telemetry_close(telemetry);
+            return;
+        }
+
+        offset += (size_t)written;
+    }
+}
+
+static int telemetry_connect(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+int telemetry_open(Telemetry *telemetry, const char *target, TelemetryFormat format) {
+    telemetry->format = format;
+
+    if (strcmp(target, "-") == 0)
+        telemetry->fd = dup(2);
+    else if (strncmp(target, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+        telemetry->fd = telemetry_connect(target + strlen(UNIX_PREFIX));
+    else
+        telemetry->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (telemetry->fd == -1)
+        return -1;
+
+    if (format == TELEMETRY_CSV) {
+        static const char header[] = "type,timestamp,elapsed,bytes,rate,average,call_time,"
+                                     "producer_stall,consumer_stall\n";
+        telemetry_write(telemetry, header, sizeof(header) - 1);
+    }
+
+    return 0;
+}
+
+void telemetry_close(Telemetry *telemetry) {
+    if (telemetry->fd != -1)
+        close(telemetry->fd);
+    telemetry->fd = -1;
+}
+
+void telemetry_record(Telemetry *telemetry, const TelemetryRecord *record) {
+    char line[512];
+    int length;
+
+    if (telemetry->format == TELEMETRY_CSV) {
+        length = snprintf(line, sizeof(line), "sample,%.6f,%.6f,%llu,%.0f,%.0f,%.6f,%.6f,%.6f\n",
+                          record->timestamp, record->elapsed, (unsigned long long)record->bytes,
+                          record->rate, record->average, record->call_time,
+                          record->producer_stall, record->consumer_stall);
+    } else {
+        length = snprintf(line, sizeof(line),
+                          "{\"type\":\"sample\",\"timestamp\":%.6f,\"elapsed\":%.6f,"
+                          "\"bytes\":%llu,\"rate\":%.0f,\"average\":%.0f,\"call_time\":%.6f,"
+                          "\"producer_stall\":%.6f,\"consumer_stall\":%.6f}\n",
+                          record->timestamp, record->elapsed, (unsigned long long)record->bytes,
+                          record->rate, record->average, record->call_time,
+                          record->producer_stall, record->consumer_stall);
+    }
+
+    telemetry_write(telemetry, line, (size_t)length);
+}
+
+void telemetry_histogram(Telemetry *telemetry, Histogram *histogram) {
+    char line[HISTOGRAM_BUCKETS * 48 + 64];
+    size_t length = 0;
+
+    if (telemetry->format == TELEMETRY_JSON)
+        length += (size_t)snprintf(line, sizeof(line), "{\"type\":\"histogram\",\"buckets\":[");
+
+    for (uint32_t i = 0, is_first = 1; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t count = atomic_load(&histogram->counts[i]);
+        if (count == 0)
+            continue;
+
+        length += (size_t)snprintf(line + length, sizeof(line) - length,
+                                   telemetry->format == TELEMETRY_CSV ? "histogram,%llu,%llu\n"
+                                   : is_first                         ? "[%llu,%llu]"
+                                                                      : ",[%llu,%llu]",
+                                   (unsigned long long)histogram_bucket_low(i),
+                                   (unsigned long long)count);
+        is_first = 0;
+    }
+
+    if (telemetry->format == TELEMETRY_JSON)
+        length += (size_t)snprintf(line + length, sizeof(line) - length, "]}\n");
+
+    telemetry_write(telemetry, line, length);
+}
+
+static void format_duration(char *output, size_t output_size, uint64_t duration_ns) {
+    static const char *units[] = {"ns", "us", "ms", "s"};
+    uint32_t unit = 0;
+
+    while (duration_ns >= 1000 && unit < sizeof(units) / sizeof(units[0]) - 1) {
+        duration_ns /= 1000;
+        unit++;
+    }
+
+    snprintf(output, output_size, "%llu %s", (unsigned long long)duration_ns, units[unit]);
+}
+
+void histogram_print(Histogram *histogram, FILE *file) {
+    uint64_t count_max = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (atomic_load(&histogram->counts[i]) > count_max)
+            count_max = atomic_load(&histogram->counts[i]);
+    }
+
+    if (count_max == 0)
+        return;
+
+    fprintf(file, "time per transfer:\n");
+
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t count = atomic_load(&histogram->counts[i]);
+        if (count == 0)
+            continue;
+
+        char low[16], high[16] = "inf";
+        format_duration(low, sizeof(low), histogram_bucket_low(i));
+        if (i < HISTOGRAM_BUCKETS - 1)
+            format_duration(high, sizeof(high), 1ULL << (i + 1));
+
+        char bar[HISTOGRAM_BAR_WIDTH + 1];
+        uint32_t width = (uint32_t)(count * HISTOGRAM_BAR_WIDTH / count_max);
+        memset(bar, '#', width);
+        bar[width] = '\0';
+
+        fprintf(file, "  %7s - %7s %10llu %s\n", low, high, (unsigned long long)count, bar);
+    }
+}
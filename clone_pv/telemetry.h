@@ -0,0 +1,79 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Machine readable status records for pv_splice. Every sample becomes one line:
+ * - json: {"type":"sample","timestamp":...,"elapsed":...,...}
+ * - csv: A header, followed by "sample,<timestamp>,<elapsed>,..." rows
+ * At the end, the histogram follows as {"type":"histogram","buckets":[[<ns>,<count>],...]} or
+ * as "histogram,<ns>,<count>" rows, where <ns> is the lower bound of the bucket (0 for the first
+ * one). */
+
+typedef enum {
+    TELEMETRY_JSON,
+    TELEMETRY_CSV,
+
+    TELEMETRY_FORMAT_COUNT,
+} TelemetryFormat;
+
+extern const char *telemetry_format_names[TELEMETRY_FORMAT_COUNT];
+
+/* Bucket i counts the calls that took [2^i, 2^(i + 1)) nanoseconds, except that the first bucket
+ * starts at 0 and the last one is open ended */
+#define HISTOGRAM_BUCKETS 40
+
+static inline uint64_t histogram_bucket_low(uint32_t bucket) {
+    return bucket == 0 ? 0 : 1ULL << bucket;
+}
+
+typedef struct {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+static inline void histogram_add(Histogram *histogram, uint64_t duration_ns) {
+    uint32_t bucket = duration_ns == 0 ? 0 : 63 - (uint32_t)__builtin_clzll(duration_ns);
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+
+    /* There is only one writer */
+    atomic_store_explicit(&histogram->counts[bucket],
+                          atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+void histogram_print(Histogram *histogram, FILE *file);
+
+/* All times are in seconds, the rate covers the time since the previous record */
+typedef struct {
+    double timestamp;
+    double elapsed;
+    uint64_t bytes;
+    double rate;
+    double average;
+    /* Time spent in transfer calls since the previous record, which includes the stalls */
+    double call_time;
+    /* Time spent waiting for the producer to write or the consumer to read. Only known for a
+     * direct splice between pipes. */
+    double producer_stall;
+    double consumer_stall;
+} TelemetryRecord;
+
+typedef struct {
+    int fd;
+    TelemetryFormat format;
+} Telemetry;
+
+/* 'target' is either a file, "unix:<path>" for a unix stream socket or "-" for stderr.
+ * Returns -1 with errno set on failure. */
+int telemetry_open(Telemetry *telemetry, const char *target, TelemetryFormat format);
+void telemetry_close(Telemetry *telemetry);
+
+/* A failed write disables the telemetry for good, so a vanished listener doesn't stop the
+ * transfer */
+void telemetry_record(Telemetry *telemetry, const TelemetryRecord *record);
+void telemetry_histogram(Telemetry *telemetry, Histogram *histogram);
+
+#endif
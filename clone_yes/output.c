@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#define __need_IOV_MAX
+
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+
+/* Every zerocopy send pins its pages until the completion arrives, which is limited by the socket's
+ * optmem. Keep the individual sends reasonably small. */
+#define ZEROCOPY_MAX_REPEAT 16
+
+#define RING_ENTRIES 16
+/* Writes are linked, so they are executed in order. A short write cancels the rest of the chain. */
+#define RING_LINKED_WRITES 8
+#define RING_NOT_COMPLETED INT32_MIN
+
+const char *output_kind_names[OUTPUT_KIND_COUNT] = {
+    [OUTPUT_AUTO] = "auto",
+    [OUTPUT_VMSPLICE] = "vmsplice",
+    [OUTPUT_SPLICE] = "splice",
+    [OUTPUT_COPY_FILE_RANGE] = "copy_file_range",
+    [OUTPUT_SENDFILE] = "sendfile",
+    [OUTPUT_ZEROCOPY] = "zerocopy",
+    [OUTPUT_IO_URING] = "io_uring",
+    [OUTPUT_WRITE] = "write",
+};
+
+OutputKind output_kind_from_name(const char *name) {
+    for (uint32_t kind = 0; kind < OUTPUT_KIND_COUNT; kind++) {
+        if (strcmp(output_kind_names[kind], name) == 0)
+            return (OutputKind)kind;
+    }
+
+    return OUTPUT_KIND_COUNT;
+}
+
+/* The next best backend, in case the first call fails because the output doesn't support it */
+static OutputKind output_fallback(OutputKind kind) {
+    switch (kind) {
+    case OUTPUT_COPY_FILE_RANGE:
+        return OUTPUT_SENDFILE;
+    default:
+        return OUTPUT_WRITE;
+    }
+}
+
+/* === io_uring ===
+ * A minimal ring on top of the raw system calls. The buffers are registered once, so the kernel
+ * doesn't have to map them for every write (IORING_OP_WRITE_FIXED). */
+
+struct OutputRing {
+    int fd;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_mapping;
+    size_t sq_mapping_size;
+    void *cq_mapping;
+    size_t cq_mapping_size;
+    size_t sqes_size;
+};
+
+static void ring_destroy(struct OutputRing *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_mapping != NULL && ring->cq_mapping != MAP_FAILED &&
+        ring->cq_mapping != ring->sq_mapping)
+        munmap(ring->cq_mapping, ring->cq_mapping_size);
+    if (ring->sq_mapping != NULL && ring->sq_mapping != MAP_FAILED)
+        munmap(ring->sq_mapping, ring->sq_mapping_size);
+
+    close(ring->fd);
+    free(ring);
+}
+
+static struct OutputRing *ring_create(Output *output) {
+    struct io_uring_params params = {0};
+    int fd = (int)syscall(SYS_io_uring_setup, RING_ENTRIES, &params);
+    if (fd == -1)
+        return NULL;
+
+    struct OutputRing *ring = calloc(1, sizeof(*ring));
+    ring->fd = fd;
+    ring->sq_mapping_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_mapping_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Newer kernels map both rings at once */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_mapping_size > ring->sq_mapping_size)
+            ring->sq_mapping_size = ring->cq_mapping_size;
+        ring->cq_mapping_size = ring->sq_mapping_size;
+    }
+
+    ring->sq_mapping = mmap(NULL, ring->sq_mapping_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_mapping == MAP_FAILED)
+        goto fail;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_mapping = ring->sq_mapping;
+    } else {
+        ring->cq_mapping = mmap(NULL, ring->cq_mapping_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_mapping == MAP_FAILED)
+            goto fail;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_mapping, *cq = ring->cq_mapping;
+    ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    struct iovec *iov = calloc(output->buffer_count, sizeof(*iov));
+    for (uint32_t i = 0; i < output->buffer_count; i++) {
+        iov[i].iov_base = output->buffers[i].data;
+        iov[i].iov_len = output->buffers[i].size;
+    }
+
+    long status = syscall(SYS_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov,
+                          output->buffer_count);
+    free(iov);
+
+    if (status == -1)
+        goto fail;
+
+    return ring;
+
+fail:
+    ring_destroy(ring);
+    return NULL;
+}
+
+/* Moves every completion to 'results', indexed by its 'user_data'. Returns how many there were. */
+static uint32_t ring_reap(struct OutputRing *ring, int32_t *results) {
+    uint32_t head = *ring->cq_head, reaped = 0;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        results[cqe->user_data] = cqe->res;
+        reaped++;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return reaped;
+}
+
+/* After a failed submission, the writes that did reach the kernel are waited for, so none of them
+ * lands in the middle of what the fallback writes next. The ring is not used again, which also
+ * drops the entries that never made it to the kernel. If even waiting fails, closing the ring is
+ * all that is left, the kernel then cancels what is still running. */
+static void ring_abandon(Output *output, int32_t *results, uint32_t in_flight) {
+    struct OutputRing *ring = output->ring;
+
+    while (in_flight > 0) {
+        long status =
+            syscall(SYS_io_uring_enter, ring->fd, 0, in_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (status == -1 && errno != EINTR)
+            break;
+
+        uint32_t reaped = ring_reap(ring, results);
+        in_flight -= reaped < in_flight ? reaped : in_flight;
+    }
+
+    ring_destroy(ring);
+    output->ring = NULL;
+    output->kind = output_fallback(OUTPUT_IO_URING);
+}
+
+static ssize_t ring_write(Output *output, OutputBuffer *buffer, struct iovec *iov,
+                          uint32_t iov_count) {
+    struct OutputRing *ring = output->ring;
+    uint32_t count = iov_count < RING_LINKED_WRITES ? iov_count : RING_LINKED_WRITES;
+    uint32_t first = *ring->sq_tail, tail = first;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = output->fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = (uint32_t)iov[i].iov_len;
+        /* Use (and update) the current file position, for pipes and sockets it is ignored */
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = (uint16_t)(buffer - output->buffers);
+        sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+        sqe->user_data = i;
+
+        ring->sq_array[index] = index;
+        tail++;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* Writes that never completed count as failed with the error of the submission */
+    int32_t results[RING_LINKED_WRITES];
+    uint32_t submitted = 0, completed = 0;
+    int error = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+        results[i] = RING_NOT_COMPLETED;
+
+    /* Once submitted, every write has to be reaped, even if we got interrupted */
+    while (completed < count) {
+        long status = syscall(SYS_io_uring_enter, ring->fd, count - submitted, count - completed,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+        if (status == -1 && errno != EINTR) {
+            /* The kernel's head tells how many entries it took, whatever it returned */
+            error = errno;
+            uint32_t taken = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) - first;
+            completed += ring_reap(ring, results);
+            ring_abandon(output, results, taken > completed ? taken - completed : 0);
+            break;
+        }
+        if (status > 0)
+            submitted += (uint32_t)status;
+
+        completed += ring_reap(ring, results);
+    }
+
+    ssize_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t expected = iov[i].iov_len;
+        int32_t result = results[i] == RING_NOT_COMPLETED ? -error : results[i];
+
+        if (result < 0) {
+            if (total > 0)
+                break;
+            errno = -result;
+            return -1;
+        }
+
+        total += result;
+        if ((size_t)result < expected)
+            break;
+    }
+
+    return total;
+}
+
+/* === MSG_ZEROCOPY ===
+ * See: https://www.kernel.org/doc/html/latest/networking/msg_zerocopy.html */
+
+static int zerocopy_enable(int fd) {
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+/* Reads all completion notifications from the error queue. With 'block', waits for at least one */
+static void zerocopy_reap(Output *output, uint8_t block) {
+    while (1) {
+        char control[128];
+        struct msghdr message = {.msg_control = control, .msg_controllen = sizeof(control)};
+
+        if (recvmsg(output->fd, &message, MSG_ERRQUEUE) == -1) {
+            if (errno == EAGAIN && block) {
+                /* POLLERR is always reported */
+                struct pollfd pollfd = {.fd = output->fd};
+                poll(&pollfd, 1, -1);
+                continue;
+            }
+
+            return;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* [ee_info, ee_data] is the range of completed sends */
+            if ((int32_t)(error->ee_data + 1 - output->zerocopy_completed) > 0)
+                output->zerocopy_completed = error->ee_data + 1;
+        }
+
+        block = 0;
+    }
+}
+
+static ssize_t zerocopy_write(Output *output, OutputBuffer *buffer, struct iovec *iov,
+                              uint32_t iov_count) {
+    struct msghdr message = {
+        .msg_iov = iov,
+        .msg_iovlen = iov_count < ZEROCOPY_MAX_REPEAT ? iov_count : ZEROCOPY_MAX_REPEAT,
+    };
+
+    while (1) {
+        ssize_t written = sendmsg(output->fd, &message, MSG_ZEROCOPY);
+
+        /* Too many sends are waiting for their completion */
+        if (written == -1 && errno == ENOBUFS) {
+            zerocopy_reap(output, 1);
+            continue;
+        }
+
+        if (written > 0) {
+            buffer->zerocopy_sequence = output->zerocopy_next++;
+            buffer->is_pending = 1;
+        }
+
+        return written;
+    }
+}
+
+/* === Output === */
+
+static OutputKind output_pick(Output *output, OutputKind kind) {
+    struct stat output_stat;
+
+    if (fstat(output->fd, &output_stat) == -1)
+        return OUTPUT_WRITE;
+
+    output->is_socket = S_ISSOCK(output_stat.st_mode);
+
+    if (kind == OUTPUT_AUTO) {
+        if (S_ISFIFO(output_stat.st_mode))
+            kind = OUTPUT_VMSPLICE;
+        else if (S_ISREG(output_stat.st_mode))
+            kind = OUTPUT_COPY_FILE_RANGE;
+        else if (S_ISSOCK(output_stat.st_mode))
+            kind = OUTPUT_ZEROCOPY;
+        else
+            kind = OUTPUT_WRITE;
+    }
+
+    if (kind == OUTPUT_ZEROCOPY && zerocopy_enable(output->fd) == -1)
+        kind = OUTPUT_SENDFILE;
+
+    if (kind == OUTPUT_IO_URING && (output->ring = ring_create(output)) == NULL)
+        kind = OUTPUT_WRITE;
+
+    /* Without a memfd, there is nothing to copy from */
+    if (output->memfd == -1 && (kind == OUTPUT_SPLICE || kind == OUTPUT_COPY_FILE_RANGE ||
+                                kind == OUTPUT_SENDFILE))
+        kind = OUTPUT_WRITE;
+
+    return kind;
+}
+
+int output_init(Output *output, int fd, OutputKind kind, size_t buffer_size,
+                uint32_t buffer_count) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t rounded_size = (buffer_size + page_size - 1) / page_size * page_size;
+
+    memset(output, 0, sizeof(*output));
+    output->fd = fd;
+    output->buffer_count = buffer_count;
+    output->mapping_size = rounded_size * buffer_count;
+    output->memfd = memfd_create("yes_vmsplice", MFD_CLOEXEC);
+
+    if (output->memfd != -1 && ftruncate(output->memfd, (off_t)output->mapping_size) == 0) {
+        output->mapping = mmap(NULL, output->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                               output->memfd, 0);
+    } else {
+        if (output->memfd != -1)
+            close(output->memfd);
+        output->memfd = -1;
+        output->mapping = mmap(NULL, output->mapping_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (output->mapping == MAP_FAILED)
+        return -1;
+
+    output->buffers = calloc(buffer_count, sizeof(*output->buffers));
+    for (uint32_t i = 0; i < buffer_count; i++) {
+        output->buffers[i].data = output->mapping + i * rounded_size;
+        output->buffers[i].size = buffer_size;
+        output->buffers[i].file_offset = (off_t)(i * rounded_size);
+    }
+
+    output->kind = output_pick(output, kind);
+
+    return 0;
+}
+
+void output_destroy(Output *output) {
+    for (uint32_t i = 0; i < output->buffer_count; i++)
+        output_acquire(output, &output->buffers[i]);
+
+    if (output->ring != NULL)
+        ring_destroy(output->ring);
+
+    munmap(output->mapping, output->mapping_size);
+    if (output->memfd != -1)
+        close(output->memfd);
+    free(output->buffers);
+}
+
+void output_acquire(Output *output, OutputBuffer *buffer) {
+    /* A socket keeps referencing the pages passed to sendfile, until the receiver consumed them.
+     * There is no way to tell when that happened, so buffers that change can't use it. */
+    if (output->kind == OUTPUT_SENDFILE && output->is_socket)
+        output->kind = OUTPUT_WRITE;
+
+    if (!buffer->is_pending)
+        return;
+
+    if (output->kind == OUTPUT_ZEROCOPY) {
+        while ((int32_t)(output->zerocopy_completed - buffer->zerocopy_sequence) <= 0)
+            zerocopy_reap(output, 1);
+    }
+
+    buffer->is_pending = 0;
+}
+
+/* Splits 'length' bytes of the endlessly repeated buffer, starting at 'offset', into at most
+ * IOV_MAX pieces */
+static uint32_t output_fill_iov(OutputBuffer *buffer, size_t offset, size_t length,
+                                struct iovec *iov) {
+    uint32_t iov_count = 0;
+
+    while (length > 0 && iov_count < IOV_MAX) {
+        size_t piece = buffer->size - offset < length ? buffer->size - offset : length;
+
+        iov[iov_count].iov_base = buffer->data + offset;
+        iov[iov_count].iov_len = piece;
+        iov_count++;
+
+        length -= piece;
+        offset = 0;
+    }
+
+    return iov_count;
+}
+
+static ssize_t output_write_kind(Output *output, OutputBuffer *buffer, size_t offset,
+                                 size_t length) {
+    static struct iovec iov[IOV_MAX];
+    uint32_t iov_count = 0;
+    loff_t file_offset = buffer->file_offset + (loff_t)offset;
+
+    if (output->kind == OUTPUT_VMSPLICE || output->kind == OUTPUT_WRITE ||
+        output->kind == OUTPUT_ZEROCOPY || output->kind == OUTPUT_IO_URING)
+        iov_count = output_fill_iov(buffer, offset, length, iov);
+
+    /* The others copy a single range of the memfd */
+    if (length > buffer->size - offset)
+        length = buffer->size - offset;
+
+    switch (output->kind) {
+    case OUTPUT_VMSPLICE:
+        return vmsplice(output->fd, iov, iov_count, 0);
+    case OUTPUT_SPLICE:
+        return splice(output->memfd, &file_offset, output->fd, NULL, length, SPLICE_F_MORE);
+    case OUTPUT_COPY_FILE_RANGE:
+        return copy_file_range(output->memfd, &file_offset, output->fd, NULL, length, 0);
+    case OUTPUT_SENDFILE:
+        return sendfile(output->fd, output->memfd, &file_offset, length);
+    case OUTPUT_ZEROCOPY:
+        return zerocopy_write(output, buffer, iov, iov_count);
+    case OUTPUT_IO_URING:
+        return ring_write(output, buffer, iov, iov_count);
+    default:
+        return writev(output->fd, iov, (int)iov_count);
+    }
+}
+
+ssize_t output_write(Output *output, OutputBuffer *buffer, size_t offset, size_t length) {
+    while (1) {
+        ssize_t written = output_write_kind(output, buffer, offset, length);
+
+        if (written > 0)
+            output->has_written = 1;
+
+        /* These tell us, that the backend does not work for this kind of output at all */
+        if (written == -1 && !output->has_written && output->kind != OUTPUT_WRITE &&
+            (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+             errno == EBADF || errno == ESPIPE)) {
+            output->kind = output_fallback(output->kind);
+            continue;
+        }
+
+        return written;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Output backends for the yes generator. All buffers are carved out of a single memfd, so the
+ * backends that copy from a file descriptor (splice, copy_file_range, sendfile) can use the very
+ * same pages the generator renders into. */
+
+typedef enum {
+    /* Picked by the type of the output, see 'output_init()' */
+    OUTPUT_AUTO,
+    OUTPUT_VMSPLICE,
+    OUTPUT_SPLICE,
+    OUTPUT_COPY_FILE_RANGE,
+    OUTPUT_SENDFILE,
+    OUTPUT_ZEROCOPY,
+    OUTPUT_IO_URING,
+    OUTPUT_WRITE,
+
+    OUTPUT_KIND_COUNT,
+} OutputKind;
+
+typedef struct {
+    char *data;
+    size_t size;
+    /* Offset of 'data' in the memfd */
+    off_t file_offset;
+    /* The kernel might still reference the pages after the last write returned, see
+     * 'output_acquire()' */
+    uint8_t is_pending;
+    /* Sequence number of the last zerocopy send that used this buffer */
+    uint32_t zerocopy_sequence;
+} OutputBuffer;
+
+typedef struct {
+    int fd;
+    OutputKind kind;
+    /* Backends only fall back, until the first write succeeded */
+    uint8_t has_written;
+    uint8_t is_socket;
+
+    int memfd;
+    char *mapping;
+    size_t mapping_size;
+    OutputBuffer *buffers;
+    uint32_t buffer_count;
+
+    /* MSG_ZEROCOPY: Every successful send gets the next sequence number, completions arrive as
+     * ranges on the error queue */
+    uint32_t zerocopy_next;
+    uint32_t zerocopy_completed;
+
+    struct OutputRing *ring;
+} Output;
+
+extern const char *output_kind_names[OUTPUT_KIND_COUNT];
+
+/* Returns OUTPUT_KIND_COUNT for unknown names */
+OutputKind output_kind_from_name(const char *name);
+
+/* Sets up 'buffer_count' page aligned buffers of 'buffer_size' bytes each. OUTPUT_AUTO picks a
+ * backend by the type of 'fd': vmsplice for pipes, copy_file_range for regular files, zerocopy
+ * sends for sockets that support it (sendfile otherwise) and write for everything else.
+ * Returns -1 if the buffers could not be set up. */
+int output_init(Output *output, int fd, OutputKind kind, size_t buffer_size,
+                uint32_t buffer_count);
+void output_destroy(Output *output);
+
+/* Waits until the contents of the buffer may be changed. Has to be called before every change,
+ * including the first one. Only zerocopy sends are tracked, vmsplice and splice into a pipe are
+ * not, see 'run_counter()' in 'yes_vmsplice.c'. */
+void output_acquire(Output *output, OutputBuffer *buffer);
+
+/* Writes up to 'length' bytes of the buffer, starting at 'offset' and wrapping around at its end
+ * for backends that can take several pieces in a single call. Returns the number of bytes written,
+ * which might be less than requested, or -1 with errno set. EINTR is passed on to the caller.
+ * If the chosen backend turns out not to work for this output on the first call, the next best
+ * one is used instead. */
+ssize_t output_write(Output *output, OutputBuffer *buffer, size_t offset, size_t length);
+
+#endif
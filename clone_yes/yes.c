@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -8,22 +9,38 @@ int main(int argc, char **argv) {
     char *msg = NULL;
 
     if(argc <= 1)
-        msg = "yes\n";
+        msg = "y";
     else
         msg = argv[1];
 
-    size_t msg_size = strlen(*argv);
+    /* Every repetition ends with a newline */
+    size_t msg_size = strlen(msg) + 1;
 
     const size_t buffer_nmemb = 2 * PAGE_SIZE;
     const size_t buffer_total_size = buffer_nmemb * msg_size;
-    void *buffer = malloc(buffer_total_size);
-
-    size_t buffer_index = 0;
-    while(buffer_index++ < buffer_nmemb)
-        memcpy(buffer + buffer_index * msg_size, msg, msg_size);
-
-    while(1)
-        write(1, buffer, buffer_total_size);
+    char *buffer = malloc(buffer_total_size);
+
+    for(size_t buffer_index = 0; buffer_index < buffer_nmemb; buffer_index++) {
+        memcpy(buffer + buffer_index * msg_size, msg, msg_size - 1);
+        buffer[(buffer_index + 1) * msg_size - 1] = '\n';
+    }
+
+    /* A short write, e.g. after a signal or to anything that is not a pipe, is continued where it
+     * stopped, so no line is cut off */
+    size_t done = 0;
+    for(;;) {
+        ssize_t written = write(1, buffer + done, buffer_total_size - done);
+        if(written == -1 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            break;
+
+        done += (size_t)written;
+        if(done == buffer_total_size)
+            done = 0;
+    }
+
+    free(buffer);
 
     return EXIT_SUCCESS;
 }
@@ -1,51 +1,521 @@
 #define _GNU_SOURCE
 #define __need_IOV_MAX
 
+#include "output.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
-#include <stdlib.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
 
 #define PIPESIZE (1 * 1024 * 1024)
-#define VM_SIZE PIPESIZE
 #define VM_LIMIT IOV_MAX
 
-#define BUFFER_SIZE PIPESIZE
+/* Width of the zero padded line counter, enough for 2^53 lines */
+#define COUNTER_DIGITS 16
+/* See 'run_counter()' */
+#define RENDER_BUFFERS 3
+
+/* See 'pace()' */
+#define PACE_CHUNK_NS (1000 * 1000)
+#define PACE_BURST_NS (50 * 1000 * 1000)
+#define PACE_SPIN_NS (100 * 1000)
 
 // Thanks a lot to this thread...
 // https://www.reddit.com/r/unix/comments/6gxduc/comment/diua761/?context=8&depth=9
 
-int main(int argc, char **argv) {
-    char *msg = NULL;
+/* Usage: yes_vmsplice [-n] [-b backend] [--bytes N] [--rate R] [--duration T] [-l line]...
+ *                     [-f template] [string...]
+ * - Without any options, this behaves like yes(1): The arguments are joined by spaces
+ * - '-l' adds a line to the template, '-f' adds every line of a file. The template is repeated
+ *   line by line.
+ * - '-n' stamps every line with a counter, that keeps increasing across repetitions
+ * - '-b' selects the output backend (see 'output.h'), by default it is picked by the type of
+ *   stdout. Backends that turn out not to work for stdout fall back to the next best one.
+ * - '--bytes' ('-c') stops after exactly N bytes, '--duration' ('-d') after T seconds and
+ *   '--rate' ('-r') limits the output to R bytes per second. Sizes take the same suffixes as
+ *   head(1): K, M, G and T are powers of 1024, KB, MB, GB and TB powers of 1000.
+ * The achieved throughput is reported on stderr once stdout is closed or on SIGINT/SIGTERM. */
 
-    if(argc <= 1)
-        msg = "y\n";
-    else
-        msg = argv[1];
+typedef struct {
+    char *data;
+    size_t length;
+} Line;
+
+typedef struct {
+    Line *lines;
+    uint32_t count;
+    /* The length of all lines combined */
+    size_t length;
+} Template;
+
+static struct {
+    Output output;
+    size_t pipe_size;
+
+    uint64_t bytes_total;
+    uint64_t start_ns;
+
+    /* Zero means unlimited */
+    uint64_t byte_limit;
+    uint64_t duration_ns;
+    double rate;
+
+    /* Token bucket, see 'pace()' */
+    double tokens;
+    double chunk;
+    double burst;
+    uint64_t refill_ns;
+    /* How far the output fell behind the ideal schedule, in seconds */
+    double max_lag;
+} state;
+
+static volatile sig_atomic_t is_running = 1;
+
+static void handle_stop_signal(int signal) { is_running = 0; }
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+/* Parses sizes like '2G' or '1.5MB', see the usage above. Returns -1 for anything else. */
+static double parse_size(const char *text) {
+    static const char units[] = "KMGT";
+    char *end;
+    double size = strtod(text, &end);
+
+    if (end == text || size < 0)
+        return -1;
+
+    if (*end != '\0') {
+        const char *unit = strchr(units, toupper((unsigned char)*end++));
+        if (unit == NULL)
+            return -1;
+
+        double base = 1024;
+        if (*end == 'B') {
+            base = 1000;
+            end++;
+        }
+
+        for (const char *power = units; power <= unit; power++)
+            size *= base;
+    }
+
+    return *end == '\0' ? size : -1;
+}
+
+static void template_add_line(Template *template, const char *data, size_t length) {
+    template->lines = realloc(template->lines, (template->count + 1) * sizeof(*template->lines));
+
+    /* Every line ends with a newline */
+    Line *line = &template->lines[template->count++];
+    line->data = malloc(length + 1);
+    line->length = length + 1;
+    memcpy(line->data, data, length);
+    line->data[length] = '\n';
+
+    template->length += line->length;
+}
+
+static void template_add_file(Template *template, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "error: Failed to open '%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
 
-    size_t msg_size = 0;
-    char *msg_index = msg;
-    while (*(msg_index++) != '\0') msg_size++;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
 
-    const size_t buffer_total_size = BUFFER_SIZE;
-    const size_t buffer_nmemb = ((size_t)buffer_total_size / (size_t)msg_size);
-    void *buffer = malloc(buffer_total_size);
+    while ((length = getline(&line, &capacity, file)) != -1) {
+        if (length > 0 && line[length - 1] == '\n')
+            length--;
+        template_add_line(template, line, (size_t)length);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+/* yes(1) joins all arguments into a single line */
+static void template_add_arguments(Template *template, int argc, char **argv) {
+    size_t length = 0;
+    for (int i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+
+    char *line = malloc(length);
+    size_t offset = 0;
+
+    for (int i = 0; i < argc; i++) {
+        size_t argument_length = strlen(argv[i]);
+        memcpy(line + offset, argv[i], argument_length);
+        offset += argument_length;
+        line[offset++] = ' ';
+    }
+
+    template_add_line(template, line, length - 1);
+    free(line);
+}
+
+static void setup_pipe(void) {
+    struct stat output_stat;
+    state.pipe_size = PIPESIZE;
+
+    if (fstat(1, &output_stat) == -1) {
+        fprintf(stderr, "error: Failed to stat stdout: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (S_ISFIFO(output_stat.st_mode)) {
+        fcntl(1, F_SETPIPE_SZ, PIPESIZE);
+
+        int pipe_size = fcntl(1, F_GETPIPE_SZ);
+        if (pipe_size > 0)
+            state.pipe_size = (size_t)pipe_size;
+    }
+}
 
-    size_t buffer_index = 0;
-    while(buffer_index++ < buffer_nmemb)
-        memcpy(buffer + msg_size * buffer_index, msg, msg_size);
+static void setup_output(OutputKind kind, size_t buffer_size, uint32_t buffer_count) {
+    if (output_init(&state.output, 1, kind, buffer_size, buffer_count) == -1) {
+        fprintf(stderr, "error: Failed to set up the output buffers: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* Sleeps until shortly before 'deadline' and spins for the rest, since waking up from a sleep
+ * takes tens of microseconds. Returns 0 if a stop signal arrived in the meantime. */
+static uint8_t wait_until(uint64_t deadline) {
+    if (deadline > now_ns() + PACE_SPIN_NS) {
+        uint64_t wakeup_ns = deadline - PACE_SPIN_NS;
+        struct timespec wakeup = {.tv_sec = (time_t)(wakeup_ns / 1000000000ULL),
+                                  .tv_nsec = (long)(wakeup_ns % 1000000000ULL)};
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR) {
+            if (!is_running)
+                return 0;
+        }
+    }
+
+    while (is_running && now_ns() < deadline)
+        ;
+
+    return is_running;
+}
 
-    fcntl(1, F_SETPIPE_SZ, PIPESIZE);
+static void pace_refill(uint64_t now) {
+    state.tokens += (double)(now - state.refill_ns) * state.rate / 1e9;
+    if (state.tokens > state.burst)
+        state.tokens = state.burst;
 
-    // Populate IOV buffers
-    struct iovec iov_array[VM_LIMIT];
-    for(int i = 0; i < VM_LIMIT; i++) {
-        iov_array[i].iov_base = buffer;
-        iov_array[i].iov_len = buffer_total_size;
+    state.refill_ns = now;
+}
+
+/* Returns how many of the next 'length' bytes may be written right now, or 0 once the byte limit
+ * or the duration is reached.
+ * The rate is enforced with a token bucket: Tokens accumulate at 'rate' bytes per second and every
+ * byte written takes one. A write covers at most PACE_CHUNK_NS worth of bytes and waits until
+ * there are enough tokens for it. The bucket holds PACE_BURST_NS worth of tokens, so a stalled
+ * reader can be caught up with, without getting far ahead of the schedule afterwards. */
+static size_t pace(size_t length) {
+    uint64_t now = now_ns();
+    uint64_t end_ns = state.start_ns + state.duration_ns;
+
+    if (state.duration_ns != 0 && now >= end_ns)
+        return 0;
+    if (state.byte_limit != 0 && state.byte_limit - state.bytes_total < length)
+        length = (size_t)(state.byte_limit - state.bytes_total);
+    if (length == 0 || state.rate == 0)
+        return length;
+
+    if ((double)length > state.chunk)
+        length = (size_t)state.chunk;
+
+    pace_refill(now);
+    if (state.tokens < (double)length) {
+        uint64_t deadline = now + (uint64_t)(((double)length - state.tokens) / state.rate * 1e9);
+
+        /* The bytes would be late anyway */
+        if (state.duration_ns != 0 && deadline > end_ns) {
+            wait_until(end_ns);
+            return 0;
+        }
+
+        if (!wait_until(deadline))
+            return 0;
+        pace_refill(now_ns());
     }
 
-    while(vmsplice(1, iov_array, VM_LIMIT, 0));
+    return length;
+}
+
+static void pace_consume(size_t written) {
+    if (state.rate == 0)
+        return;
+
+    state.tokens -= (double)written;
+
+    double lag = (double)(now_ns() - state.start_ns) / 1e9 - (double)state.bytes_total / state.rate;
+    if (lag > state.max_lag)
+        state.max_lag = lag;
+}
+
+/* Writes up to 'length' bytes of the buffer, starting at 'offset' and wrapping around at its end
+ * (see 'output_write()'). Returns the number of bytes written, or 0 if writing should stop. */
+static size_t write_buffer(OutputBuffer *buffer, size_t offset, size_t length) {
+    while (is_running) {
+        length = pace(length);
+        if (length == 0)
+            break;
+
+        ssize_t written = output_write(&state.output, buffer, offset, length);
+
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+
+        state.bytes_total += (uint64_t)written;
+        pace_consume((size_t)written);
+        return (size_t)written;
+    }
+
+    is_running = 0;
+    return 0;
+}
+
+/* The template is repeated as often as it fits into one pipe sized buffer. The buffer never
+ * changes, so the same pages can be handed to the output over and over again. */
+static void run_static(Template *template, OutputKind kind) {
+    size_t repetitions = state.pipe_size / template->length;
+    if (repetitions == 0)
+        repetitions = 1;
+
+    setup_output(kind, repetitions * template->length, 1);
+    OutputBuffer *buffer = &state.output.buffers[0];
+
+    for (size_t i = 0, offset = 0; i < repetitions; i++) {
+        for (uint32_t j = 0; j < template->count; j++) {
+            memcpy(buffer->data + offset, template->lines[j].data, template->lines[j].length);
+            offset += template->lines[j].length;
+        }
+    }
+
+    /* A partial transfer has to be continued where it stopped, so the stream stays intact */
+    size_t offset = 0, written;
+    do {
+        written = write_buffer(buffer, offset, (size_t)VM_LIMIT * buffer->size);
+        offset = (offset + written) % buffer->size;
+    } while (written > 0);
+}
+
+static inline void counter_increment(char *digits) {
+    for (int i = COUNTER_DIGITS - 1; i >= 0; i--) {
+        if (digits[i] != '9') {
+            digits[i]++;
+            return;
+        }
+
+        digits[i] = '0';
+    }
+}
+
+/* Fills the buffer with as many whole lines as possible and returns the number of bytes used */
+static size_t render_counter_lines(char *buffer, size_t size, Template *template,
+                                   uint32_t *line_index, char *digits) {
+    size_t offset = 0;
+
+    while (1) {
+        Line *line = &template->lines[*line_index];
+        if (offset + COUNTER_DIGITS + 1 + line->length > size)
+            break;
+
+        memcpy(buffer + offset, digits, COUNTER_DIGITS);
+        buffer[offset + COUNTER_DIGITS] = ' ';
+        memcpy(buffer + offset + COUNTER_DIGITS + 1, line->data, line->length);
+        offset += COUNTER_DIGITS + 1 + line->length;
+
+        counter_increment(digits);
+        *line_index = (*line_index + 1) % template->count;
+    }
+
+    return offset;
+}
+
+/* Every line is different, so the buffers have to be rendered over and over again. A buffer that
+ * was handed to vmsplice must not be touched until the reader is done with it. Once a full pipe
+ * worth of data has been spliced after it, its pages have left the pipe. With three buffers that
+ * each hold at least half a pipe, that is the case by the time we get back to it.
+ * Zerocopy sends are tracked explicitly, see 'output_acquire()'.
+ * NOTE: A reader that splices the pages somewhere else still references them. This is fine for
+ * the usual consumers (/dev/null, sockets, files), but not for a reader that keeps them in
+ * another pipe. */
+static void run_counter(Template *template, OutputKind kind) {
+    size_t size = state.pipe_size;
+    for (uint32_t i = 0; i < template->count; i++) {
+        if (COUNTER_DIGITS + 1 + template->lines[i].length > size / 2) {
+            fprintf(stderr, "error: Lines have to be shorter than %zu bytes\n",
+                    size / 2 - COUNTER_DIGITS - 1);
+            exit(1);
+        }
+    }
+
+    setup_output(kind, size, RENDER_BUFFERS);
+
+    char digits[COUNTER_DIGITS];
+    memset(digits, '0', sizeof(digits));
+    uint32_t line_index = 0;
+
+    for (uint32_t current = 0; is_running; current = (current + 1) % RENDER_BUFFERS) {
+        OutputBuffer *buffer = &state.output.buffers[current];
+        output_acquire(&state.output, buffer);
+        buffer->size = render_counter_lines(buffer->data, size, template, &line_index, digits);
+
+        for (size_t offset = 0; offset < buffer->size;) {
+            size_t written = write_buffer(buffer, offset, buffer->size - offset);
+            if (written == 0)
+                break;
+
+            offset += written;
+        }
+    }
+}
+
+static void report(void) {
+    double seconds = (double)(now_ns() - state.start_ns) / 1e9;
+    double rate = seconds > 0 ? (double)state.bytes_total / seconds : 0.0;
+
+    fprintf(stderr, "%llu bytes in %.2f s, %.2f GB/s (%s)", (unsigned long long)state.bytes_total,
+            seconds, rate / 1e9, output_kind_names[state.output.kind]);
+
+    if (state.rate != 0) {
+        static const char *units[] = {"B/s", "kB/s", "MB/s", "GB/s"};
+        double target = state.rate;
+        uint32_t unit = 0;
+
+        while (target >= 1000 && unit < 3) {
+            target /= 1000;
+            unit++;
+        }
+
+        fprintf(stderr, ", target %.3f %s, deviation %+.3f%%, max lag %.3f ms", target,
+                units[unit], (rate - state.rate) / state.rate * 100, state.max_lag * 1e3);
+    }
+
+    fputc('\n', stderr);
+}
+
+static double parse_option_size(const char *name, const char *text) {
+    double size = parse_size(text);
+    if (size <= 0) {
+        fprintf(stderr, "error: Invalid %s '%s'\n", name, text);
+        exit(1);
+    }
+
+    return size;
+}
+
+int main(int argc, char **argv) {
+    Template template = {0};
+    OutputKind kind = OUTPUT_AUTO;
+    uint8_t use_counter = 0;
+    int option;
+
+    static const struct option long_options[] = {
+        {"bytes", required_argument, NULL, 'c'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {0},
+    };
+
+    while ((option = getopt_long(argc, argv, "nb:c:r:d:l:f:", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'n':
+            use_counter = 1;
+            break;
+        case 'b':
+            kind = output_kind_from_name(optarg);
+            if (kind == OUTPUT_KIND_COUNT) {
+                fprintf(stderr, "error: Unknown backend '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            state.byte_limit = (uint64_t)parse_option_size("byte count", optarg);
+            break;
+        case 'r':
+            state.rate = parse_option_size("rate", optarg);
+            break;
+        case 'd': {
+            char *end;
+            double seconds = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || seconds <= 0) {
+                fprintf(stderr, "error: Invalid duration '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+
+            state.duration_ns = (uint64_t)(seconds * 1e9);
+            break;
+        }
+        case 'l':
+            template_add_line(&template, optarg, strlen(optarg));
+            break;
+        case 'f':
+            template_add_file(&template, optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-n] [-b backend] [--bytes N] [--rate R] [--duration T] "
+                    "[-l line]... [-f template] [string...]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc)
+        template_add_arguments(&template, argc - optind, argv + optind);
+    if (template.count == 0)
+        template_add_line(&template, "y", 1);
+
+    struct sigaction action = {.sa_handler = handle_stop_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    /* A closed stdout shows up as EPIPE, so we still get to report */
+    signal(SIGPIPE, SIG_IGN);
+
+    setup_pipe();
+
+    /* At least a byte per write, the bucket starts out empty */
+    state.chunk = state.rate * PACE_CHUNK_NS / 1e9;
+    if (state.chunk < 1)
+        state.chunk = 1;
+    state.burst = state.rate * PACE_BURST_NS / 1e9;
+    if (state.burst < state.chunk)
+        state.burst = state.chunk;
+
+    state.start_ns = now_ns();
+    state.refill_ns = state.start_ns;
+
+    if (use_counter)
+        run_counter(&template, kind);
+    else
+        run_static(&template, kind);
+
+    report();
+    output_destroy(&state.output);
 
     return EXIT_SUCCESS;
 }
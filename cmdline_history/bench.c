@@ -0,0 +1,820 @@
+#define _GNU_SOURCE
+
+#include "history.h"
+#include "search.h"
+#include "suggest.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+/* Usage: bench load|search|suggest|dedup [entries]...
+ *        bench replay <program>
+ * load: Writes a history file with the given number of entries and measures how long loading it
+ *       takes and how much memory that costs, compared to reading the same history from a plain
+ *       text file line by line. Every measurement runs in a fresh process. The files are left in
+ *       /tmp.
+ * search: Measures the reverse search on a history of the given size. Every pattern is typed one
+ *       character at a time, followed by repeated Ctrl-R, and compared to scanning the history
+ *       with memmem().
+ * suggest: Measures the autosuggestion on a history of the given size. Every prefix is typed one
+ *       character at a time and compared to scanning the history for the newest entry that starts
+ *       with it.
+ * dedup: Submits the given number of lines, which mostly repeat a small set of commands, with and
+ *       without deduplication. Measures how long every submit takes (including the update of the
+ *       search index) and what the history holds and costs afterwards. Every mode runs in a fresh
+ *       process.
+ * replay: Runs the line editor in a pty and replays a scripted session: Typing commands key by
+ *       key, browsing the history, searching and pasting long lines (bracketed, if the editor
+ *       enables it). Every key is sent with its own write once the editor has read the previous
+ *       one, like a terminal would. Reports what the editor did for it, as counted in
+ *       /proc/<pid>/io, and how much of it reached the terminal. */
+
+#define BENCH_ARENA_SIZE (64 << 20)
+#define BENCH_SEARCH_REPEATS 100
+#define BENCH_SEARCH_ADDS 100000
+/* Same as the shell */
+#define BENCH_DEDUP_ENTRIES (1 << 17)
+#define BENCH_DEDUP_ARENA_SIZE (16 << 20)
+#define BENCH_DEDUP_COMMANDS 2000
+/* Percentage of submits that are new lines, like commit messages */
+#define BENCH_DEDUP_UNIQUE 5
+#define BENCH_REPLAY_COMMANDS 100
+#define BENCH_REPLAY_PASTE_LENGTH 4000
+#define BENCH_REPLAY_DONE "replay-done"
+
+typedef struct {
+    long anonymous_kb;
+    long file_kb;
+} Memory;
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+static Memory memory_read(void) {
+    Memory memory = {0};
+    char line[256];
+
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file == NULL)
+        return memory;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        sscanf(line, "RssAnon: %ld", &memory.anonymous_kb);
+        sscanf(line, "RssFile: %ld", &memory.file_kb);
+    }
+
+    fclose(file);
+    return memory;
+}
+
+/* Something that looks like a shell history, with lines of different lengths */
+static int command_format(char *buffer, size_t size, uint32_t index) {
+    switch (index % 4) {
+    case 0:
+        return snprintf(buffer, size, "git commit -m 'Fix the thing number %u'", index);
+    case 1:
+        return snprintf(buffer, size, "make -j%u bench", index % 64);
+    case 2:
+        return snprintf(buffer, size, "cd ~/src/project_%u && ls -la", index % 1000);
+    default:
+        return snprintf(buffer, size, "grep -rn 'pattern_%u' --include='*.c' .", index);
+    }
+}
+
+static void bench_generate(const char *path, const char *text_path, uint32_t count) {
+    History history;
+    char command[256];
+
+    unlink(path);
+    if (history_init(&history, count, BENCH_ARENA_SIZE) == -1 ||
+        history_load(&history, path) == -1) {
+        perror("error: Failed to create the history file");
+        exit(1);
+    }
+
+    FILE *text = fopen(text_path, "w");
+    if (text == NULL) {
+        perror("error: Failed to create the text file");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        int length = command_format(command, sizeof(command), i);
+        history_add(&history, command, (uint32_t)length);
+        fprintf(text, "%s\n", command);
+    }
+
+    fclose(text);
+    history_destroy(&history);
+}
+
+static void bench_load(const char *path, uint32_t count) {
+    History history;
+    char expected[256];
+
+    Memory before = memory_read();
+    uint64_t start = now_ns();
+
+    if (history_init(&history, count, BENCH_ARENA_SIZE) == -1 ||
+        history_load(&history, path) == -1) {
+        perror("error: Failed to load the history file");
+        exit(1);
+    }
+
+    uint64_t duration = now_ns() - start;
+    Memory after = memory_read();
+
+    /* Make sure everything made it */
+    HistoryEntry newest = history_get(&history, history.next - 1);
+    int length = command_format(expected, sizeof(expected), count - 1);
+    if (history_count(&history) != count || newest.length != (uint32_t)length ||
+        memcmp(newest.text, expected, newest.length) != 0) {
+        fprintf(stderr, "error: Loaded %lu entries, the newest is '%s'\n",
+                (unsigned long)history_count(&history), newest.text);
+        exit(1);
+    }
+
+    printf("  mmap:  %8.3f ms  %8ld KiB anonymous  %8ld KiB file\n", (double)duration / 1e6,
+           after.anonymous_kb - before.anonymous_kb, after.file_kb - before.file_kb);
+
+    history_destroy(&history);
+}
+
+/* What loading a plain text history takes: One allocation per line */
+static void bench_load_text(const char *path, uint32_t count) {
+    Memory before = memory_read();
+    uint64_t start = now_ns();
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("error: Failed to open the text file");
+        exit(1);
+    }
+
+    char **entries = malloc(count * sizeof(*entries));
+    uint32_t entry_count = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+
+    while (entry_count < count && (length = getline(&line, &line_size, file)) != -1) {
+        line[length - 1] = '\0';
+        entries[entry_count++] = strndup(line, (size_t)length - 1);
+    }
+
+    fclose(file);
+
+    uint64_t duration = now_ns() - start;
+    Memory after = memory_read();
+
+    printf("  text:  %8.3f ms  %8ld KiB anonymous  %8ld KiB file\n", (double)duration / 1e6,
+           after.anonymous_kb - before.anonymous_kb, after.file_kb - before.file_kb);
+
+    for (uint32_t i = 0; i < entry_count; i++)
+        free(entries[i]);
+    free(entries);
+    free(line);
+}
+
+typedef struct {
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t count;
+    uint32_t hits;
+} Timing;
+
+static void timing_add(Timing *timing, uint64_t duration, uint8_t is_hit) {
+    timing->total_ns += duration;
+    timing->count++;
+    timing->hits += is_hit;
+    if (duration > timing->max_ns)
+        timing->max_ns = duration;
+}
+
+static uint8_t scan_find(const History *history, const char *pattern, uint32_t length,
+                         uint64_t before, uint64_t *sequence) {
+    for (uint64_t candidate = before; candidate-- > history->first;) {
+        HistoryEntry entry = history_get(history, candidate);
+        if (memmem(entry.text, entry.length, pattern, length) != NULL) {
+            *sequence = candidate;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Types 'pattern' one character at a time, then keeps pressing Ctrl-R */
+static Timing bench_search_pattern(SearchIndex *index, const History *history,
+                                   const char *pattern) {
+    Timing timing = {0};
+    uint32_t length = (uint32_t)strlen(pattern);
+    uint64_t match = history->next;
+
+    for (uint32_t i = 1; i <= length; i++) {
+        uint64_t start = now_ns();
+        uint8_t is_hit = index != NULL ? search_find(index, history, pattern, i, match, &match)
+                                       : scan_find(history, pattern, i, match, &match);
+        timing_add(&timing, now_ns() - start, is_hit);
+
+        /* Like the incremental search: The current match is kept, if it still matches */
+        match = is_hit ? match + 1 : history->next;
+    }
+
+    match = match - 1;
+    for (uint32_t i = 0; i < BENCH_SEARCH_REPEATS; i++) {
+        uint64_t start = now_ns();
+        uint8_t is_hit = index != NULL ? search_find(index, history, pattern, length, match, &match)
+                                       : scan_find(history, pattern, length, match, &match);
+        timing_add(&timing, now_ns() - start, is_hit);
+    }
+
+    return timing;
+}
+
+static void search_handle_evict(void *context, uint64_t sequence, HistoryEntry entry) {
+    search_evict(context, sequence, entry);
+}
+
+static void bench_search(uint32_t count) {
+    static const char *patterns[] = {
+        "pattern_4242", "git commit -m", "make -j6", "project_999 &&", "no such command", "--",
+    };
+
+    History history;
+    SearchIndex index;
+    char command[256];
+
+    if (history_init(&history, count, BENCH_ARENA_SIZE) == -1) {
+        perror("error: Failed to set up the history");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        int length = command_format(command, sizeof(command), i);
+        history_add(&history, command, (uint32_t)length);
+    }
+
+    search_init(&index);
+    history.listener = (HistoryListener){.evict = search_handle_evict, .context = &index};
+
+    Memory before = memory_read();
+    uint64_t start = now_ns();
+    search_sync(&index, &history);
+    uint64_t duration = now_ns() - start;
+    Memory after = memory_read();
+
+    printf("%u entries:\n", count);
+    printf("  building the index: %8.3f ms  %8ld KiB\n", (double)duration / 1e6,
+           after.anonymous_kb - before.anonymous_kb);
+
+    /* Every add evicts the oldest entry */
+    start = now_ns();
+    for (uint32_t i = count; i < count + BENCH_SEARCH_ADDS; i++) {
+        int length = command_format(command, sizeof(command), i);
+        history_add(&history, command, (uint32_t)length);
+        search_sync(&index, &history);
+    }
+    duration = now_ns() - start;
+    printf("  add and evict:      %8.3f us per entry\n",
+           (double)duration / 1e3 / BENCH_SEARCH_ADDS);
+
+    for (uint32_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        Timing indexed = bench_search_pattern(&index, &history, patterns[i]);
+        Timing scanned = bench_search_pattern(NULL, &history, patterns[i]);
+
+        printf("  %-18s index: avg %8.2f us  max %8.2f us   scan: avg %8.2f us  max %8.2f us"
+               "   (%u of %u found)\n",
+               patterns[i], (double)indexed.total_ns / indexed.count / 1e3,
+               (double)indexed.max_ns / 1e3, (double)scanned.total_ns / scanned.count / 1e3,
+               (double)scanned.max_ns / 1e3, indexed.hits, indexed.count);
+
+        if (indexed.hits != scanned.hits) {
+            fprintf(stderr, "error: The index found %u matches, the scan %u\n", indexed.hits,
+                    scanned.hits);
+            exit(1);
+        }
+    }
+
+    search_destroy(&index);
+    history_destroy(&history);
+}
+
+static uint8_t scan_suggest(const History *history, const char *prefix, uint32_t length,
+                            uint64_t *sequence) {
+    for (uint64_t candidate = history->next; candidate-- > history->first;) {
+        HistoryEntry entry = history_get(history, candidate);
+        if (entry.length > length && memcmp(entry.text, prefix, length) == 0) {
+            *sequence = candidate;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Types 'prefix' one character at a time */
+static Timing bench_suggest_prefix(SuggestIndex *index, const History *history,
+                                   const char *prefix) {
+    Timing timing = {0};
+    uint32_t length = (uint32_t)strlen(prefix);
+    uint64_t sequence;
+
+    for (uint32_t i = 1; i <= length; i++) {
+        uint64_t start = now_ns();
+        uint8_t is_hit = index != NULL ? suggest_find(index, history, prefix, i, &sequence)
+                                       : scan_suggest(history, prefix, i, &sequence);
+        timing_add(&timing, now_ns() - start, is_hit);
+    }
+
+    return timing;
+}
+
+static void suggest_handle_evict(void *context, uint64_t sequence, HistoryEntry entry) {
+    suggest_evict(context, sequence, entry);
+}
+
+static void bench_suggest(uint32_t count) {
+    static const char *prefixes[] = {
+        "git commit -m 'Fix the thing number 4", "make -j6", "cd ~/src/project_99", "grep -rn 'q",
+        "ls",
+    };
+
+    History history;
+    SuggestIndex index;
+    char command[256];
+
+    if (history_init(&history, count, BENCH_ARENA_SIZE) == -1) {
+        perror("error: Failed to set up the history");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        int length = command_format(command, sizeof(command), i);
+        history_add(&history, command, (uint32_t)length);
+    }
+
+    suggest_init(&index);
+    history.listener = (HistoryListener){.evict = suggest_handle_evict, .context = &index};
+
+    Memory before = memory_read();
+    uint64_t start = now_ns();
+    suggest_sync(&index, &history);
+    uint64_t duration = now_ns() - start;
+    Memory after = memory_read();
+
+    printf("%u entries:\n", count);
+    printf("  building the index: %8.3f ms  %8ld KiB  %u nodes\n", (double)duration / 1e6,
+           after.anonymous_kb - before.anonymous_kb, index.node_count);
+
+    /* Every add evicts the oldest entry */
+    start = now_ns();
+    for (uint32_t i = count; i < count + BENCH_SEARCH_ADDS; i++) {
+        int length = command_format(command, sizeof(command), i);
+        history_add(&history, command, (uint32_t)length);
+        suggest_sync(&index, &history);
+    }
+    duration = now_ns() - start;
+    printf("  add and evict:      %8.3f us per entry\n",
+           (double)duration / 1e3 / BENCH_SEARCH_ADDS);
+
+    for (uint32_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        Timing indexed = bench_suggest_prefix(&index, &history, prefixes[i]);
+        Timing scanned = bench_suggest_prefix(NULL, &history, prefixes[i]);
+
+        printf("  %-38s index: avg %6.2f us  max %6.2f us   scan: avg %9.2f us  max %9.2f us"
+               "   (%u of %u found)\n",
+               prefixes[i], (double)indexed.total_ns / indexed.count / 1e3,
+               (double)indexed.max_ns / 1e3, (double)scanned.total_ns / scanned.count / 1e3,
+               (double)scanned.max_ns / 1e3, indexed.hits, indexed.count);
+
+        if (indexed.hits != scanned.hits) {
+            fprintf(stderr, "error: The index found %u suggestions, the scan %u\n", indexed.hits,
+                    scanned.hits);
+            exit(1);
+        }
+    }
+
+    suggest_destroy(&index);
+    history_destroy(&history);
+}
+
+static uint64_t random_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Mostly a few favourite commands, a long tail of rarer ones and some lines that never repeat */
+static int command_repetitive(char *buffer, size_t size, uint32_t index, uint64_t *random) {
+    if (random_next(random) % 100 < BENCH_DEDUP_UNIQUE)
+        return command_format(buffer, size, index * 4);
+
+    uint32_t range = (uint32_t)(random_next(random) % BENCH_DEDUP_COMMANDS) + 1;
+    return command_format(buffer, size, (uint32_t)(random_next(random) % range));
+}
+
+static int string_compare(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static uint64_t history_count_distinct(const History *history) {
+    uint64_t count = 0, distinct = 0;
+    const char **texts = malloc(history_count(history) * sizeof(*texts));
+
+    for (uint64_t sequence = history->first; sequence < history->next; sequence++) {
+        if (!history_is_removed(history, sequence))
+            texts[count++] = history_get(history, sequence).text;
+    }
+
+    qsort(texts, count, sizeof(*texts), string_compare);
+    for (uint64_t i = 0; i < count; i++)
+        distinct += i == 0 || strcmp(texts[i - 1], texts[i]) != 0;
+
+    free(texts);
+    return distinct;
+}
+
+static void search_handle_renumber(void *context, const History *history, uint64_t old_first,
+                                   const uint64_t *sequences) {
+    search_renumber(context, history, old_first, sequences);
+}
+
+/* 'mode' is either "plain" or "dedup" */
+static void bench_submit(const char *mode, uint32_t count) {
+    History history;
+    SearchIndex index;
+    char command[256];
+    uint64_t random = 0x2545f4914f6cdd1dull;
+    Timing timing = {0};
+
+    Memory before = memory_read();
+
+    if (history_init(&history, BENCH_DEDUP_ENTRIES, BENCH_DEDUP_ARENA_SIZE) == -1) {
+        perror("error: Failed to set up the history");
+        exit(1);
+    }
+
+    search_init(&index);
+    history.is_deduplicated = strcmp(mode, "dedup") == 0;
+    history.listener = (HistoryListener){
+        .evict = search_handle_evict,
+        .renumber = search_handle_renumber,
+        .context = &index,
+    };
+
+    /* Like after the first search, the index is kept up to date from now on */
+    search_sync(&index, &history);
+
+    uint64_t arena_head = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        int length = command_repetitive(command, sizeof(command), i, &random);
+
+        uint64_t start = now_ns();
+        history_add(&history, command, (uint32_t)length);
+        search_sync(&index, &history);
+        timing_add(&timing, now_ns() - start, history.arena_head != arena_head);
+
+        arena_head = history.arena_head;
+    }
+
+    Memory after = memory_read();
+    uint64_t live = history_count(&history) - history.removed_count;
+
+    printf("  %s:  submit avg %6.2f us  max %8.2f us   %6lu live  %6lu distinct  %7u written"
+           "  %8ld KiB\n",
+           mode, (double)timing.total_ns / timing.count / 1e3, (double)timing.max_ns / 1e3,
+           (unsigned long)live, (unsigned long)history_count_distinct(&history), timing.hits,
+           after.anonymous_kb - before.anonymous_kb);
+
+    search_destroy(&index);
+    history_destroy(&history);
+}
+
+/* What the terminal sends, one chunk per keystroke or paste */
+typedef struct {
+    char *bytes;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t *chunk_ends;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+} Session;
+
+static void session_add(Session *session, const char *bytes, uint32_t length) {
+    while (session->length + length > session->capacity) {
+        session->capacity = session->capacity == 0 ? 4096 : session->capacity * 2;
+        session->bytes = realloc(session->bytes, session->capacity);
+    }
+
+    if (session->chunk_count == session->chunk_capacity) {
+        session->chunk_capacity = session->chunk_capacity == 0 ? 256 : session->chunk_capacity * 2;
+        session->chunk_ends =
+            realloc(session->chunk_ends, session->chunk_capacity * sizeof(*session->chunk_ends));
+    }
+
+    memcpy(session->bytes + session->length, bytes, length);
+    session->length += length;
+    session->chunk_ends[session->chunk_count++] = session->length;
+}
+
+static void session_type(Session *session, const char *text) {
+    for (; *text != '\0'; text++)
+        session_add(session, text, 1);
+}
+
+static void session_repeat(Session *session, const char *key, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        session_add(session, key, (uint32_t)strlen(key));
+}
+
+/* Pastes are only marked, if the editor asked the terminal for it */
+static void session_script(Session *session, uint8_t is_paste_bracketed) {
+    char command[256];
+    char paste[BENCH_REPLAY_PASTE_LENGTH + 16];
+
+    for (uint32_t i = 0; i < BENCH_REPLAY_COMMANDS; i++) {
+        command_format(command, sizeof(command), i);
+        session_type(session, command);
+        session_type(session, "\r");
+    }
+
+    /* Fix a typo in an older command */
+    session_repeat(session, "\x1b[A", 20);
+    session_repeat(session, "\x1b[B", 10);
+    session_repeat(session, "\x1b[D", 8);
+    session_repeat(session, "\x7f", 3);
+    session_type(session, "abc\r");
+
+    session_type(session, "\x12make -j");
+    session_repeat(session, "\x12", 5);
+    session_type(session, "\x1b[C\r");
+
+    for (uint32_t i = 0; i < BENCH_REPLAY_PASTE_LENGTH; i++)
+        paste[i] = (char)('a' + i % 26);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        if (is_paste_bracketed)
+            session_add(session, "\x1b[200~", 6);
+        session_add(session, paste, BENCH_REPLAY_PASTE_LENGTH);
+        if (is_paste_bracketed)
+            session_add(session, "\x1b[201~", 6);
+        session_type(session, "\r");
+    }
+
+    session_type(session, BENCH_REPLAY_DONE "\r");
+}
+
+typedef struct {
+    unsigned long read_calls;
+    unsigned long write_calls;
+    unsigned long written;
+} ProcessIo;
+
+static ProcessIo process_io_read(pid_t pid) {
+    ProcessIo io = {0};
+    char path[64], line[256];
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("error: Failed to read the I/O counters");
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        sscanf(line, "syscr: %lu", &io.read_calls);
+        sscanf(line, "syscw: %lu", &io.write_calls);
+        sscanf(line, "wchar: %lu", &io.written);
+    }
+
+    fclose(file);
+    return io;
+}
+
+typedef struct {
+    /* The end of the output, to spot the last submission */
+    char tail[64];
+    uint64_t received;
+} Terminal;
+
+/* Reads what the editor wrote, until 'timeout_ms' pass without anything. Returns 1, once the last
+ * submission showed up. */
+static uint8_t replay_drain(int master, int timeout_ms, Terminal *terminal) {
+    char *tail = terminal->tail;
+    size_t tail_size = sizeof(terminal->tail);
+    struct pollfd poll_fd = {.fd = master, .events = POLLIN};
+    char buffer[65536];
+
+    while (poll(&poll_fd, 1, timeout_ms) == 1) {
+        ssize_t length = read(master, buffer, sizeof(buffer));
+        if (length <= 0)
+            return 0;
+
+        terminal->received += (uint64_t)length;
+
+        /* Keep the end of the output around, the marker might be split between two reads */
+        size_t tail_length = strlen(tail);
+        size_t keep = (size_t)length >= tail_size - 1 ? 0 : tail_size - 1 - (size_t)length;
+        if (keep > tail_length)
+            keep = tail_length;
+
+        memmove(tail, tail + tail_length - keep, keep);
+        size_t copy = (size_t)length < tail_size - 1 ? (size_t)length : tail_size - 1;
+        memcpy(tail + keep, buffer + length - copy, copy);
+        tail[keep + copy] = '\0';
+
+        if (strstr(tail, "submission: " BENCH_REPLAY_DONE) != NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void bench_replay(const char *program) {
+    const char *history_path = "/tmp/cmdline_history.replay";
+    Session session = {0};
+    unlink(history_path);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        perror("error: Failed to open a pty");
+        exit(1);
+    }
+
+    /* Kept open, to see when the editor has taken all input */
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        perror("error: Failed to open the pty");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(master);
+        close(slave);
+
+        execl(program, program, history_path, (char *)NULL);
+        perror("error: Failed to start the editor");
+        exit(1);
+    }
+
+    Terminal terminal = {0};
+
+    /* Let it start up, loading the (empty) history is not part of this */
+    replay_drain(master, 500, &terminal);
+    session_script(&session, strstr(terminal.tail, "\x1b[?2004h") != NULL);
+    ProcessIo before = process_io_read(pid);
+    terminal.received = 0;
+    uint64_t start = now_ns();
+
+    uint8_t is_done = 0;
+    for (uint32_t i = 0, offset = 0; i < session.chunk_count; i++) {
+        uint32_t end = session.chunk_ends[i];
+        unsigned long read_calls = process_io_read(pid).read_calls;
+
+        if (write(master, session.bytes + offset, end - offset) != (ssize_t)(end - offset)) {
+            perror("error: Failed to write to the pty");
+            exit(1);
+        }
+        offset = end;
+
+        /* Like typing: The next key comes, once the editor has read all of this one */
+        int queued = 0;
+        do
+            is_done |= replay_drain(master, 0, &terminal);
+        while ((process_io_read(pid).read_calls == read_calls ||
+                (ioctl(slave, FIONREAD, &queued) == 0 && queued > 0)) &&
+               waitpid(pid, NULL, WNOHANG) == 0);
+    }
+
+    while (!is_done && replay_drain(master, 2000, &terminal) == 1)
+        is_done = 1;
+
+    uint64_t duration = now_ns() - start;
+    ProcessIo after = process_io_read(pid);
+    uint64_t received = terminal.received;
+
+    write(master, "\x1bqq", 3);
+    replay_drain(master, 200, &terminal);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    if (!is_done) {
+        fprintf(stderr, "error: The editor did not finish the session\n");
+        exit(1);
+    }
+
+    unsigned long read_calls = after.read_calls - before.read_calls;
+    unsigned long write_calls = after.write_calls - before.write_calls;
+    unsigned long written = after.written - before.written;
+
+    printf("%s: %u keys and pastes, %u bytes\n", program, session.chunk_count, session.length);
+    printf("  %8.2f ms   reads %7lu (%5.2f per key)   writes %7lu (%6.2f per key)   "
+           "written %9lu bytes (%8.1f per key)\n",
+           (double)duration / 1e6, read_calls, (double)read_calls / session.chunk_count,
+           write_calls, (double)write_calls / session.chunk_count, written,
+           (double)written / session.chunk_count);
+    printf("  terminal received %9lu bytes (%8.1f per key)\n", (unsigned long)received,
+           (double)received / session.chunk_count);
+
+    close(slave);
+    close(master);
+    free(session.bytes);
+    free(session.chunk_ends);
+}
+
+static void bench_in_child(void (*function)(const char *, uint32_t), const char *path,
+                           uint32_t count) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        function(path, count);
+        exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        exit(1);
+}
+
+static uint32_t parse_count(const char *string) {
+    uint32_t count = (uint32_t)strtoul(string, NULL, 10);
+    if (count == 0) {
+        fprintf(stderr, "error: Invalid entry count '%s'\n", string);
+        exit(1);
+    }
+
+    return count;
+}
+
+int main(int argc, char **argv) {
+    char path[256], text_path[256];
+
+    if (argc == 3 && strcmp(argv[1], "replay") == 0) {
+        bench_replay(argv[2]);
+        return 0;
+    }
+
+    if (argc < 2 || (strcmp(argv[1], "load") != 0 && strcmp(argv[1], "search") != 0 &&
+                     strcmp(argv[1], "suggest") != 0 && strcmp(argv[1], "dedup") != 0)) {
+        fprintf(stderr, "Usage: %s load|search|suggest|dedup [entries]...\n", argv[0]);
+        fprintf(stderr, "       %s replay <program>\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        uint32_t count = parse_count(argv[i]);
+
+        if (strcmp(argv[1], "search") == 0) {
+            bench_search(count);
+            continue;
+        }
+
+        if (strcmp(argv[1], "suggest") == 0) {
+            bench_suggest(count);
+            continue;
+        }
+
+        if (strcmp(argv[1], "dedup") == 0) {
+            printf("%u submits:\n", count);
+            fflush(stdout);
+
+            bench_in_child(bench_submit, "plain", count);
+            bench_in_child(bench_submit, "dedup", count);
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/tmp/cmdline_history.bench.%u", count);
+        snprintf(text_path, sizeof(text_path), "/tmp/cmdline_history.bench.%u.txt", count);
+
+        /* Both files are still in the page cache afterwards */
+        bench_generate(path, text_path, count);
+
+        printf("%u entries:\n", count);
+        fflush(stdout);
+
+        bench_in_child(bench_load, path, count);
+        bench_in_child(bench_load_text, text_path, count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,498 @@
+#include "history.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FILE_HEADER_SIZE (sizeof(HISTORY_FILE_MAGIC) - 1)
+#define RECORD_ALIGN 4
+/* Leading and trailing length */
+#define RECORD_OVERHEAD (2 * sizeof(uint32_t))
+/* Compacting a handful of removed entries is not worth renumbering everything */
+#define COMPACT_MIN_REMOVED 64
+#define DEDUPLICATE_BATCH 16
+
+static size_t record_size(uint32_t length) {
+    size_t text_size = (size_t)length + 1;
+    return RECORD_OVERHEAD + ((text_size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1));
+}
+
+static uint32_t record_read_length(const char *position) {
+    uint32_t length;
+    memcpy(&length, position, sizeof(length));
+    return length;
+}
+
+static size_t round_up_power_of_two(size_t value) {
+    size_t result = 1;
+    while (result < value)
+        result <<= 1;
+
+    return result;
+}
+
+/* Any hash does, entries with the same fingerprint are compared anyway. Never returns 0. */
+static uint64_t fingerprint_compute(const char *text, uint32_t length) {
+    uint64_t hash = length * 0x9e3779b97f4a7c15ull;
+    uint64_t word;
+    uint32_t i = 0;
+
+    for (; i + sizeof(word) <= length; i += sizeof(word)) {
+        memcpy(&word, text + i, sizeof(word));
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+        hash ^= hash >> 31;
+    }
+
+    word = 0;
+    memcpy(&word, text + i, length - i);
+    hash = (hash ^ word) * 0x94d049bb133111ebull;
+    hash ^= hash >> 29;
+
+    return hash | 1;
+}
+
+static uint32_t fingerprint_home(const History *history, uint64_t fingerprint) {
+    return (uint32_t)((fingerprint * 0x9e3779b97f4a7c15ull) >> 32) &
+           (history->fingerprint_capacity - 1);
+}
+
+/* Returns the slot of the live entry with the same text or the free slot it would go into */
+static HistoryFingerprint *fingerprint_find(const History *history, uint64_t fingerprint,
+                                            const char *text, uint32_t length) {
+    uint32_t mask = history->fingerprint_capacity - 1;
+
+    for (uint32_t i = fingerprint_home(history, fingerprint);; i = (i + 1) & mask) {
+        HistoryFingerprint *slot = &history->fingerprints[i];
+        if (slot->fingerprint == 0)
+            return slot;
+
+        if (slot->fingerprint == fingerprint) {
+            HistoryEntry entry = history_get(history, slot->sequence);
+            if (entry.length == length && memcmp(entry.text, text, length) == 0)
+                return slot;
+        }
+    }
+}
+
+static void fingerprint_remove(History *history, uint64_t fingerprint, uint64_t sequence) {
+    uint32_t mask = history->fingerprint_capacity - 1;
+    HistoryFingerprint *fingerprints = history->fingerprints;
+
+    uint32_t i = fingerprint_home(history, fingerprint);
+    while (fingerprints[i].fingerprint != 0 && fingerprints[i].sequence != sequence)
+        i = (i + 1) & mask;
+
+    if (fingerprints[i].fingerprint == 0)
+        return;
+
+    /* Fill the hole with the following slots that may live there, so lookups don't stop early */
+    for (uint32_t j = (i + 1) & mask; fingerprints[j].fingerprint != 0; j = (j + 1) & mask) {
+        uint32_t home = fingerprint_home(history, fingerprints[j].fingerprint);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            fingerprints[i] = fingerprints[j];
+            i = j;
+        }
+    }
+
+    fingerprints[i].fingerprint = 0;
+}
+
+/* There are never more live entries than 'entry_capacity', so the set is at most half full */
+static int fingerprint_reserve(History *history) {
+    if (history->fingerprints != NULL)
+        return 0;
+
+    history->fingerprint_capacity = history->entry_capacity * 2;
+    history->fingerprints =
+        calloc(history->fingerprint_capacity, sizeof(*history->fingerprints));
+
+    return history->fingerprints == NULL ? -1 : 0;
+}
+
+int history_init(History *history, uint32_t entry_capacity, size_t arena_size) {
+    *history = (History){
+        .entry_capacity = (uint32_t)round_up_power_of_two(entry_capacity),
+        .arena_size = round_up_power_of_two(arena_size),
+        .fd = -1,
+    };
+
+    history->positions = malloc(history->entry_capacity * sizeof(*history->positions));
+    if (history->positions == NULL)
+        return -1;
+
+    /* Only the parts of the arena that have been written to take up memory */
+    history->arena = mmap(NULL, history->arena_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (history->arena == MAP_FAILED) {
+        free(history->positions);
+        return -1;
+    }
+
+    return 0;
+}
+
+void history_destroy(History *history) {
+    free(history->positions);
+    free(history->fingerprints);
+    munmap(history->arena, history->arena_size);
+
+    if (history->mapping != NULL)
+        munmap(history->mapping, history->mapping_size);
+    if (history->fd != -1)
+        close(history->fd);
+
+    *history = (History){.fd = -1};
+}
+
+/* Once none of the entries from the file are left */
+static void history_release_mapping(History *history) {
+    if (history->mapping != NULL && history->first >= history->mapped_end) {
+        munmap(history->mapping, history->mapping_size);
+        history->mapping = NULL;
+    }
+}
+
+/* Evicts every entry below 'end' */
+static void history_evict(History *history, uint64_t end) {
+    for (; history->first < end; history->first++) {
+        HistoryEntry entry = history_get(history, history->first);
+
+        if (history->listener.evict != NULL)
+            history->listener.evict(history->listener.context, history->first, entry);
+
+        if (history_is_removed(history, history->first))
+            history->removed_count--;
+        else if (history->fingerprints != NULL)
+            fingerprint_remove(history, fingerprint_compute(entry.text, entry.length),
+                               history->first);
+    }
+
+    history_release_mapping(history);
+}
+
+/* Drops the removed entries and renumbers the others. They only ever move to higher sequence
+ * numbers, so going from the newest one down, every position is read before it is overwritten. */
+static void history_compact(History *history) {
+    uint64_t old_first = history->first;
+    uint64_t *sequences = malloc(history_count(history) * sizeof(*sequences));
+    if (sequences == NULL)
+        return;
+
+    uint32_t mask = history->entry_capacity - 1;
+    uint64_t sequence = history->next;
+    uint64_t mapped_end = history->mapped_end;
+    uint8_t is_mapped_found = 0;
+
+    for (uint64_t old = history->next; old-- > old_first;) {
+        uint64_t position = history->positions[old & mask];
+        if ((position & HISTORY_POSITION_REMOVED) != 0) {
+            sequences[old - old_first] = HISTORY_SEQUENCE_NONE;
+            continue;
+        }
+
+        history->positions[--sequence & mask] = position;
+        sequences[old - old_first] = sequence;
+
+        if (!is_mapped_found && old < history->mapped_end) {
+            mapped_end = sequence + 1;
+            is_mapped_found = 1;
+        }
+    }
+
+    /* Every entry from the file was removed */
+    if (!is_mapped_found && history->mapped_end > old_first)
+        mapped_end = sequence;
+
+    history->first = sequence;
+    history->mapped_end = mapped_end;
+    history->removed_count = 0;
+
+    for (uint32_t i = 0; i < history->fingerprint_capacity; i++) {
+        if (history->fingerprints[i].fingerprint != 0)
+            history->fingerprints[i].sequence =
+                sequences[history->fingerprints[i].sequence - old_first];
+    }
+
+    if (history->listener.renumber != NULL)
+        history->listener.renumber(history->listener.context, history, old_first, sequences);
+
+    free(sequences);
+    history_release_mapping(history);
+}
+
+static const char *history_record(const History *history, uint64_t sequence) {
+    uint64_t position = history->positions[sequence & (history->entry_capacity - 1)] &
+                        ~HISTORY_POSITION_REMOVED;
+
+    if (sequence < history->mapped_end)
+        return history->mapping + position;
+
+    return history->arena + (position & (history->arena_size - 1));
+}
+
+HistoryEntry history_get(const History *history, uint64_t sequence) {
+    const char *record = history_record(history, sequence);
+
+    return (HistoryEntry){
+        .text = record + sizeof(uint32_t),
+        .length = record_read_length(record),
+    };
+}
+
+/* The record is written with a single call, so shells sharing the file don't interleave their
+ * records. A failed write disables the file, the history itself keeps working. */
+static void history_append(History *history, const char *record, size_t size) {
+    if (history->fd == -1)
+        return;
+
+    if (write(history->fd, record, size) != (ssize_t)size) {
+        fprintf(stderr, "\r\nwarning: History file disabled, write failed: %s\r\n",
+                strerror(errno));
+        close(history->fd);
+        history->fd = -1;
+    }
+}
+
+int history_add(History *history, const char *text, uint32_t length) {
+    size_t size = record_size(length);
+    if (size > history->arena_size) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    uint64_t fingerprint = 0;
+    if (history->is_deduplicated) {
+        if (fingerprint_reserve(history) == -1)
+            return -1;
+
+        fingerprint = fingerprint_compute(text, length);
+        HistoryFingerprint *duplicate = fingerprint_find(history, fingerprint, text, length);
+
+        if (duplicate->fingerprint != 0) {
+            uint64_t sequence = duplicate->sequence;
+            if (sequence == history->next - 1)
+                return 0;
+
+            history->positions[sequence & (history->entry_capacity - 1)] |=
+                HISTORY_POSITION_REMOVED;
+            history->removed_count++;
+            fingerprint_remove(history, fingerprint, sequence);
+        }
+    }
+
+    uint64_t head = history->arena_head;
+    size_t offset = head & (history->arena_size - 1);
+    if (offset + size > history->arena_size)
+        head += history->arena_size - offset;
+
+    if (history_count(history) == history->entry_capacity)
+        history_evict(history, history->first + 1);
+
+    /* The new record overwrites everything below 'head + size - arena_size'. Entries are evicted
+     * oldest first, so the ones from the file go as well. */
+    uint64_t oldest = history->first > history->mapped_end ? history->first : history->mapped_end;
+    uint64_t end = oldest;
+    while (end < history->next &&
+           (history->positions[end & (history->entry_capacity - 1)] & ~HISTORY_POSITION_REMOVED) +
+                   history->arena_size <
+               head + size)
+        end++;
+
+    if (end > oldest)
+        history_evict(history, end);
+
+    char *record = history->arena + (head & (history->arena_size - 1));
+    memcpy(record, &length, sizeof(length));
+    memcpy(record + sizeof(length), text, length);
+    /* NUL terminator and padding */
+    memset(record + sizeof(length) + length, 0, size - RECORD_OVERHEAD - length);
+    memcpy(record + size - sizeof(length), &length, sizeof(length));
+
+    uint64_t sequence = history->next++;
+    history->positions[sequence & (history->entry_capacity - 1)] = head;
+    history->arena_head = head + size;
+
+    history_append(history, record, size);
+
+    if (history->is_deduplicated) {
+        *fingerprint_find(history, fingerprint, text, length) =
+            (HistoryFingerprint){.fingerprint = fingerprint, .sequence = sequence};
+
+        if (history->removed_count >= COMPACT_MIN_REMOVED &&
+            history->removed_count * 2 >= history_count(history))
+            history_compact(history);
+    }
+
+    return 0;
+}
+
+static void close_keep_errno(int fd) {
+    int error = errno;
+    close(fd);
+    errno = error;
+}
+
+/* Returns the end of the last complete record. Only needed, if a write was cut short. */
+static size_t history_file_recover(const char *mapping, size_t size) {
+    size_t offset = FILE_HEADER_SIZE;
+
+    while (size - offset >= RECORD_OVERHEAD) {
+        uint32_t length = record_read_length(mapping + offset);
+        size_t next_size = record_size(length);
+
+        if (next_size > size - offset ||
+            record_read_length(mapping + offset + next_size - sizeof(length)) != length)
+            break;
+
+        offset += next_size;
+    }
+
+    return offset;
+}
+
+/* Walks backwards from 'end' and fills the position ring from the top, so the newest entry ends
+ * up right below 'entry_capacity'. Returns the number of records, which stops at the first one that
+ * is not intact. */
+static uint64_t history_file_index(History *history, const char *mapping, size_t end) {
+    uint64_t count = 0;
+    size_t offset = end;
+
+    while (offset > FILE_HEADER_SIZE && count < history->entry_capacity) {
+        uint32_t length = record_read_length(mapping + offset - sizeof(length));
+        size_t size = record_size(length);
+
+        if (size > offset - FILE_HEADER_SIZE ||
+            record_read_length(mapping + offset - size) != length)
+            break;
+
+        offset -= size;
+        count++;
+        history->positions[(history->entry_capacity - count) & (history->entry_capacity - 1)] =
+            offset;
+    }
+
+    return count;
+}
+
+/* Going from the newest entry down, every entry that is already in the set is an older copy. The
+ * set is too large for the cache, so the slots of a whole batch are prefetched before the batch is
+ * looked up. */
+static int history_deduplicate(History *history) {
+    uint64_t fingerprints[DEDUPLICATE_BATCH];
+
+    if (fingerprint_reserve(history) == -1)
+        return -1;
+
+    for (uint64_t end = history->next; end > history->first;) {
+        uint64_t start = end - history->first > DEDUPLICATE_BATCH ? end - DEDUPLICATE_BATCH
+                                                                  : history->first;
+
+        for (uint64_t sequence = end; sequence-- > start;) {
+            HistoryEntry entry = history_get(history, sequence);
+            uint64_t fingerprint = fingerprint_compute(entry.text, entry.length);
+
+            fingerprints[end - 1 - sequence] = fingerprint;
+            __builtin_prefetch(&history->fingerprints[fingerprint_home(history, fingerprint)]);
+        }
+
+        for (uint64_t sequence = end; sequence-- > start;) {
+            HistoryEntry entry = history_get(history, sequence);
+            uint64_t fingerprint = fingerprints[end - 1 - sequence];
+            HistoryFingerprint *slot =
+                fingerprint_find(history, fingerprint, entry.text, entry.length);
+
+            if (slot->fingerprint == 0) {
+                *slot = (HistoryFingerprint){.fingerprint = fingerprint, .sequence = sequence};
+            } else {
+                history->positions[sequence & (history->entry_capacity - 1)] |=
+                    HISTORY_POSITION_REMOVED;
+                history->removed_count++;
+            }
+        }
+
+        end = start;
+    }
+
+    if (history->removed_count > 0)
+        history_compact(history);
+
+    return 0;
+}
+
+int history_load(History *history, const char *path) {
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1)
+        goto fail;
+
+    size_t size = (size_t)file_stat.st_size;
+    if (size == 0) {
+        if (write(fd, HISTORY_FILE_MAGIC, FILE_HEADER_SIZE) != FILE_HEADER_SIZE)
+            goto fail;
+
+        history->fd = fd;
+        return 0;
+    }
+
+    if (size < FILE_HEADER_SIZE) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    char *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+        goto fail;
+
+    if (memcmp(mapping, HISTORY_FILE_MAGIC, FILE_HEADER_SIZE) != 0) {
+        munmap(mapping, size);
+        errno = EINVAL;
+        goto fail;
+    }
+
+    uint64_t count = history_file_index(history, mapping, size);
+
+    /* The newest record is broken, most likely a write got cut short. Drop it from the file, so
+     * new records are appended right after the intact ones. */
+    if (count == 0 && size > FILE_HEADER_SIZE) {
+        size_t end = history_file_recover(mapping, size);
+        fprintf(stderr, "warning: Dropping %zu broken bytes at the end of '%s'\n", size - end,
+                path);
+
+        if (ftruncate(fd, (off_t)end) == -1) {
+            munmap(mapping, size);
+            goto fail;
+        }
+
+        count = history_file_index(history, mapping, end);
+    }
+
+    if (count == 0) {
+        munmap(mapping, size);
+    } else {
+        history->mapping = mapping;
+        history->mapping_size = size;
+    }
+
+    history->first = history->entry_capacity - count;
+    history->next = history->entry_capacity;
+    history->mapped_end = history->entry_capacity;
+    history->fd = fd;
+
+    if (history->is_deduplicated && history_deduplicate(history) == -1)
+        return -1;
+
+    return 0;
+
+fail:
+    close_keep_errno(fd);
+    return -1;
+}
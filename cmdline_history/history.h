@@ -0,0 +1,126 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Storage for the submitted lines.
+ *
+ * Every line is stored as a variable length record, which is laid out the same way in memory and
+ * in the history file:
+ *
+ *   [uint32_t length] [text] [NUL] [padding to 4 bytes] [uint32_t length]
+ *
+ * The trailing length allows walking the records backwards, starting at the newest one.
+ *
+ * New lines are appended to a ring of bytes (the arena) and to the history file. Once the arena is
+ * full, the oldest records get overwritten. Records never wrap around the end of the arena, the
+ * remaining bytes are skipped instead.
+ *
+ * At startup, the history file is mapped and only the records of the newest entries are visited to
+ * find their offsets. The entries are not copied, they are read straight from the mapping, until
+ * they get evicted. Since the file is append-only, it grows without bounds, but the part of it that
+ * is older than the newest 'entry_capacity' entries is never touched.
+ *
+ * Every entry gets the next sequence number, which stays valid until the entry is evicted or the
+ * history is compacted.
+ *
+ * With 'is_deduplicated' set, a fingerprint (a 64 bit hash of the text) of every live entry is kept
+ * in a hash set. Adding a line that is already in the history moves it to the front: The old entry
+ * is marked as removed and the line is added again, so it gets the newest sequence number. Adding
+ * the newest entry again does nothing at all. Removed entries keep their sequence number and their
+ * bytes in the arena until they are evicted. Once they make up half of the live range, the
+ * history is compacted: The remaining entries are renumbered so that they are consecutive again,
+ * which keeps the newest sequence number and shifts the older ones up. */
+
+#define HISTORY_FILE_MAGIC "CMDHIST1"
+
+typedef struct {
+    const char *text; /* NUL terminated */
+    uint32_t length;
+} HistoryEntry;
+
+/* Set on the positions of removed duplicates */
+#define HISTORY_POSITION_REMOVED (1ull << 63)
+/* Removed entries map to this, see 'HistoryListener' */
+#define HISTORY_SEQUENCE_NONE UINT64_MAX
+
+typedef struct History History;
+
+typedef struct {
+    /* Called for every entry right before it is evicted, oldest first. The entry is still readable.
+     * Removed duplicates are evicted as well. */
+    void (*evict)(void *context, uint64_t sequence, HistoryEntry entry);
+    /* Called after the history was compacted. 'sequences[i]' is the new sequence number of what
+     * was 'old_first + i', up to the current 'next'. */
+    void (*renumber)(void *context, const History *history, uint64_t old_first,
+                     const uint64_t *sequences);
+    void *context;
+} HistoryListener;
+
+typedef struct {
+    /* 0 marks a free slot */
+    uint64_t fingerprint;
+    uint64_t sequence;
+} HistoryFingerprint;
+
+struct History {
+    /* Ring of record positions indexed by sequence number. Entries below 'mapped_end' are offsets
+     * into the mapping, everything else is a position in the arena. */
+    uint64_t *positions;
+    uint32_t entry_capacity;
+    /* Live entries are in [first, next) */
+    uint64_t first;
+    uint64_t next;
+
+    char *arena;
+    size_t arena_size;
+    /* Absolute position of the next record, only ever grows */
+    uint64_t arena_head;
+
+    char *mapping;
+    size_t mapping_size;
+    uint64_t mapped_end;
+
+    /* The history file, -1 if the history is not persisted */
+    int fd;
+
+    /* Has to be set before 'history_load()' */
+    uint8_t is_deduplicated;
+    /* Entries in [first, next) that were removed as duplicates */
+    uint64_t removed_count;
+    /* Open addressing with linear probing, at most half full */
+    HistoryFingerprint *fingerprints;
+    uint32_t fingerprint_capacity;
+
+    HistoryListener listener;
+};
+
+/* 'entry_capacity' and 'arena_size' are rounded up to powers of two. Returns -1 on failure. */
+int history_init(History *history, uint32_t entry_capacity, size_t arena_size);
+void history_destroy(History *history);
+
+/* Maps the history file at 'path' (which is created if needed) and loads its newest entries. New
+ * entries are appended to it from now on. Returns -1 with errno set, if the file could not be
+ * opened or is not a history file. */
+int history_load(History *history, const char *path);
+
+/* Copies 'text' into the arena and appends it to the history file, the oldest entries are evicted
+ * to make room. Returns -1, if 'text' is larger than the whole arena. The new entry is always the
+ * newest one afterwards, even if it was a duplicate. */
+int history_add(History *history, const char *text, uint32_t length);
+
+static inline uint64_t history_count(const History *history) {
+    return history->next - history->first;
+}
+
+/* 'sequence' has to be in [first, next) */
+static inline uint8_t history_is_removed(const History *history, uint64_t sequence) {
+    return (history->positions[sequence & (history->entry_capacity - 1)] &
+            HISTORY_POSITION_REMOVED) != 0;
+}
+
+/* 'sequence' has to be in [first, next). Removed entries can still be read. */
+HistoryEntry history_get(const History *history, uint64_t sequence);
+
+#endif
@@ -0,0 +1,185 @@
+#include "keys.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PASTE_START "\x1b[200~"
+#define PASTE_END "\x1b[201~"
+#define PASTE_MARKER_LENGTH (sizeof(PASTE_START) - 1)
+/* A sequence that is still not complete after that many bytes is garbage */
+#define SEQUENCE_MAX_LENGTH 32
+
+void keys_init(KeyReader *reader, int fd) { *reader = (KeyReader){.fd = fd}; }
+
+KeysStatus keys_read(KeyReader *reader, int timeout_ms) {
+    /* Only a cut off key is left, move it to the front */
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    if (timeout_ms != 0) {
+        struct pollfd poll_fd = {.fd = reader->fd, .events = POLLIN};
+        int result;
+        while ((result = poll(&poll_fd, 1, timeout_ms)) == -1 && errno == EINTR)
+            ;
+
+        if (result == -1)
+            return KEYS_ERROR;
+        if (result == 0)
+            return KEYS_TIMEOUT;
+    }
+
+    ssize_t length;
+    while ((length = read(reader->fd, reader->buffer + reader->end,
+                          KEYS_BUFFER_SIZE - reader->end)) == -1 &&
+           errno == EINTR)
+        ;
+
+    if (length == -1)
+        return KEYS_ERROR;
+    if (length == 0)
+        return KEYS_EOF;
+
+    reader->end += (uint32_t)length;
+    return KEYS_OK;
+}
+
+static uint8_t is_printable(char c) { return c >= 0x20 && c < 0x7f; }
+
+static uint8_t is_ascii(char c) { return (unsigned char)c < 0x80; }
+
+/* Returns the length of the escape sequence at the start of 'text', 0 if it is cut off.
+ * - CSI: 'ESC [', parameters and intermediates, one final byte in [0x40, 0x7e]
+ * - SS3: 'ESC O' and one more byte, sent for the arrows in application mode
+ * - Anything else following the ESC is left alone, so 'ESC' is on its own */
+static uint32_t sequence_length(const char *text, uint32_t length) {
+    if (length < 2)
+        return 0;
+
+    if (text[1] == 'O')
+        return length < 3 ? 0 : 3;
+    if (text[1] != '[')
+        return 1;
+
+    for (uint32_t i = 2; i < length; i++) {
+        if (text[i] >= 0x40 && text[i] <= 0x7e)
+            return i + 1;
+        /* Broken off, the rest is not part of it */
+        if (text[i] < 0x20 || text[i] > 0x7e)
+            return i;
+    }
+
+    return 0;
+}
+
+static KeyCode sequence_decode(KeyReader *reader, const char *sequence, uint32_t length) {
+    if (length == 1)
+        return KEY_ESC;
+
+    switch (sequence[length - 1]) {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    default:
+        break;
+    }
+
+    if (length == PASTE_MARKER_LENGTH && memcmp(sequence, PASTE_START, length) == 0)
+        reader->is_pasting = 1;
+
+    return KEY_UNKNOWN;
+}
+
+/* Everything up to the end marker is text. Returns 0, if the rest has to be waited for. */
+static uint8_t keys_next_pasted(KeyReader *reader, KeyEvent *event, uint8_t is_flushing) {
+    char *text = reader->buffer + reader->start;
+    uint32_t available = reader->end - reader->start;
+
+    if (text[0] == '\x1b') {
+        uint32_t length = available < PASTE_MARKER_LENGTH ? available : PASTE_MARKER_LENGTH;
+        if (memcmp(text, PASTE_END, length) == 0) {
+            if (length < PASTE_MARKER_LENGTH && !is_flushing)
+                return 0;
+
+            if (length == PASTE_MARKER_LENGTH) {
+                reader->start += length;
+                reader->is_pasting = 0;
+                *event = (KeyEvent){.code = KEY_UNKNOWN};
+                return 1;
+            }
+        }
+    }
+
+    /* The ESC of something other than the end marker is text as well */
+    char *escape = memchr(text + 1, '\x1b', available - 1);
+    uint32_t length = escape != NULL ? (uint32_t)(escape - text) : available;
+
+    for (uint32_t i = 0; i < length; i++) {
+        if (!is_printable(text[i]))
+            text[i] = ' ';
+    }
+
+    reader->start += length;
+    *event = (KeyEvent){.code = KEY_TEXT, .text = text, .length = length};
+    return 1;
+}
+
+uint8_t keys_next(KeyReader *reader, KeyEvent *event, uint8_t is_flushing) {
+    if (reader->start == reader->end)
+        return 0;
+
+    if (reader->is_pasting)
+        return keys_next_pasted(reader, event, is_flushing);
+
+    const char *text = reader->buffer + reader->start;
+    uint32_t available = reader->end - reader->start;
+
+    if (text[0] == '\x1b') {
+        uint32_t length = sequence_length(text, available);
+
+        if (length == 0) {
+            if (!is_flushing && available < SEQUENCE_MAX_LENGTH)
+                return 0;
+
+            length = available;
+        }
+
+        reader->start += length;
+        *event = (KeyEvent){.code = sequence_decode(reader, text, length)};
+        return 1;
+    }
+
+    if (is_printable(text[0])) {
+        uint32_t length = 1;
+        while (length < available && is_printable(text[length]))
+            length++;
+
+        reader->start += length;
+        *event = (KeyEvent){.code = KEY_TEXT, .text = text, .length = length};
+        return 1;
+    }
+
+    /* Not one key per byte of a UTF-8 sequence, which might not even have arrived completely */
+    if (!is_ascii(text[0])) {
+        uint32_t length = 1;
+        while (length < available && !is_ascii(text[length]))
+            length++;
+
+        reader->start += length;
+        *event = (KeyEvent){.code = KEY_UNKNOWN};
+        return 1;
+    }
+
+    reader->start++;
+    *event = (KeyEvent){.code = (KeyCode)(unsigned char)text[0]};
+    return 1;
+}
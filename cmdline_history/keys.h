@@ -0,0 +1,84 @@
+#ifndef _KEYS_H_
+#define _KEYS_H_
+
+#include <stdint.h>
+
+/* Buffered decoding of the terminal input.
+ *
+ * Everything that is available is read with a single call and then decoded from the buffer: Runs
+ * of printable characters come out as a single KEY_TEXT, escape sequences are matched as a whole
+ * and sequences that are not known are skipped instead of being taken apart into single keys.
+ *
+ * With bracketed paste enabled, the terminal wraps pasted text in 'ESC [200~' and 'ESC [201~'.
+ * Everything in between is text, even if it looks like a key, so pasting a line never submits it.
+ *
+ * The editor counts one column per byte, so it only handles ASCII. Control characters and bytes
+ * from 0x80 on, such as those of UTF-8 sequences, are turned into blanks inside a paste. Typed
+ * outside of one, a run of such bytes is a single KEY_UNKNOWN.
+ *
+ * A key might arrive in pieces. An escape sequence that is cut off at the end of the buffer is
+ * kept until the rest of it arrives. If nothing else follows within KEYS_ESCAPE_TIMEOUT_MS, it was
+ * a lone ESC. */
+
+#define KEYS_BUFFER_SIZE 4096
+#define KEYS_ESCAPE_TIMEOUT_MS 50
+
+typedef enum {
+    KEY_UP = 512,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    /* Printable characters, see 'KeyEvent' */
+    KEY_TEXT,
+    /* An escape sequence that has no key of its own */
+    KEY_UNKNOWN,
+
+    KEY_CTRL_F = '\x06',
+    KEY_CTRL_G = '\x07',
+    KEY_CTRL_R = '\x12',
+    KEY_ESC = '\x1b',
+    KEY_ENTER = '\x0d',
+    KEY_DEL = '\x7f',
+} KeyCode;
+
+typedef struct {
+    KeyCode code;
+    /* Only for KEY_TEXT, points into the buffer and is valid until the next read */
+    const char *text;
+    uint32_t length;
+} KeyEvent;
+
+typedef enum {
+    KEYS_OK,
+    /* Nothing arrived in time */
+    KEYS_TIMEOUT,
+    KEYS_EOF,
+    /* See errno */
+    KEYS_ERROR,
+} KeysStatus;
+
+typedef struct {
+    int fd;
+    char buffer[KEYS_BUFFER_SIZE];
+    /* The undecoded bytes are in [start, end) */
+    uint32_t start;
+    uint32_t end;
+    uint8_t is_pasting;
+} KeyReader;
+
+void keys_init(KeyReader *reader, int fd);
+
+/* Waits up to 'timeout_ms' (-1 waits forever) for input and reads all of it. With 0, it reads right
+ * away, for when the caller already knows that there is input. */
+KeysStatus keys_read(KeyReader *reader, int timeout_ms);
+
+/* Decodes the next key from the buffer. Returns 0, if the buffer does not hold a complete one. With
+ * 'is_flushing' set, a cut off escape sequence is taken as it is, so a lone ESC becomes KEY_ESC. */
+uint8_t keys_next(KeyReader *reader, KeyEvent *event, uint8_t is_flushing);
+
+/* Whether part of a key is waiting for the rest of it */
+static inline uint8_t keys_is_pending(const KeyReader *reader) {
+    return reader->start < reader->end;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#include "line.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_MIN_CAPACITY 64
+
+void line_init(Line *line) { *line = (Line){0}; }
+
+void line_free(Line *line) {
+    free(line->data);
+    line_init(line);
+}
+
+/* Makes sure the gap can take at least 'length' more bytes */
+static void line_reserve(Line *line, uint32_t length) {
+    if (line->gap_end - line->gap_start >= length)
+        return;
+
+    uint32_t text_length = line_length(line);
+    uint32_t capacity = line->capacity < LINE_MIN_CAPACITY ? LINE_MIN_CAPACITY : line->capacity;
+    while (capacity - text_length < length)
+        capacity *= 2;
+
+    char *data = realloc(line->data, capacity);
+    if (data == NULL) {
+        fprintf(stderr, "error: Failed to grow the line to %u bytes\r\n", capacity);
+        abort();
+    }
+
+    /* The text after the gap moves to the end of the new buffer */
+    uint32_t after_length = line->capacity - line->gap_end;
+    memmove(data + capacity - after_length, data + line->gap_end, after_length);
+
+    line->data = data;
+    line->gap_end = capacity - after_length;
+    line->capacity = capacity;
+}
+
+void line_insert(Line *line, const char *string, uint32_t length) {
+    line_reserve(line, length);
+    memcpy(line->data + line->gap_start, string, length);
+    line->gap_start += length;
+}
+
+uint8_t line_delete_before_cursor(Line *line) {
+    if (line->gap_start == 0)
+        return 0;
+
+    line->gap_start--;
+    return 1;
+}
+
+uint8_t line_delete_after_cursor(Line *line) {
+    if (line->gap_end == line->capacity)
+        return 0;
+
+    line->gap_end++;
+    return 1;
+}
+
+uint8_t line_move_left(Line *line) {
+    if (line->gap_start == 0)
+        return 0;
+
+    line->data[--line->gap_end] = line->data[--line->gap_start];
+    return 1;
+}
+
+uint8_t line_move_right(Line *line) {
+    if (line->gap_end == line->capacity)
+        return 0;
+
+    line->data[line->gap_start++] = line->data[line->gap_end++];
+    return 1;
+}
+
+void line_clear(Line *line) {
+    line->gap_start = 0;
+    line->gap_end = line->capacity;
+}
+
+void line_set(Line *line, const char *string, uint32_t length) {
+    line_clear(line);
+    line_insert(line, string, length);
+}
+
+const char *line_text(Line *line, uint32_t *length) {
+    uint32_t after_length = line_after_cursor_length(line);
+    if (after_length > 0)
+        memmove(line->data + line->gap_start, line->data + line->gap_end, after_length);
+
+    line->gap_start += after_length;
+    line->gap_end = line->capacity;
+
+    *length = line->gap_start;
+    return line->data;
+}
@@ -0,0 +1,61 @@
+#ifndef _LINE_H_
+#define _LINE_H_
+
+#include <stdint.h>
+
+/* A gap buffer holding the line that is currently being edited. The gap always sits at the cursor,
+ * so inserting and deleting at the cursor only moves the gap boundaries. Moving the cursor moves
+ * a single character from one side of the gap to the other. Once the gap is used up, the buffer
+ * doubles in size, which keeps inserting O(1) amortized:
+ *
+ *   data: [h e l l o _ _ _ _ w o r l d]
+ *                    ^       ^
+ *              gap_start   gap_end */
+
+typedef struct {
+    char *data;
+    uint32_t capacity;
+    uint32_t gap_start; /* Equals the cursor position */
+    uint32_t gap_end;
+} Line;
+
+/* Does not allocate, the buffer is created by the first insertion */
+void line_init(Line *line);
+void line_free(Line *line);
+
+static inline uint32_t line_length(const Line *line) {
+    return line->capacity - (line->gap_end - line->gap_start);
+}
+
+static inline uint32_t line_cursor(const Line *line) { return line->gap_start; }
+
+/* The text is split into the part before and after the cursor */
+static inline const char *line_before_cursor(const Line *line) { return line->data; }
+static inline uint32_t line_before_cursor_length(const Line *line) { return line->gap_start; }
+static inline const char *line_after_cursor(const Line *line) {
+    return line->data + line->gap_end;
+}
+static inline uint32_t line_after_cursor_length(const Line *line) {
+    return line->capacity - line->gap_end;
+}
+
+void line_insert(Line *line, const char *string, uint32_t length);
+/* Both return 0 if there was nothing to delete */
+uint8_t line_delete_before_cursor(Line *line);
+uint8_t line_delete_after_cursor(Line *line);
+
+/* Both return 0 if the cursor is already at the start/end of the line */
+uint8_t line_move_left(Line *line);
+uint8_t line_move_right(Line *line);
+
+/* Empties the line, but keeps its buffer around */
+void line_clear(Line *line);
+
+/* Replaces the contents with a copy of 'string' and places the cursor at the end */
+void line_set(Line *line, const char *string, uint32_t length);
+
+/* Closes the gap by moving the cursor to the end, so the contents can be read in one piece. The
+ * string is not NUL terminated and valid until the line is changed. */
+const char *line_text(Line *line, uint32_t *length);
+
+#endif
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include "loop.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#define LOOP_MIN_WATCHES 8
+
+int loop_init(Loop *loop) {
+    *loop = (Loop){.signal_fd = -1};
+    sigemptyset(&loop->signal_set);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epoll_fd == -1 ? -1 : 0;
+}
+
+static LoopWatch *loop_find(Loop *loop, int fd) {
+    for (uint32_t i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].fd == fd)
+            return &loop->watches[i];
+    }
+
+    return NULL;
+}
+
+int loop_add(Loop *loop, int fd, uint32_t events, LoopFunction function, void *context) {
+    if (loop->watch_count == loop->watch_capacity) {
+        uint32_t capacity =
+            loop->watch_capacity == 0 ? LOOP_MIN_WATCHES : loop->watch_capacity * 2;
+        LoopWatch *watches = realloc(loop->watches, capacity * sizeof(*watches));
+        if (watches == NULL)
+            return -1;
+
+        loop->watches = watches;
+        loop->watch_capacity = capacity;
+    }
+
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        return -1;
+
+    loop->watches[loop->watch_count++] = (LoopWatch){
+        .fd = fd,
+        .function = function,
+        .context = context,
+    };
+
+    return 0;
+}
+
+void loop_remove(Loop *loop, int fd) {
+    LoopWatch *watch = loop_find(loop, fd);
+    if (watch == NULL)
+        return;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    *watch = loop->watches[--loop->watch_count];
+}
+
+static void loop_handle_signals(void *context, uint32_t events) {
+    Loop *loop = context;
+    struct signalfd_siginfo info;
+
+    while (read(loop->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        LoopSignal *signal = &loop->signals[info.ssi_signo];
+        if (signal->function != NULL)
+            signal->function(signal->context, (int)info.ssi_signo);
+    }
+}
+
+int loop_add_signal(Loop *loop, int signal, LoopSignalFunction function, void *context) {
+    sigset_t signal_set = loop->signal_set;
+    sigaddset(&signal_set, signal);
+
+    /* Blocked first, so none of them get lost in between */
+    if (sigprocmask(SIG_BLOCK, &signal_set, NULL) == -1)
+        return -1;
+
+    int signal_fd = signalfd(loop->signal_fd, &signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+        return -1;
+
+    if (loop->signal_fd == -1) {
+        loop->signal_fd = signal_fd;
+        if (loop_add(loop, signal_fd, EPOLLIN, loop_handle_signals, loop) == -1)
+            return -1;
+    }
+
+    loop->signal_set = signal_set;
+    loop->signals[signal] = (LoopSignal){.function = function, .context = context};
+
+    return 0;
+}
+
+void loop_destroy(Loop *loop) {
+    if (loop->signal_fd != -1) {
+        sigprocmask(SIG_UNBLOCK, &loop->signal_set, NULL);
+        close(loop->signal_fd);
+    }
+
+    close(loop->epoll_fd);
+    free(loop->watches);
+    *loop = (Loop){.epoll_fd = -1, .signal_fd = -1};
+}
+
+int loop_run(Loop *loop) {
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    loop->is_running = 1;
+    while (loop->is_running) {
+        int count = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (int i = 0; i < count && loop->is_running; i++) {
+            /* Might have been removed by an earlier callback */
+            LoopWatch *watch = loop_find(loop, events[i].data.fd);
+            if (watch != NULL)
+                watch->function(watch->context, events[i].events);
+        }
+    }
+
+    return 0;
+}
+
+void loop_stop(Loop *loop) { loop->is_running = 0; }
@@ -0,0 +1,63 @@
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include <signal.h>
+#include <stdint.h>
+
+/* An event loop on top of epoll.
+ *
+ * File descriptors are watched with 'loop_add()', the function is called with the epoll events
+ * that are ready (EPOLLIN, ...). Signals are delivered through a signalfd: 'loop_add_signal()'
+ * blocks the signal, so it is only ever handled from inside the loop, where everything is safe to
+ * call. Children inherit the blocked signals, they have to unblock them after fork(). */
+
+#define LOOP_MAX_EVENTS 16
+
+typedef void (*LoopFunction)(void *context, uint32_t events);
+typedef void (*LoopSignalFunction)(void *context, int signal);
+
+typedef struct {
+    int fd;
+    LoopFunction function;
+    void *context;
+} LoopWatch;
+
+typedef struct {
+    LoopSignalFunction function;
+    void *context;
+} LoopSignal;
+
+typedef struct {
+    int epoll_fd;
+
+    /* Looked up by fd, there are only ever a few of them */
+    LoopWatch *watches;
+    uint32_t watch_count;
+    uint32_t watch_capacity;
+
+    /* -1 until the first signal is added */
+    int signal_fd;
+    sigset_t signal_set;
+    LoopSignal signals[NSIG];
+
+    uint8_t is_running;
+} Loop;
+
+/* Return -1 with errno set on failure */
+int loop_init(Loop *loop);
+int loop_add(Loop *loop, int fd, uint32_t events, LoopFunction function, void *context);
+int loop_add_signal(Loop *loop, int signal, LoopSignalFunction function, void *context);
+
+/* The fd has to be removed before it is closed. Can be called from inside a callback, events that
+ * are still pending for the fd are dropped. */
+void loop_remove(Loop *loop, int fd);
+
+/* Unblocks the signals again */
+void loop_destroy(Loop *loop);
+
+/* Calls the callbacks as events arrive, until 'loop_stop()' is called. Returns -1, if waiting for
+ * events failed. */
+int loop_run(Loop *loop);
+void loop_stop(Loop *loop);
+
+#endif
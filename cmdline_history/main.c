@@ -1,3 +1,13 @@
+#define _GNU_SOURCE
+
+#include "history.h"
+#include "keys.h"
+#include "line.h"
+#include "loop.h"
+#include "screen.h"
+#include "search.h"
+#include "suggest.h"
+
 #include <ctype.h>
 #include <errno.h>
 #include <signal.h>
@@ -7,6 +17,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
 #include <termios.h>
 
 #define ASSERT(condition)                                                                          \
@@ -36,7 +49,12 @@
 
 static struct termios term_attributes_default;
 
+/* Makes the terminal mark pasted text, see 'keys.h' */
+#define TERMINAL_PASTE_ENABLE "\x1b[?2004h"
+#define TERMINAL_PASTE_DISABLE "\x1b[?2004l"
+
 static void terminal_disable_raw_mode(void) {
+    write(STDOUT_FILENO, TERMINAL_PASTE_DISABLE, strlen(TERMINAL_PASTE_DISABLE));
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &term_attributes_default);
 }
 
@@ -90,6 +108,8 @@ static void terminal_enable_raw_mode(void) {
         fprintf(stderr, "error: Unable to apply new config\n");
         exit(1);
     }
+
+    write(STDOUT_FILENO, TERMINAL_PASTE_ENABLE, strlen(TERMINAL_PASTE_ENABLE));
 }
 
 /* Restore cooked mode */
@@ -115,32 +135,30 @@ static void handle_exit_signal(int signal) { terminate(1); }
  *
  * - Since the history is implemented as a ring buffer, it can only
  *   grow and is will subsequently overwrite previous entries.
+ *   The entries are stored in an arena and persisted to a file,
+ *   see 'history.h'.
  *
  * The history consists of three functions:
  * - history_add_entry(): Adds an entry onto the list,
  *   potentially overwriting previous entries.
  * - history_get_next_entry(): Returns the next selected entry.
- * - history_get_previous_entry(): Returns the previous selected entry. */
+ * - history_get_previous_entry(): Returns the previous selected entry.
+ *
+ * The line that is being edited lives in a gap buffer (see 'line.h'), so it can be of any length.
+ * Text is never copied between the input and the history, unless it has to: A submitted line is
+ * copied into the history arena once, the input that is put aside while browsing the history is
+ * moved into the backup and back. Selecting a history entry copies it, since editing it must not
+ * change the history. */
 
-#define HISTORY_MAX_ENTRIES 4
-#define INPUT_MAX_LENGTH 64
+#define HISTORY_MAX_ENTRIES (1 << 17)
+#define HISTORY_ARENA_SIZE (16 << 20)
+#define HISTORY_FILE_NAME ".cmdline_history"
 
 /* Since our intitial input is not part of the history list, we need an
- * indicator to signal that the list is empty or an index is unset. This allows
- * us to use the 0 index as just another entry, without assigning it any special
- * meaning */
-#define HISTORY_NONE_SELECTED_MARK (uint32_t)(-1)
-
-typedef enum {
-    KEY_UP = 512,
-    KEY_DOWN,
-    KEY_LEFT,
-    KEY_RIGHT,
-
-    KEY_ESC = '\x1b',
-    KEY_ENTER = '\x0d',
-    KEY_DEL = '\x7f',
-} KeyCode;
+ * indicator to signal that the list is empty or an index is unset. Entries
+ * are selected by their sequence number (see 'history.h'), which will not
+ * reach this value */
+#define HISTORY_NONE_SELECTED_MARK (uint64_t)(-1)
 
 typedef enum {
     /* The list is empty*/
@@ -157,218 +175,293 @@ typedef enum {
 
 /* In an actual implementation, these variables might be passed to library functions as an opaque
  * pointer */
-typedef struct {
-    char buffer[INPUT_MAX_LENGTH];
-    uint32_t length;
-} InputEntry;
-
 static struct {
-    InputEntry primary_entry;  /* This entry is directly modified by 'input_*()' */
-    InputEntry primary_backup; /* A backup of the primary entry */
+    Line primary_entry;  /* This entry is directly modified by 'input_*()' */
+    Line primary_backup; /* The primary entry, while the history is being browsed */
 } input_state = {0};
 
 static struct {
-    uint32_t selected_entry_index;
-    uint32_t newest_entry_index;
-    InputEntry history[HISTORY_MAX_ENTRIES];
+    uint64_t selected_entry_index;
+    History store;
 } history_state = {
     .selected_entry_index = HISTORY_NONE_SELECTED_MARK,
-    .newest_entry_index = HISTORY_NONE_SELECTED_MARK,
 };
 
-static struct {
-    InputEntry submission;
-} cmdline_state = {0};
+/* Called for every submitted line. The text is borrowed from the history and only valid during the
+ * call. */
+typedef void (*CmdlineSubmitFunction)(void *context, const char *text, uint32_t length);
 
-/* Avoid adding entries that start with blanks */
-static uint8_t entry_is_valid(InputEntry *entry) {
-    if (entry->length == 0)
-        return 1;
+/* The editor runs inside an event loop (see 'loop.h'), which other parts of the program can use to
+ * wait for their own fds. Input is handled as it arrives and every submission is passed to the
+ * submit function right away. */
+static struct {
+    Loop *loop;
+    CmdlineSubmitFunction submit_function;
+    void *submit_context;
+
+    KeyReader keys;
+    Screen screen;
+    /* Armed while a cut off escape sequence waits for the rest of it */
+    int escape_timer_fd;
+    uint8_t is_escape_timer_armed;
+} cmdline_state = {
+    .escape_timer_fd = -1,
+};
 
-    int is_valid = 0;
-    uint32_t index = 0;
-    char *buffer = entry->buffer;
+/* Incremental reverse search, started with Ctrl-R:
+ * - Typing extends the pattern, the current match is kept while it still matches
+ * - Ctrl-R moves on to the next older match
+ * - Ctrl-G leaves the search and keeps the input as it was
+ * - Any other key puts the match into the input, and is processed as usual. Except for ESC, which
+ *   only ends the search. */
+static struct {
+    uint8_t is_active;
+    uint8_t is_failed;
+    Line pattern;
+    uint64_t match; /* HISTORY_NONE_SELECTED_MARK, until something matched */
+    SearchIndex index;
+} search_state = {
+    .match = HISTORY_NONE_SELECTED_MARK,
+};
 
-    while ((is_valid = !isblank(*buffer++)) && index++ < entry->length) {
-        if (is_valid == 1)
-            return 1;
-    }
+/* Fish-style autosuggestion: While the cursor is at the end of the line and no entry is selected,
+ * the rest of the newest entry that starts with the line is shown dimmed after the cursor. RIGHT or
+ * Ctrl-F take it. */
+static struct {
+    SuggestIndex index;
+} suggest_state = {0};
 
-    return is_valid;
+/* Avoid adding entries that are empty or start with blanks */
+static uint8_t entry_is_valid(const char *buffer, uint32_t length) {
+    return length > 0 && !isblank(buffer[0]);
 }
 
-/* Add a new entry to the history list */
-void history_add_entry(InputEntry *entry) {
-    ASSERT(entry != NULL);
+/* Add a new entry to the history list. The text is copied into the history. Duplicates are moved
+ * to the front instead. */
+int history_add_entry(const char *text, uint32_t length) {
+    ASSERT(text != NULL);
 
-    /* The first item to be added to the list should be at index 0 */
-    if (history_state.newest_entry_index == HISTORY_NONE_SELECTED_MARK) {
-        history_state.newest_entry_index = 0;
-    } else {
-        history_state.newest_entry_index =
-            (history_state.newest_entry_index + 1) % HISTORY_MAX_ENTRIES;
-    }
+    if (history_add(&history_state.store, text, length) == -1)
+        return -1;
 
-    // TODO: Ignore duplicate entries
-    InputEntry *top_entry = &history_state.history[history_state.newest_entry_index];
-    memcpy(top_entry, entry, sizeof(*entry));
+    /* The index is built by the first search, until then there is nothing to update */
+    if (search_state.index.is_built)
+        search_sync(&search_state.index, &history_state.store);
+    if (suggest_state.index.is_built)
+        suggest_sync(&suggest_state.index, &history_state.store);
 
     /* Reset the history selection index */
     history_state.selected_entry_index = HISTORY_NONE_SELECTED_MARK;
+
+    return 0;
+}
+
+static void history_handle_evict(void *context, uint64_t sequence, HistoryEntry entry) {
+    search_evict(&search_state.index, sequence, entry);
+    suggest_evict(&suggest_state.index, sequence, entry);
+}
+
+static void history_handle_renumber(void *context, const History *history, uint64_t old_first,
+                                    const uint64_t *sequences) {
+    search_renumber(&search_state.index, history, old_first, sequences);
+    suggest_renumber(&suggest_state.index, history, old_first, sequences);
+}
+
+/* Returns the newest entry in [first, end) that was not removed as a duplicate */
+static uint8_t history_find_older(const History *store, uint64_t end, uint64_t *sequence) {
+    while (end > store->first) {
+        if (!history_is_removed(store, --end)) {
+            *sequence = end;
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 /* Get the next entry from the history buffer and places it into 'entry'.
  * See 'HistoryStatus' for an explanation of the return values. */
-HistoryStatus history_get_next_entry(InputEntry **entry) {
+HistoryStatus history_get_next_entry(HistoryEntry *entry) {
     ASSERT(entry != NULL);
-    uint32_t index = history_state.selected_entry_index;
+    History *store = &history_state.store;
+    uint64_t index = history_state.selected_entry_index;
 
     /* The list is empty */
-    if (history_state.newest_entry_index == HISTORY_NONE_SELECTED_MARK)
+    if (history_count(store) == 0)
         return HIST_EMPTY;
 
     /* This is the first selection. Return the newest entry */
     if (index == HISTORY_NONE_SELECTED_MARK) {
-        history_state.selected_entry_index = history_state.newest_entry_index;
-        *entry = &history_state.history[history_state.selected_entry_index];
+        history_find_older(store, store->next, &history_state.selected_entry_index);
+        *entry = history_get(store, history_state.selected_entry_index);
         return HIST_OK_FIRST_SELECTION;
     }
 
-    /* Wrap around */
-    if (index == 0) {
-        index = HISTORY_MAX_ENTRIES - 1;
-    } else {
-        index -= 1;
-    }
-
-    if (index == history_state.newest_entry_index)
-        return HIST_END;
-
     /* There are no more valid entries */
-    if (history_state.history[index].length == 0)
+    if (!history_find_older(store, index, &index))
         return HIST_END;
 
     history_state.selected_entry_index = index;
-    *entry = &history_state.history[history_state.selected_entry_index];
+    *entry = history_get(store, history_state.selected_entry_index);
 
     return HIST_OK;
 }
 
 /* Get the previous entry from the history buffer. */
-HistoryStatus history_get_previous_entry(InputEntry **entry) {
+HistoryStatus history_get_previous_entry(HistoryEntry *entry) {
     ASSERT(entry != NULL);
-    uint32_t index = history_state.selected_entry_index;
+    History *store = &history_state.store;
+    uint64_t index = history_state.selected_entry_index;
 
     /* List is empty */
-    if (history_state.newest_entry_index == HISTORY_NONE_SELECTED_MARK)
+    if (history_count(store) == 0)
         return HIST_EMPTY;
 
     if (index == HISTORY_NONE_SELECTED_MARK)
         return HIST_LAST_ENTRY;
 
+    do
+        index++;
+    while (index < store->next && history_is_removed(store, index));
+
     /* Reached the end of the list. Restore entry and reset selection. */
-    if (index == history_state.newest_entry_index) {
+    if (index == store->next) {
         history_state.selected_entry_index = HISTORY_NONE_SELECTED_MARK;
         return HIST_LAST_ENTRY;
     }
 
-    /* Wrap around */
-    if (index >= HISTORY_MAX_ENTRIES - 1) {
-        index = 0;
-    } else {
-        index += 1;
-    }
-
-    /* There are no more valid entries */
-    if (history_state.history[index].length == 0)
-        return HIST_END;
-
     history_state.selected_entry_index = index;
-    *entry = &history_state.history[index];
+    *entry = history_get(store, history_state.selected_entry_index);
     return HIST_OK;
 }
 
+/* Moves the primary entry into the backup. A backup that is still around from browsing the history
+ * before the last submission is dropped. */
 void input_save_primary(void) {
-    memcpy(&input_state.primary_backup, &input_state.primary_entry,
-           sizeof(input_state.primary_backup));
+    line_free(&input_state.primary_backup);
+    input_state.primary_backup = input_state.primary_entry;
+    line_init(&input_state.primary_entry);
 }
 
-void input_overwrite_primary(InputEntry *entry) {
+/* The primary entry gets a copy, so editing it leaves the history alone */
+void input_overwrite_primary(HistoryEntry *entry) {
     ASSERT(entry != NULL);
-    memcpy(&input_state.primary_entry, entry, sizeof(input_state.primary_entry));
+    line_set(&input_state.primary_entry, entry->text, entry->length);
 }
 
+/* Moves the backup back into the primary entry */
 void input_restore_primary(void) {
-    memcpy(&input_state.primary_entry, &input_state.primary_backup,
-           sizeof(input_state.primary_entry));
+    line_free(&input_state.primary_entry);
+    input_state.primary_entry = input_state.primary_backup;
+    line_init(&input_state.primary_backup);
 }
 
-void input_clear(void) { memset(&input_state.primary_entry, 0, sizeof(input_state.primary_entry)); }
+void input_clear(void) { line_clear(&input_state.primary_entry); }
 
-/* Add a character to the primary input buffer, until INPUT_MAX_LENGTH length has been reached */
-void input_add_char(char c) {
-    InputEntry *entry = &input_state.primary_entry;
+/* Insert text at the cursor */
+void input_add_text(const char *text, uint32_t length) {
+    line_insert(&input_state.primary_entry, text, length);
+}
 
-    if (entry->length >= INPUT_MAX_LENGTH - 1)
-        return;
+/* Remove the character before the cursor.
+ * Returns 0 if there was nothing to delete. */
+uint8_t input_delete_char(void) { return line_delete_before_cursor(&input_state.primary_entry); }
+
+/* Adds the primary entry to the history and clears it. Returns 0, if the entry was not added. */
+uint8_t input_submit_primary(void) {
+    uint32_t length;
+    const char *text = line_text(&input_state.primary_entry, &length);
+
+    uint8_t is_added = entry_is_valid(text, length) == 1 && history_add_entry(text, length) == 0;
+    input_clear();
 
-    entry->buffer[entry->length++] = c;
+    return is_added;
 }
 
-/* Remove a character from the primary input buffer.
- * NOTE: This function does nothing if there are no
- * characters left. */
-void input_delete_char(void) {
-    InputEntry *entry = &input_state.primary_entry;
+/* Looks for the newest match below 'before' and keeps the previous one, if there is none */
+static void search_update(uint64_t before) {
+    uint32_t length;
+    const char *pattern = line_text(&search_state.pattern, &length);
 
-    if (entry->length <= 0)
+    if (length == 0) {
+        search_state.match = HISTORY_NONE_SELECTED_MARK;
+        search_state.is_failed = 0;
         return;
+    }
+
+    uint64_t match;
+    search_state.is_failed =
+        !search_find(&search_state.index, &history_state.store, pattern, length, before, &match);
 
-    entry->buffer[--entry->length] = '\0';
+    if (!search_state.is_failed)
+        search_state.match = match;
 }
 
-static KeyCode cmdline_read_keycode(void) {
-    char c = 0;
-    uint32_t nread = 0;
+static void search_start(void) {
+    line_clear(&search_state.pattern);
+    search_state.match = HISTORY_NONE_SELECTED_MARK;
+    search_state.is_failed = 0;
+    search_state.is_active = 1;
+}
 
-    if ((nread = read(STDIN_FILENO, &c, 1) == -1) && errno != EAGAIN) {
-        fprintf(stderr, "Failed to read form stdin\r\n");
-        terminate(1);
-    }
+/* Puts the match into the primary entry, as if it had been selected with UP */
+static void search_accept(void) {
+    search_state.is_active = 0;
 
-    if (c == '\x1b') {
-        char buffer[3];
-
-        // FIXME: Just returning KEY_ESC means that any multi byte keycode that
-        //        is not explicitly handled will terminate the program
-        //        if ((nread = read(STDIN_FILENO, buffer, 1) != 1))
-        if ((nread = read(STDIN_FILENO, buffer, 1) != 1))
-            return KEY_ESC; /* ESC */
-        if ((nread = read(STDIN_FILENO, buffer + 1, 1) != 1))
-            return KEY_ESC; /* ESC */
-
-        if (buffer[0] == '[') {
-            switch (buffer[1]) {
-            case 'A': /* UP */
-                return KEY_UP;
-            case 'B': /* DOWN */
-                return KEY_DOWN;
-            case 'C': /* LEFT */
-                // TODO: Move the cursor around?
-                return KEY_LEFT;
-            case 'D': /* RIGHT */
-                // TODO: Move the cursor around?
-                return KEY_RIGHT;
-            }
+    if (search_state.match == HISTORY_NONE_SELECTED_MARK)
+        return;
+
+    if (history_state.selected_entry_index == HISTORY_NONE_SELECTED_MARK)
+        input_save_primary();
+
+    history_state.selected_entry_index = search_state.match;
+
+    HistoryEntry entry = history_get(&history_state.store, search_state.match);
+    input_overwrite_primary(&entry);
+}
+
+/* Returns 0, if the key ended the search and still has to be processed */
+static uint8_t search_handle_key(const KeyEvent *event) {
+    History *store = &history_state.store;
+
+    switch (event->code) {
+    case KEY_CTRL_R:
+        search_update(search_state.match == HISTORY_NONE_SELECTED_MARK ? store->next
+                                                                        : search_state.match);
+        return 1;
+    case KEY_CTRL_G:
+        search_state.is_active = 0;
+        return 1;
+    case KEY_ESC:
+        search_accept();
+        return 1;
+    case KEY_DEL:
+        /* Start over from the newest entry */
+        if (line_delete_before_cursor(&search_state.pattern) == 1) {
+            search_state.match = HISTORY_NONE_SELECTED_MARK;
+            search_update(store->next);
         }
+        return 1;
+    case KEY_TEXT:
+        /* Searching for all of it at once finds the same match as extending the pattern one
+         * character at a time. The current match might still match. */
+        line_insert(&search_state.pattern, event->text, event->length);
+        search_update(search_state.match == HISTORY_NONE_SELECTED_MARK ? store->next
+                                                                        : search_state.match + 1);
+        return 1;
+    case KEY_UNKNOWN:
+        return 1;
+    default:
+        break;
     }
 
-    return c;
+    search_accept();
+    return 0;
 }
 
-static inline void cmdline_handle_key_up(InputEntry *current_entry, uint8_t *entry_modified) {
-    ASSERT(current_entry != NULL);
+static inline void cmdline_handle_key_up(uint8_t *entry_modified) {
     ASSERT(entry_modified != NULL);
+    HistoryEntry current_entry;
     HistoryStatus hist_status = history_get_next_entry(&current_entry);
 
     switch (hist_status) {
@@ -384,15 +477,15 @@ static inline void cmdline_handle_key_up(InputEntry *current_entry, uint8_t *ent
     case HIST_OK_FIRST_SELECTION:
         input_save_primary();
     case HIST_OK:
-        input_overwrite_primary(current_entry);
+        input_overwrite_primary(&current_entry);
         *entry_modified = 1;
         break;
     }
 }
 
-static inline void cmdline_handle_key_down(InputEntry *current_entry, uint8_t *entry_modified) {
-    ASSERT(current_entry != NULL);
+static inline void cmdline_handle_key_down(uint8_t *entry_modified) {
     ASSERT(entry_modified != NULL);
+    HistoryEntry current_entry;
     HistoryStatus hist_status = history_get_previous_entry(&current_entry);
 
     switch (hist_status) {
@@ -408,114 +501,322 @@ static inline void cmdline_handle_key_down(InputEntry *current_entry, uint8_t *e
         isalnum('s');
         break;
     case HIST_OK:
-        input_overwrite_primary(current_entry);
+        input_overwrite_primary(&current_entry);
         *entry_modified = 1;
         break;
     }
 }
 
-void cmdline_clear(void) {
-    char *clear_sequence = "\r\x1b[2K";
-    write(STDOUT_FILENO, clear_sequence, strlen(clear_sequence));
+/* Returns 1 and the suggested entry, if there is a suggestion for the primary entry */
+static uint8_t suggest_lookup(HistoryEntry *suggestion) {
+    Line *current_input = &input_state.primary_entry;
+    uint64_t sequence;
+
+    if (history_state.selected_entry_index != HISTORY_NONE_SELECTED_MARK ||
+        line_after_cursor_length(current_input) > 0)
+        return 0;
+
+    if (!suggest_find(&suggest_state.index, &history_state.store,
+                      line_before_cursor(current_input), line_length(current_input), &sequence))
+        return 0;
+
+    *suggestion = history_get(&history_state.store, sequence);
+    return 1;
+}
+
+/* Appends the rest of the suggestion to the primary entry. Returns 0, if there is none. */
+static uint8_t suggest_accept(void) {
+    HistoryEntry suggestion;
+    uint32_t length = line_length(&input_state.primary_entry);
+
+    if (!suggest_lookup(&suggestion))
+        return 0;
+
+    input_add_text(suggestion.text + length, suggestion.length - length);
+    return 1;
 }
 
-void cmdline_render_entry(InputEntry *entry) {
-    cmdline_clear();
+void cmdline_render_entry(Line *entry) {
+    Screen *screen = &cmdline_state.screen;
+    HistoryEntry suggestion;
 
     if (entry != NULL) {
-        write(STDOUT_FILENO, entry->buffer, entry->length);
+        screen_append(screen, line_before_cursor(entry), line_before_cursor_length(entry));
+        screen_append(screen, line_after_cursor(entry), line_after_cursor_length(entry));
+
+        if (entry == &input_state.primary_entry && suggest_lookup(&suggestion)) {
+            uint32_t length = line_length(entry);
+            screen_append_hint(screen, suggestion.text + length, suggestion.length - length);
+        }
     }
+
+    screen_present(screen, entry != NULL ? line_before_cursor_length(entry) : 0);
 }
 
-/* Read and process input */
-void cmdline_update(unsigned char *is_running) {
-    ASSERT(is_running != NULL);
-    InputEntry *current_input = &input_state.primary_entry;
+void cmdline_render_search(void) {
+    Screen *screen = &cmdline_state.screen;
+    uint32_t pattern_length;
+    const char *pattern = line_text(&search_state.pattern, &pattern_length);
+    const char *prompt =
+        search_state.is_failed ? "(failed reverse-i-search)'" : "(reverse-i-search)'";
+
+    screen_append(screen, prompt, (uint32_t)strlen(prompt));
+    screen_append(screen, pattern, pattern_length);
+    screen_append(screen, "': ", 3);
+
+    uint32_t cursor = (uint32_t)strlen(prompt) + pattern_length + 3;
+
+    if (search_state.match != HISTORY_NONE_SELECTED_MARK) {
+        HistoryEntry entry = history_get(&history_state.store, search_state.match);
+        screen_append(screen, entry.text, entry.length);
+
+        /* Put the cursor onto the matching part */
+        const char *found = memmem(entry.text, entry.length, pattern, pattern_length);
+        cursor += found != NULL && pattern_length > 0 ? (uint32_t)(found - entry.text)
+                                                      : entry.length;
+    }
+
+    screen_present(screen, cursor);
+}
+
+static void cmdline_render(void) {
+    if (search_state.is_active)
+        cmdline_render_search();
+    else
+        cmdline_render_entry(&input_state.primary_entry);
+}
+
+/* Returns 1, if the key changed what is on screen */
+static uint8_t cmdline_handle_key(const KeyEvent *event) {
+    Line *current_input = &input_state.primary_entry;
+    History *store = &history_state.store;
     uint8_t input_modified = 0;
 
-    memset(&cmdline_state.submission, 0, sizeof(cmdline_state.submission));
+    if (search_state.is_active) {
+        if (search_handle_key(event) == 1)
+            return 1;
 
-    KeyCode c = cmdline_read_keycode();
+        input_modified = 1;
+    }
 
     // TODO: Clean this mess...
-    switch (c) {
+    switch (event->code) {
     case KEY_UP:
-        cmdline_handle_key_up(current_input, &input_modified);
+        cmdline_handle_key_up(&input_modified);
         break;
     case KEY_DOWN:
-        cmdline_handle_key_down(current_input, &input_modified);
+        cmdline_handle_key_down(&input_modified);
         break;
     case KEY_LEFT:
+        input_modified = line_move_left(current_input);
+        break;
     case KEY_RIGHT:
+    case KEY_CTRL_F:
+        /* At the end of the line, there is nowhere to move but into the suggestion */
+        input_modified = line_move_right(current_input) || suggest_accept();
+        break;
     case KEY_ESC:
-        *is_running = 0;
-        return;
+        loop_stop(cmdline_state.loop);
+        return 0;
     case KEY_ENTER:
-        if (entry_is_valid(current_input) == 1) {
-            history_add_entry(current_input);
-            memcpy(&cmdline_state.submission, &input_state.primary_entry,
-                   sizeof(cmdline_state.submission));
+        if (input_submit_primary() == 1) {
+            HistoryEntry submission = history_get(store, store->next - 1);
+            cmdline_state.submit_function(cmdline_state.submit_context, submission.text,
+                                          submission.length);
         }
 
-        input_clear();
         input_modified = 1;
         break;
     case KEY_DEL:
-        input_delete_char();
+        input_modified = input_delete_char();
+        break;
+    case KEY_CTRL_R:
+        search_start();
+        return 1;
+    case KEY_CTRL_G: /* Only ends the search */
+        break;
+    case KEY_TEXT:
+        input_add_text(event->text, event->length);
         input_modified = 1;
         break;
+    default:
+        break;
     }
 
-    if (c >= 0x20 && c < 0x7f) {
-        input_add_char(c);
-        input_modified = 1;
+    return input_modified;
+}
+
+static void cmdline_arm_escape_timer(uint8_t is_armed) {
+    if (is_armed == cmdline_state.is_escape_timer_armed && !is_armed)
+        return;
+
+    struct itimerspec timeout = {
+        .it_value.tv_nsec = is_armed ? KEYS_ESCAPE_TIMEOUT_MS * 1000000L : 0,
+    };
+
+    timerfd_settime(cmdline_state.escape_timer_fd, 0, &timeout, NULL);
+    cmdline_state.is_escape_timer_armed = is_armed;
+}
+
+/* Processes all keys in the buffer, before the line is redrawn once. A cut off escape sequence is
+ * only taken as it is when flushing, until then the timer waits for the rest of it. */
+static void cmdline_process_keys(uint8_t is_flushing) {
+    KeyReader *keys = &cmdline_state.keys;
+    KeyEvent event;
+    uint8_t input_modified = 0;
+
+    while (cmdline_state.loop->is_running && keys_next(keys, &event, is_flushing))
+        input_modified |= cmdline_handle_key(&event);
+
+    if (!cmdline_state.loop->is_running)
+        return;
+
+    cmdline_arm_escape_timer(keys_is_pending(keys));
+
+    if (input_modified == 1)
+        cmdline_render();
+}
+
+static void cmdline_handle_input(void *context, uint32_t events) {
+    KeysStatus status = keys_read(&cmdline_state.keys, 0);
+
+    if (status == KEYS_EOF) {
+        loop_stop(cmdline_state.loop);
+        return;
     }
 
-    if (input_modified == 1) {
-        cmdline_render_entry(current_input);
+    if (status == KEYS_ERROR) {
+        fprintf(stderr, "Failed to read form stdin\r\n");
+        terminate(1);
     }
+
+    cmdline_process_keys(0);
 }
 
-uint8_t cmdline_has_submission(char **string, uint32_t *string_length) {
-    if (cmdline_state.submission.length > 0) {
-        *string = cmdline_state.submission.buffer;
-        *string_length = cmdline_state.submission.length;
+static void cmdline_handle_escape_timeout(void *context, uint32_t events) {
+    uint64_t expirations;
+    if (read(cmdline_state.escape_timer_fd, &expirations, sizeof(expirations)) == -1)
+        return;
 
-        return 1;
-    }
+    cmdline_state.is_escape_timer_armed = 0;
+    cmdline_process_keys(1);
+}
+
+/* The terminal might have reflowed the line, so it is drawn from scratch */
+static void cmdline_handle_resize(void *context, int signal) {
+    screen_invalidate(&cmdline_state.screen);
+    cmdline_render();
+}
+
+/* Prints 'text' above the line that is being edited, it has to end with a line break */
+void cmdline_print(const char *text, uint32_t length) {
+    screen_print(&cmdline_state.screen, text, length);
+    cmdline_render();
+}
+
+/* Starts editing, the terminal has to be in raw mode. Returns -1 with errno set on failure. */
+int cmdline_start(Loop *loop, CmdlineSubmitFunction submit_function, void *submit_context) {
+    cmdline_state.loop = loop;
+    cmdline_state.submit_function = submit_function;
+    cmdline_state.submit_context = submit_context;
+
+    keys_init(&cmdline_state.keys, STDIN_FILENO);
+    screen_init(&cmdline_state.screen, STDOUT_FILENO);
+
+    cmdline_state.escape_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (cmdline_state.escape_timer_fd == -1)
+        return -1;
+
+    if (loop_add(loop, STDIN_FILENO, EPOLLIN, cmdline_handle_input, NULL) == -1 ||
+        loop_add(loop, cmdline_state.escape_timer_fd, EPOLLIN, cmdline_handle_escape_timeout,
+                 NULL) == -1 ||
+        loop_add_signal(loop, SIGWINCH, cmdline_handle_resize, NULL) == -1)
+        return -1;
 
     return 0;
 }
 
-#define DEBUG_HIST_ADD_ENTRY(value)                                                                \
-    history_add_entry(&(InputEntry){.buffer = (value), .length = strlen((value))})
+void cmdline_stop(void) {
+    loop_remove(cmdline_state.loop, STDIN_FILENO);
 
-int main(void) {
-    uint8_t is_running = 1;
+    if (cmdline_state.escape_timer_fd != -1) {
+        loop_remove(cmdline_state.loop, cmdline_state.escape_timer_fd);
+        close(cmdline_state.escape_timer_fd);
+        cmdline_state.escape_timer_fd = -1;
+    }
 
-    terminal_enable_raw_mode();
+    screen_free(&cmdline_state.screen);
+}
 
-    signal(SIGINT, handle_exit_signal);
-    signal(SIGABRT, handle_exit_signal);
+static void handle_submission(void *context, const char *text, uint32_t length) {
+    char *message;
+    int message_length = asprintf(&message, "Got submission: %.*s\r\n", (int)length, text);
+    if (message_length == -1)
+        return;
 
-    DEBUG_HIST_ADD_ENTRY("1. one");
-    DEBUG_HIST_ADD_ENTRY("2. I am the oldest entry!");
-    DEBUG_HIST_ADD_ENTRY("3. three");
-    DEBUG_HIST_ADD_ENTRY("4. four");
-    DEBUG_HIST_ADD_ENTRY("5. I am the newest, and I overwrote the first entry!");
+    cmdline_print(message, (uint32_t)message_length);
+    free(message);
+}
 
-    char *string;
-    uint32_t string_length;
+static void handle_interrupt(void *context, int signal) { terminate(1); }
 
-    while (is_running) {
-        cmdline_update(&is_running);
+/* Usage: main [history file]
+ * The history file defaults to '~/.cmdline_history'. */
+int main(int argc, char **argv) {
+    char path[4096];
+    Loop loop;
 
-        if (cmdline_has_submission(&string, &string_length)) {
-            printf("Got submission: %s\r\n", string);
-        }
+    if (argc > 1) {
+        snprintf(path, sizeof(path), "%s", argv[1]);
+    } else {
+        const char *home = getenv("HOME");
+        snprintf(path, sizeof(path), "%s/%s", home != NULL ? home : ".", HISTORY_FILE_NAME);
+    }
+
+    if (history_init(&history_state.store, HISTORY_MAX_ENTRIES, HISTORY_ARENA_SIZE) == -1) {
+        fprintf(stderr, "error: Failed to set up the history\n");
+        return 1;
+    }
+
+    search_init(&search_state.index);
+    history_state.store.is_deduplicated = 1;
+    history_state.store.listener = (HistoryListener){
+        .evict = history_handle_evict,
+        .renumber = history_handle_renumber,
+    };
+
+    /* The history still works without the file, it just does not outlive the program */
+    if (history_load(&history_state.store, path) == -1)
+        fprintf(stderr, "warning: Failed to load '%s': %s\n", path, strerror(errno));
+
+    if (loop_init(&loop) == -1) {
+        fprintf(stderr, "error: Failed to set up the event loop: %s\n", strerror(errno));
+        return 1;
+    }
+
+    terminal_enable_raw_mode();
+
+    if (cmdline_start(&loop, handle_submission, NULL) == -1 ||
+        loop_add_signal(&loop, SIGINT, handle_interrupt, NULL) == -1) {
+        fprintf(stderr, "error: Failed to start the editor: %s\r\n", strerror(errno));
+        terminate(1);
     }
 
+    signal(SIGABRT, handle_exit_signal);
+
+    if (loop_run(&loop) == -1)
+        fprintf(stderr, "error: Failed to wait for input: %s\r\n", strerror(errno));
+
+    cmdline_stop();
+    loop_destroy(&loop);
     terminal_disable_raw_mode();
 
+    line_free(&input_state.primary_entry);
+    line_free(&input_state.primary_backup);
+    history_destroy(&history_state.store);
+    search_destroy(&search_state.index);
+    line_free(&search_state.pattern);
+    suggest_destroy(&suggest_state.index);
+
     return 0;
 }
@@ -0,0 +1,185 @@
+#include "screen.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCREEN_MIN_CAPACITY 256
+/* Bright black, which is grey on most terminals */
+#define SCREEN_HINT_STYLE "\x1b[90m"
+#define SCREEN_RESET_STYLE "\x1b[m"
+
+static void buffer_append(ScreenBuffer *buffer, const char *text, uint32_t length) {
+    if (length == 0)
+        return;
+
+    if (buffer->capacity - buffer->length < length) {
+        uint32_t capacity =
+            buffer->capacity < SCREEN_MIN_CAPACITY ? SCREEN_MIN_CAPACITY : buffer->capacity;
+        while (capacity - buffer->length < length)
+            capacity *= 2;
+
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "error: Failed to grow the screen buffer to %u bytes\r\n", capacity);
+            abort();
+        }
+
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+void screen_init(Screen *screen, int fd) {
+    *screen = (Screen){
+        .fd = fd,
+        .shown_hint = SCREEN_NO_HINT,
+        .next_hint = SCREEN_NO_HINT,
+    };
+}
+
+void screen_free(Screen *screen) {
+    free(screen->shown.data);
+    free(screen->next.data);
+    free(screen->output.data);
+    screen_init(screen, screen->fd);
+}
+
+void screen_append(Screen *screen, const char *text, uint32_t length) {
+    buffer_append(&screen->next, text, length);
+}
+
+void screen_append_hint(Screen *screen, const char *text, uint32_t length) {
+    screen->next_hint = screen->next.length;
+    buffer_append(&screen->next, text, length);
+}
+
+/* Moves the cursor from 'from' to 'to'. Going right, the characters in between are 'text', which
+ * are only printed again if none of them are part of the hint that starts at 'hint'. */
+static void screen_move(Screen *screen, uint32_t from, uint32_t to, const char *text,
+                        uint32_t hint) {
+    ScreenBuffer *output = &screen->output;
+    char sequence[16];
+    int length;
+
+    if (from == to)
+        return;
+
+    if (to == 0) {
+        buffer_append(output, "\r", 1);
+    } else if (to + 1 == from) {
+        buffer_append(output, "\b", 1);
+    } else if (to < from) {
+        length = snprintf(sequence, sizeof(sequence), "\x1b[%uD", from - to);
+        buffer_append(output, sequence, (uint32_t)length);
+    } else {
+        length = snprintf(sequence, sizeof(sequence), "\x1b[%uC", to - from);
+        if (to - from <= (uint32_t)length && to <= hint)
+            buffer_append(output, text + from, to - from);
+        else
+            buffer_append(output, sequence, (uint32_t)length);
+    }
+}
+
+static void screen_write(Screen *screen) {
+    const char *data = screen->output.data;
+    uint32_t remaining = screen->output.length;
+
+    while (remaining > 0) {
+        ssize_t written = write(screen->fd, data, remaining);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        data += written;
+        remaining -= (uint32_t)written;
+    }
+
+    screen->output.length = 0;
+}
+
+void screen_present(Screen *screen, uint32_t cursor) {
+    ScreenBuffer *shown = &screen->shown;
+    ScreenBuffer *next = &screen->next;
+
+    uint32_t common = shown->length < next->length ? shown->length : next->length;
+    /* Columns after the first hint start might look different now */
+    if (screen->shown_hint != screen->next_hint) {
+        uint32_t hint =
+            screen->shown_hint < screen->next_hint ? screen->shown_hint : screen->next_hint;
+        if (hint < common)
+            common = hint;
+    }
+
+    uint32_t prefix = 0;
+    while (prefix < common && shown->data[prefix] == next->data[prefix])
+        prefix++;
+
+    if (prefix < next->length || prefix < shown->length) {
+        /* If the line keeps its length, the columns at the end that look the same are left alone.
+         * Typing what the hint suggested only turns that character into text. */
+        uint32_t end = next->length;
+        if (next->length == shown->length) {
+            while (end > prefix && shown->data[end - 1] == next->data[end - 1] &&
+                   (end - 1 >= screen->shown_hint) == (end - 1 >= screen->next_hint))
+                end--;
+        }
+
+        screen_move(screen, screen->cursor, prefix, next->data, screen->next_hint);
+
+        uint32_t hint = screen->next_hint < end ? screen->next_hint : end;
+        if (prefix < hint)
+            buffer_append(&screen->output, next->data + prefix, hint - prefix);
+
+        if (hint < end) {
+            uint32_t start = prefix > hint ? prefix : hint;
+            buffer_append(&screen->output, SCREEN_HINT_STYLE, sizeof(SCREEN_HINT_STYLE) - 1);
+            buffer_append(&screen->output, next->data + start, end - start);
+            buffer_append(&screen->output, SCREEN_RESET_STYLE, sizeof(SCREEN_RESET_STYLE) - 1);
+        }
+
+        if (next->length < shown->length)
+            buffer_append(&screen->output, "\x1b[K", 3);
+
+        screen->cursor = end;
+    }
+
+    screen_move(screen, screen->cursor, cursor, next->data, screen->next_hint);
+    screen->cursor = cursor;
+    screen_write(screen);
+
+    ScreenBuffer frame = *shown;
+    *shown = *next;
+    *next = frame;
+    next->length = 0;
+
+    screen->shown_hint = screen->next_hint;
+    screen->next_hint = SCREEN_NO_HINT;
+}
+
+void screen_reset(Screen *screen) {
+    screen->shown.length = 0;
+    screen->shown_hint = SCREEN_NO_HINT;
+    screen->cursor = 0;
+}
+
+void screen_print(Screen *screen, const char *text, uint32_t length) {
+    screen_move(screen, screen->cursor, 0, NULL, SCREEN_NO_HINT);
+    if (screen->shown.length > 0)
+        buffer_append(&screen->output, "\x1b[K", 3);
+
+    buffer_append(&screen->output, text, length);
+    screen_reset(screen);
+}
+
+void screen_invalidate(Screen *screen) {
+    buffer_append(&screen->output, "\r\x1b[K", 4);
+    screen_reset(screen);
+}
@@ -0,0 +1,62 @@
+#ifndef _SCREEN_H_
+#define _SCREEN_H_
+
+#include <stdint.h>
+
+/* Redraws the line the editor is on with as few bytes as possible.
+ *
+ * The screen remembers what the terminal line shows and where the cursor is. A frame is put
+ * together with 'screen_append()' and compared to that by 'screen_present()': Only the part after
+ * the longest common prefix is written, followed by an erase to the end of the line, if the line
+ * got shorter. The cursor is moved with whatever is shorter, a relative move or printing the
+ * characters it passes over. Everything a frame needs goes out with a single write().
+ *
+ * The end of a frame can be a hint, which is drawn dimmed. Its bytes are compared like the others,
+ * but a column that changes from hint to text or back is redrawn.
+ *
+ * Like the rest of the editor, this assumes that the line fits into one row of the terminal. */
+
+#define SCREEN_NO_HINT UINT32_MAX
+
+typedef struct {
+    char *data;
+    uint32_t length;
+    uint32_t capacity;
+} ScreenBuffer;
+
+typedef struct {
+    int fd;
+    /* What the terminal line shows and the column of the cursor on it */
+    ScreenBuffer shown;
+    uint32_t cursor;
+    /* The column the hint starts at, SCREEN_NO_HINT if there is none */
+    uint32_t shown_hint;
+    /* The frame that is being put together */
+    ScreenBuffer next;
+    uint32_t next_hint;
+    ScreenBuffer output;
+} Screen;
+
+void screen_init(Screen *screen, int fd);
+void screen_free(Screen *screen);
+
+void screen_append(Screen *screen, const char *text, uint32_t length);
+/* Appends the hint, nothing else can be appended after it */
+void screen_append_hint(Screen *screen, const char *text, uint32_t length);
+
+/* Makes the terminal show the frame, with the cursor at column 'cursor', and starts a new one */
+void screen_present(Screen *screen, uint32_t cursor);
+
+/* Has to be called after writing anything else to the terminal. Assumes that the cursor was left at
+ * the start of an empty line. */
+void screen_reset(Screen *screen);
+
+/* Replaces the line with 'text', which has to end with a line break. The next frame is drawn on the
+ * line below it. Goes out with the next frame. */
+void screen_print(Screen *screen, const char *text, uint32_t length);
+
+/* Nothing is known about the line anymore (the terminal was resized, for example). The next frame
+ * clears it and draws everything. */
+void screen_invalidate(Screen *screen);
+
+#endif
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+
+#include "search.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_MIN_SLOTS 1024
+#define SEARCH_MIN_POSTINGS 4
+/* Candidates are only checked against the lists of the first trigrams, memmem() does the rest */
+#define SEARCH_MAX_FILTERS 16
+
+static void *search_realloc(void *data, size_t size) {
+    data = realloc(data, size);
+    if (data == NULL) {
+        fprintf(stderr, "error: Failed to grow the search index to %zu bytes\r\n", size);
+        abort();
+    }
+
+    return data;
+}
+
+static uint32_t trigram_key(const char *text) {
+    return (1u << 24) | ((uint32_t)(unsigned char)text[0] << 16) |
+           ((uint32_t)(unsigned char)text[1] << 8) | (uint32_t)(unsigned char)text[2];
+}
+
+static uint32_t slot_hash(const SearchIndex *index, uint32_t key) {
+    return (key * 2654435761u) & (index->slot_count - 1);
+}
+
+static SearchSlot *search_lookup(const SearchIndex *index, uint32_t key) {
+    if (index->slot_count == 0)
+        return NULL;
+
+    for (uint32_t i = slot_hash(index, key);; i = (i + 1) & (index->slot_count - 1)) {
+        if (index->slots[i].key == key)
+            return &index->slots[i];
+        if (index->slots[i].key == 0)
+            return NULL;
+    }
+}
+
+static void search_grow(SearchIndex *index) {
+    SearchSlot *slots = index->slots;
+    uint32_t slot_count = index->slot_count;
+
+    index->slot_count = slot_count == 0 ? SEARCH_MIN_SLOTS : slot_count * 2;
+    index->slots = calloc(index->slot_count, sizeof(*index->slots));
+    if (index->slots == NULL) {
+        fprintf(stderr, "error: Failed to grow the search index\r\n");
+        abort();
+    }
+
+    for (uint32_t i = 0; i < slot_count; i++) {
+        if (slots[i].key == 0)
+            continue;
+
+        uint32_t j = slot_hash(index, slots[i].key);
+        while (index->slots[j].key != 0)
+            j = (j + 1) & (index->slot_count - 1);
+
+        index->slots[j] = slots[i];
+    }
+
+    free(slots);
+}
+
+static SearchSlot *search_insert(SearchIndex *index, uint32_t key) {
+    /* Keep the table at most half full */
+    if ((index->used_count + 1) * 2 > index->slot_count)
+        search_grow(index);
+
+    uint32_t i = slot_hash(index, key);
+    while (index->slots[i].key != key && index->slots[i].key != 0)
+        i = (i + 1) & (index->slot_count - 1);
+
+    if (index->slots[i].key == 0) {
+        index->slots[i].key = key;
+        index->used_count++;
+    }
+
+    return &index->slots[i];
+}
+
+static void postings_append(SearchPostings *postings, uint32_t sequence) {
+    /* The trigram appeared earlier in the same entry */
+    if (postings->end > postings->start && postings->sequences[postings->end - 1] == sequence)
+        return;
+
+    if (postings->end == postings->capacity) {
+        /* Reuse the room in front of the list, once at least half of it is unused */
+        if (postings->start >= postings->capacity / 2 && postings->start > 0) {
+            memmove(postings->sequences, postings->sequences + postings->start,
+                    (postings->end - postings->start) * sizeof(*postings->sequences));
+            postings->end -= postings->start;
+            postings->start = 0;
+        } else {
+            postings->capacity =
+                postings->capacity == 0 ? SEARCH_MIN_POSTINGS : postings->capacity * 2;
+            postings->sequences = search_realloc(
+                postings->sequences, postings->capacity * sizeof(*postings->sequences));
+        }
+    }
+
+    postings->sequences[postings->end++] = sequence;
+}
+
+/* Turns a stored sequence number back into 64 bits, every live one is at least 'first' */
+static uint64_t postings_get(const SearchPostings *postings, uint32_t position, uint64_t first) {
+    return first + (uint32_t)(postings->sequences[position] - (uint32_t)first);
+}
+
+/* Returns the position of the first entry that is not below 'sequence' */
+static uint32_t postings_lower_bound(const SearchPostings *postings, uint64_t sequence,
+                                     uint64_t first) {
+    uint32_t low = postings->start;
+    uint32_t high = postings->end;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (postings_get(postings, middle, first) < sequence)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+static uint8_t postings_contain(const SearchPostings *postings, uint64_t sequence,
+                                uint64_t first) {
+    uint32_t position = postings_lower_bound(postings, sequence, first);
+    return position < postings->end && postings_get(postings, position, first) == sequence;
+}
+
+void search_init(SearchIndex *index) { *index = (SearchIndex){0}; }
+
+void search_destroy(SearchIndex *index) {
+    for (uint32_t i = 0; i < index->slot_count; i++)
+        free(index->slots[i].postings.sequences);
+
+    free(index->slots);
+    free(index->blocks);
+    search_init(index);
+}
+
+/* The NUL terminator is part of the last trigram, see 'search.h' */
+static uint32_t entry_trigram_count(HistoryEntry entry) {
+    return entry.length < 2 ? 0 : entry.length - 1;
+}
+
+static void search_add_bytes(SearchIndex *index, uint64_t sequence, HistoryEntry entry) {
+    uint64_t id = sequence / SEARCH_BLOCK_SIZE;
+    SearchBlock *block = &index->blocks[id & (index->block_count - 1)];
+    if (block->id != id)
+        *block = (SearchBlock){.id = id};
+
+    for (uint32_t i = 0; i < entry.length; i++) {
+        unsigned char byte = (unsigned char)entry.text[i];
+        block->bytes[byte / 64] |= 1ull << (byte % 64);
+    }
+}
+
+static void search_add(SearchIndex *index, uint64_t sequence, HistoryEntry entry) {
+    for (uint32_t i = 0; i < entry_trigram_count(entry); i++) {
+        SearchSlot *slot = search_insert(index, trigram_key(entry.text + i));
+        postings_append(&slot->postings, (uint32_t)sequence);
+    }
+
+    search_add_bytes(index, sequence, entry);
+}
+
+static void search_clear_blocks(SearchIndex *index) {
+    for (uint32_t i = 0; i < index->block_count; i++)
+        index->blocks[i] = (SearchBlock){.id = UINT64_MAX};
+}
+
+void search_sync(SearchIndex *index, const History *history) {
+    if (index->blocks == NULL) {
+        index->block_count = 1;
+        while (index->block_count < history->entry_capacity / SEARCH_BLOCK_SIZE + 2)
+            index->block_count *= 2;
+
+        index->blocks = search_realloc(NULL, index->block_count * sizeof(*index->blocks));
+        search_clear_blocks(index);
+    }
+
+    uint64_t sequence = index->indexed_end > history->first ? index->indexed_end : history->first;
+
+    for (; sequence < history->next; sequence++)
+        search_add(index, sequence, history_get(history, sequence));
+
+    index->indexed_end = history->next;
+    index->is_built = 1;
+}
+
+void search_evict(SearchIndex *index, uint64_t sequence, HistoryEntry entry) {
+    if (sequence >= index->indexed_end)
+        return;
+
+    for (uint32_t i = 0; i < entry_trigram_count(entry); i++) {
+        SearchSlot *slot = search_lookup(index, trigram_key(entry.text + i));
+        if (slot == NULL)
+            continue;
+
+        /* Repeated trigrams were only added once */
+        SearchPostings *postings = &slot->postings;
+        if (postings->end > postings->start &&
+            postings->sequences[postings->start] == (uint32_t)sequence)
+            postings->start++;
+
+        if (postings->start == postings->end)
+            postings->start = postings->end = 0;
+    }
+}
+
+/* Postings keep their order, since the renumbering does. The blocks are simply rebuilt. */
+void search_renumber(SearchIndex *index, const History *history, uint64_t old_first,
+                     const uint64_t *sequences) {
+    if (!index->is_built)
+        return;
+
+    for (uint32_t i = 0; i < index->slot_count; i++) {
+        SearchPostings *postings = &index->slots[i].postings;
+        uint32_t end = 0;
+
+        for (uint32_t j = postings->start; j < postings->end; j++) {
+            uint64_t sequence = sequences[postings_get(postings, j, old_first) - old_first];
+            if (sequence != HISTORY_SEQUENCE_NONE)
+                postings->sequences[end++] = (uint32_t)sequence;
+        }
+
+        postings->start = 0;
+        postings->end = end;
+
+        /* Lists of trigrams that mostly appeared in duplicates give their memory back */
+        if (postings->capacity > SEARCH_MIN_POSTINGS && end < postings->capacity / 4) {
+            postings->capacity = end < SEARCH_MIN_POSTINGS ? SEARCH_MIN_POSTINGS : end * 2;
+            postings->sequences = search_realloc(
+                postings->sequences, postings->capacity * sizeof(*postings->sequences));
+        }
+    }
+
+    uint64_t indexed_end = history->first;
+    for (uint64_t old = index->indexed_end; old-- > old_first;) {
+        if (sequences[old - old_first] != HISTORY_SEQUENCE_NONE) {
+            indexed_end = sequences[old - old_first] + 1;
+            break;
+        }
+    }
+
+    index->indexed_end = indexed_end;
+
+    search_clear_blocks(index);
+    for (uint64_t sequence = history->first; sequence < indexed_end; sequence++)
+        search_add_bytes(index, sequence, history_get(history, sequence));
+}
+
+static uint8_t entry_contains(const History *history, uint64_t sequence, const char *pattern,
+                              uint32_t length) {
+    HistoryEntry entry = history_get(history, sequence);
+    return memmem(entry.text, entry.length, pattern, length) != NULL;
+}
+
+/* Blocks might still have bits set for evicted or removed entries, so only the live ones are
+ * scanned */
+static uint8_t search_find_byte(const SearchIndex *index, const History *history, char byte,
+                                uint64_t before, uint64_t *sequence) {
+    unsigned char bit = (unsigned char)byte;
+
+    for (uint64_t id = before / SEARCH_BLOCK_SIZE; before > history->first; id--) {
+        const SearchBlock *block = &index->blocks[id & (index->block_count - 1)];
+        uint64_t block_start = id * SEARCH_BLOCK_SIZE;
+
+        if (block->id == id && (block->bytes[bit / 64] & (1ull << (bit % 64))) != 0) {
+            for (uint64_t candidate = before; candidate-- > block_start &&
+                                              candidate >= history->first;) {
+                if (!history_is_removed(history, candidate) &&
+                    entry_contains(history, candidate, &byte, 1)) {
+                    *sequence = candidate;
+                    return 1;
+                }
+            }
+        }
+
+        before = block_start;
+    }
+
+    return 0;
+}
+
+/* Every trigram that starts with the pair could hold the newest match */
+static uint8_t search_find_pair(const SearchIndex *index, const History *history,
+                                const char *pattern, uint64_t before, uint64_t *sequence) {
+    uint8_t is_found = 0;
+    char trigram[3] = {pattern[0], pattern[1]};
+
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        trigram[2] = (char)byte;
+
+        SearchSlot *slot = search_lookup(index, trigram_key(trigram));
+        if (slot == NULL)
+            continue;
+
+        uint32_t position = postings_lower_bound(&slot->postings, before, history->first);
+        uint64_t candidate = 0;
+
+        while (position > slot->postings.start &&
+               history_is_removed(history,
+                                  candidate = postings_get(&slot->postings, position - 1,
+                                                           history->first)))
+            position--;
+
+        if (position == slot->postings.start)
+            continue;
+
+        if (!is_found || candidate > *sequence) {
+            *sequence = candidate;
+            is_found = 1;
+        }
+    }
+
+    return is_found;
+}
+
+uint8_t search_find(SearchIndex *index, const History *history, const char *pattern,
+                    uint32_t length, uint64_t before, uint64_t *sequence) {
+    if (before > history->next)
+        before = history->next;
+
+    if (length == 0)
+        return 0;
+
+    search_sync(index, history);
+
+    if (length == 1)
+        return search_find_byte(index, history, pattern[0], before, sequence);
+    if (length == 2)
+        return search_find_pair(index, history, pattern, before, sequence);
+
+    const SearchPostings *filters[SEARCH_MAX_FILTERS];
+    uint32_t filter_count = 0;
+    const SearchPostings *rarest = NULL;
+
+    for (uint32_t i = 0; i + 3 <= length; i++) {
+        SearchSlot *slot = search_lookup(index, trigram_key(pattern + i));
+        if (slot == NULL || slot->postings.start == slot->postings.end)
+            return 0;
+
+        const SearchPostings *postings = &slot->postings;
+        if (rarest == NULL || postings->end - postings->start < rarest->end - rarest->start)
+            rarest = postings;
+        if (filter_count < SEARCH_MAX_FILTERS)
+            filters[filter_count++] = postings;
+    }
+
+    /* Newest candidates first */
+    uint32_t position = postings_lower_bound(rarest, before, history->first);
+    while (position-- > rarest->start) {
+        uint64_t candidate = postings_get(rarest, position, history->first);
+
+        uint32_t i = 0;
+        while (i < filter_count &&
+               (filters[i] == rarest || postings_contain(filters[i], candidate, history->first)))
+            i++;
+
+        if (i == filter_count && !history_is_removed(history, candidate) &&
+            entry_contains(history, candidate, pattern, length)) {
+            *sequence = candidate;
+            return 1;
+        }
+    }
+
+    return 0;
+}
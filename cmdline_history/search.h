@@ -0,0 +1,83 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include "history.h"
+
+#include <stdint.h>
+
+/* Substring search over the history.
+ *
+ * Every entry is split into trigrams (all runs of three bytes) and for every trigram, the index
+ * keeps a posting list of the entries that contain it, oldest first. A pattern can only be found in
+ * entries that contain all of its trigrams: The candidates are taken from the shortest posting
+ * list of the pattern, newest first, checked against the other lists by binary search and verified
+ * with memmem().
+ *
+ * Shorter patterns have no trigrams of their own:
+ * - Every entry is followed by its NUL terminator, which counts as part of the entry's last
+ *   trigram. So every pair of characters is the start of a trigram, and the newest entry containing
+ *   a pair is the newest one in any of the 256 lists its trigrams could have.
+ * - For single characters, the index keeps a bitmap of the bytes that appear in every block of
+ *   SEARCH_BLOCK_SIZE entries. Only the entries of blocks that have the bit set are scanned.
+ *
+ * Entries are evicted oldest first, so an evicted entry is always at the front of its posting
+ * lists. Sequence numbers are stored in 32 bits, there are never more live entries than that.
+ * Duplicates that were removed from the history stay in the lists and are skipped, until the
+ * history is compacted.
+ *
+ * The index is only built once it is needed, see 'search_sync()'. */
+
+typedef struct {
+    uint32_t *sequences;
+    uint32_t start;
+    uint32_t end;
+    uint32_t capacity;
+} SearchPostings;
+
+#define SEARCH_BLOCK_SIZE 64
+
+typedef struct {
+    /* Sequence number divided by SEARCH_BLOCK_SIZE */
+    uint64_t id;
+    uint64_t bytes[256 / 64];
+} SearchBlock;
+
+typedef struct {
+    /* The trigram with bit 24 set, 0 marks a free slot */
+    uint32_t key;
+    SearchPostings postings;
+} SearchSlot;
+
+typedef struct {
+    /* Open addressing with linear probing, trigrams are never removed */
+    SearchSlot *slots;
+    uint32_t slot_count;
+    uint32_t used_count;
+
+    /* Ring of blocks indexed by their id, large enough for every live entry */
+    SearchBlock *blocks;
+    uint32_t block_count;
+
+    /* Every entry below has been indexed */
+    uint64_t indexed_end;
+    uint8_t is_built;
+} SearchIndex;
+
+void search_init(SearchIndex *index);
+void search_destroy(SearchIndex *index);
+
+/* Indexes the entries that were added to the history since the last call. The first call builds
+ * the index. */
+void search_sync(SearchIndex *index, const History *history);
+
+/* Have to be called for every entry that is evicted and every time the history is compacted, see
+ * 'HistoryListener' */
+void search_evict(SearchIndex *index, uint64_t sequence, HistoryEntry entry);
+void search_renumber(SearchIndex *index, const History *history, uint64_t old_first,
+                     const uint64_t *sequences);
+
+/* Finds the newest entry below 'before' that contains 'pattern'. Returns 0, if there is none. */
+uint8_t search_find(SearchIndex *index, const History *history, const char *pattern,
+                    uint32_t length, uint64_t before, uint64_t *sequence);
+
+#endif
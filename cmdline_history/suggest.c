@@ -0,0 +1,316 @@
+#include "suggest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SUGGEST_MIN_NODES 1024
+#define SUGGEST_ROOT 0
+
+static void *suggest_realloc(void *data, size_t size) {
+    data = realloc(data, size);
+    if (data == NULL) {
+        fprintf(stderr, "error: Failed to grow the suggestion index to %zu bytes\r\n", size);
+        abort();
+    }
+
+    return data;
+}
+
+/* Might move the nodes, so pointers to them have to be taken again afterwards */
+static uint32_t node_allocate(SuggestIndex *index) {
+    uint32_t node = index->free_node;
+    if (node != 0) {
+        index->free_node = index->nodes[node].sibling;
+        return node;
+    }
+
+    if (index->node_count == index->node_capacity) {
+        index->node_capacity =
+            index->node_capacity == 0 ? SUGGEST_MIN_NODES : index->node_capacity * 2;
+        index->nodes =
+            suggest_realloc(index->nodes, index->node_capacity * sizeof(*index->nodes));
+    }
+
+    return index->node_count++;
+}
+
+static void node_free(SuggestIndex *index, uint32_t node) {
+    index->nodes[node].sibling = index->free_node;
+    index->free_node = node;
+}
+
+static uint32_t node_find_child(const SuggestIndex *index, uint32_t node, char first) {
+    uint32_t child = index->nodes[node].child;
+    while (child != 0 && index->nodes[child].first != first)
+        child = index->nodes[child].sibling;
+
+    return child;
+}
+
+/* Puts 'replacement' into the place of 'child' in the list of 'parent', 0 removes 'child' */
+static void node_replace_child(SuggestIndex *index, uint32_t parent, uint32_t child,
+                               uint32_t replacement) {
+    uint32_t *link = &index->nodes[parent].child;
+    while (*link != child)
+        link = &index->nodes[*link].sibling;
+
+    if (replacement == 0) {
+        *link = index->nodes[child].sibling;
+        return;
+    }
+
+    index->nodes[replacement].sibling = index->nodes[child].sibling;
+    *link = replacement;
+}
+
+/* A node that no entry ends at and that has a single child is merged into it, the child's entries
+ * hold the bytes of both edges */
+static void node_merge(SuggestIndex *index, uint32_t parent, uint32_t node) {
+    SuggestNode *merged = &index->nodes[node];
+    if (merged->sequence != HISTORY_SEQUENCE_NONE || merged->child == 0 ||
+        index->nodes[merged->child].sibling != 0)
+        return;
+
+    uint32_t child = merged->child;
+    index->nodes[child].first = merged->first;
+    node_replace_child(index, parent, node, child);
+    node_free(index, node);
+}
+
+/* The bytes of the edge that leads to 'node' start at the parent's depth */
+static const char *node_text(const History *history, const SuggestNode *node) {
+    return history_get(history, node->newest).text;
+}
+
+void suggest_init(SuggestIndex *index) { *index = (SuggestIndex){0}; }
+
+void suggest_destroy(SuggestIndex *index) {
+    free(index->nodes);
+    free(index->stack);
+    suggest_init(index);
+}
+
+static void suggest_add(SuggestIndex *index, const History *history, uint64_t sequence,
+                        HistoryEntry entry) {
+    uint32_t node = SUGGEST_ROOT;
+    uint32_t depth = 0;
+
+    for (;;) {
+        /* The entry is newer than everything in the tree */
+        index->nodes[node].newest = sequence;
+
+        if (depth == entry.length) {
+            index->nodes[node].sequence = sequence;
+            return;
+        }
+
+        uint32_t child = node_find_child(index, node, entry.text[depth]);
+        if (child == 0) {
+            uint32_t leaf = node_allocate(index);
+            index->nodes[leaf] = (SuggestNode){
+                .newest = sequence,
+                .sequence = sequence,
+                .depth = entry.length,
+                .sibling = index->nodes[node].child,
+                .first = entry.text[depth],
+            };
+            index->nodes[node].child = leaf;
+            return;
+        }
+
+        /* Follow the edge as long as the entry matches it */
+        uint32_t edge_depth = index->nodes[child].depth;
+        const char *label = node_text(history, &index->nodes[child]);
+        uint32_t end = edge_depth < entry.length ? edge_depth : entry.length;
+        uint32_t common = depth + 1;
+        while (common < end && label[common] == entry.text[common])
+            common++;
+
+        if (common == edge_depth) {
+            node = child;
+            depth = common;
+            continue;
+        }
+
+        /* Split the edge where the entry branches off or ends */
+        uint32_t middle = node_allocate(index);
+        index->nodes[middle] = (SuggestNode){
+            .sequence = HISTORY_SEQUENCE_NONE,
+            .depth = common,
+            .child = child,
+            .first = index->nodes[child].first,
+        };
+        node_replace_child(index, node, child, middle);
+        index->nodes[child].sibling = 0;
+        index->nodes[child].first = label[common];
+
+        node = middle;
+        depth = common;
+    }
+}
+
+void suggest_sync(SuggestIndex *index, const History *history) {
+    if (index->nodes == NULL) {
+        uint32_t root = node_allocate(index);
+        index->nodes[root] = (SuggestNode){
+            .newest = HISTORY_SEQUENCE_NONE,
+            .sequence = HISTORY_SEQUENCE_NONE,
+        };
+    }
+
+    uint64_t sequence = index->indexed_end > history->first ? index->indexed_end : history->first;
+
+    /* Removed duplicates have a newer copy further up */
+    for (; sequence < history->next; sequence++) {
+        if (!history_is_removed(history, sequence))
+            suggest_add(index, history, sequence, history_get(history, sequence));
+    }
+
+    index->indexed_end = history->next;
+    index->is_built = 1;
+}
+
+void suggest_evict(SuggestIndex *index, uint64_t sequence, HistoryEntry entry) {
+    if (sequence >= index->indexed_end)
+        return;
+
+    uint32_t grandparent = SUGGEST_ROOT, parent = SUGGEST_ROOT, node = SUGGEST_ROOT;
+    uint32_t depth = 0;
+
+    /* The text is in the tree, so the first byte of every edge is enough to find the way */
+    while (depth < entry.length) {
+        uint32_t child = node_find_child(index, node, entry.text[depth]);
+        if (child == 0)
+            return;
+
+        grandparent = parent;
+        parent = node;
+        node = child;
+        depth = index->nodes[child].depth;
+    }
+
+    /* The entry was never indexed, or a newer copy ends here */
+    if (depth != entry.length || index->nodes[node].sequence != sequence)
+        return;
+
+    index->nodes[node].sequence = HISTORY_SEQUENCE_NONE;
+    if (node == SUGGEST_ROOT)
+        return;
+
+    /* Being the oldest entry, it was only the newest one of its own subtree, if that held nothing
+     * else. So nothing above has to change, except for the shape of the tree. */
+    if (index->nodes[node].child == 0) {
+        node_replace_child(index, parent, node, 0);
+        node_free(index, node);
+
+        if (parent != SUGGEST_ROOT)
+            node_merge(index, grandparent, parent);
+    } else {
+        node_merge(index, parent, node);
+    }
+}
+
+/* Removed duplicates disappear, so their nodes might go away. Every node is visited after all of
+ * its children: The nodes are listed parents first and then processed in reverse. */
+void suggest_renumber(SuggestIndex *index, const History *history, uint64_t old_first,
+                      const uint64_t *sequences) {
+    if (!index->is_built)
+        return;
+
+    if (index->stack_capacity < index->node_count) {
+        index->stack_capacity = index->node_count;
+        index->stack =
+            suggest_realloc(index->stack, index->stack_capacity * sizeof(*index->stack));
+    }
+
+    uint32_t count = 0;
+    index->stack[count++] = SUGGEST_ROOT;
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t child = index->nodes[index->stack[i]].child; child != 0;
+             child = index->nodes[child].sibling)
+            index->stack[count++] = child;
+    }
+
+    while (count-- > 0) {
+        uint32_t node = index->stack[count];
+        SuggestNode *current = &index->nodes[node];
+
+        if (current->sequence != HISTORY_SEQUENCE_NONE)
+            current->sequence = sequences[current->sequence - old_first];
+
+        uint64_t newest = current->sequence;
+        uint32_t child = current->child;
+
+        while (child != 0) {
+            uint32_t sibling = index->nodes[child].sibling;
+
+            /* Children that lost all of their entries are marked by their newest one */
+            if (index->nodes[child].newest == HISTORY_SEQUENCE_NONE) {
+                node_replace_child(index, node, child, 0);
+                node_free(index, child);
+            } else {
+                if (newest == HISTORY_SEQUENCE_NONE || index->nodes[child].newest > newest)
+                    newest = index->nodes[child].newest;
+                node_merge(index, node, child);
+            }
+
+            child = sibling;
+        }
+
+        current->newest = newest;
+    }
+
+    uint64_t indexed_end = history->first;
+    for (uint64_t old = index->indexed_end; old-- > old_first;) {
+        if (sequences[old - old_first] != HISTORY_SEQUENCE_NONE) {
+            indexed_end = sequences[old - old_first] + 1;
+            break;
+        }
+    }
+
+    index->indexed_end = indexed_end;
+}
+
+uint8_t suggest_find(SuggestIndex *index, const History *history, const char *prefix,
+                     uint32_t length, uint64_t *sequence) {
+    if (length == 0)
+        return 0;
+
+    suggest_sync(index, history);
+
+    uint32_t node = SUGGEST_ROOT;
+    uint32_t depth = 0;
+
+    while (depth < length) {
+        uint32_t child = node_find_child(index, node, prefix[depth]);
+        if (child == 0)
+            return 0;
+
+        const SuggestNode *edge = &index->nodes[child];
+        uint32_t end = edge->depth < length ? edge->depth : length;
+        if (memcmp(node_text(history, edge) + depth + 1, prefix + depth + 1, end - depth - 1) != 0)
+            return 0;
+
+        node = child;
+        depth = edge->depth;
+    }
+
+    /* The prefix ends inside the edge, every entry below is longer */
+    if (depth > length) {
+        *sequence = index->nodes[node].newest;
+        return 1;
+    }
+
+    /* The entry that ends here is the prefix itself, only the ones below are longer */
+    uint8_t is_found = 0;
+    for (uint32_t child = index->nodes[node].child; child != 0;
+         child = index->nodes[child].sibling) {
+        if (!is_found || index->nodes[child].newest > *sequence) {
+            *sequence = index->nodes[child].newest;
+            is_found = 1;
+        }
+    }
+
+    return is_found;
+}
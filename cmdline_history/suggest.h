@@ -0,0 +1,74 @@
+#ifndef _SUGGEST_H_
+#define _SUGGEST_H_
+
+#include "history.h"
+
+#include <stdint.h>
+
+/* Prefix lookup over the history, for suggesting how the line might continue.
+ *
+ * The distinct entries are kept in a radix tree: Every edge is labeled with the bytes that all
+ * entries below it share, so a node only exists where entries branch off or end. Every node knows
+ * the newest entry in its subtree, which makes the newest entry with a given prefix a walk down the
+ * tree, no matter how many entries share it.
+ *
+ * Labels are not stored. An edge covers the bytes [parent depth, depth) of every entry below it,
+ * so they are read from the node's newest entry, which is always live. Adding an entry that is
+ * already in the tree only updates the newest entries along its path.
+ *
+ * Entries are evicted oldest first, so an evicted entry is never the newest one of a subtree that
+ * holds anything else: It is either still in the tree as a newer copy, or its node goes away.
+ * Removed duplicates simply find their newer copy in the tree.
+ *
+ * The index is only built once it is needed, see 'suggest_sync()'. */
+
+typedef struct {
+    /* Newest entry in the subtree */
+    uint64_t newest;
+    /* Entry that ends here, HISTORY_SEQUENCE_NONE if none */
+    uint64_t sequence;
+    /* Length of the prefix, up to the end of the edge */
+    uint32_t depth;
+    /* Index of the first child and of the next sibling, 0 if there is none. The root is never
+     * anyone's child. Free nodes are linked through 'sibling'. */
+    uint32_t child;
+    uint32_t sibling;
+    /* First byte of the edge, so siblings can be told apart without reading their entry */
+    char first;
+} SuggestNode;
+
+typedef struct {
+    /* Node 0 is the root */
+    SuggestNode *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t free_node;
+
+    /* Used while renumbering */
+    uint32_t *stack;
+    uint32_t stack_capacity;
+
+    /* Every entry below has been indexed */
+    uint64_t indexed_end;
+    uint8_t is_built;
+} SuggestIndex;
+
+void suggest_init(SuggestIndex *index);
+void suggest_destroy(SuggestIndex *index);
+
+/* Indexes the entries that were added to the history since the last call. The first call builds
+ * the index. */
+void suggest_sync(SuggestIndex *index, const History *history);
+
+/* Have to be called for every entry that is evicted and every time the history is compacted, see
+ * 'HistoryListener' */
+void suggest_evict(SuggestIndex *index, uint64_t sequence, HistoryEntry entry);
+void suggest_renumber(SuggestIndex *index, const History *history, uint64_t old_first,
+                      const uint64_t *sequences);
+
+/* Finds the newest entry that starts with 'prefix' and is longer than it. Returns 0, if there is
+ * none. */
+uint8_t suggest_find(SuggestIndex *index, const History *history, const char *prefix,
+                     uint32_t length, uint64_t *sequence);
+
+#endif
@@ -1,3 +1,5 @@
+#include "present.h"
+
 #include <signal.h>
 #include <sys/ioctl.h>
 
@@ -8,6 +10,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #define assert(condition)                                                    \
     do {                                                                     \
@@ -22,10 +25,29 @@
 
 #define SCREEN_TERM_RATIO 1
 #define EMPTY_CHAR ' '
+/* Used when the output is not a terminal */
+#define DEFAULT_WIDTH 80
+#define DEFAULT_HEIGHT 24
+
+#define SURFACE_POOL_SIZE 2
+#define SURFACE_MIN_CAPACITY 4096
+
+/* The resize stress test sends SIGWINCH that often, mostly while a frame is drawn, and only passes
+ * if nothing is allocated after the first tenth of the frames and resized frames are not much
+ * slower than the others */
+#define STRESS_RESIZE_PERIOD_US 100
+#define STRESS_WARM_UP_DIVISOR 10
+#define STRESS_MAX_P99_RATIO 4
+#define STRESS_MIN_SAMPLES 100
+
+/* Corners are placed on a grid of 1/256th of a cell */
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_SCALE / 2)
 
 typedef struct {
-    uint32_t offset_x;
-    uint32_t offset_y;
+    int32_t offset_x;
+    int32_t offset_y;
     uint32_t pivot_x;
     uint32_t pivot_y;
     uint32_t width;
@@ -39,51 +61,333 @@ typedef struct {
     char *buffer;
 } Surface;
 
+/* Frames are drawn into the buffers in turns, so the one drawn last stays intact while the next
+ * one is drawn. The buffers share a capacity that only grows: Resizing within it, which is what
+ * almost every resize does after a few, allocates nothing. */
+typedef struct {
+    char *buffers[SURFACE_POOL_SIZE];
+    size_t capacity;
+    uint32_t next;
+    uint32_t width;
+    uint32_t height;
+
+    /* For benchmarks */
+    uint32_t allocation_count;
+} SurfacePool;
+
+static void surface_pool_resize(SurfacePool *pool, uint32_t width, uint32_t height) {
+    size_t cells = (size_t)width * height;
+
+    if (cells > pool->capacity) {
+        size_t capacity = pool->capacity < SURFACE_MIN_CAPACITY ? SURFACE_MIN_CAPACITY
+                                                                : pool->capacity;
+        while (capacity < cells)
+            capacity *= 2;
+
+        for (uint32_t i = 0; i < SURFACE_POOL_SIZE; i++) {
+            char *buffer = realloc(pool->buffers[i], capacity);
+            if (buffer == NULL) {
+                fprintf(stderr, "error: Failed to grow a surface to %zu cells\n", capacity);
+                abort();
+            }
+
+            pool->buffers[i] = buffer;
+            pool->allocation_count++;
+        }
+
+        pool->capacity = capacity;
+    }
+
+    pool->width = width;
+    pool->height = height;
+}
+
+static Surface surface_pool_next(SurfacePool *pool) {
+    Surface surface = {
+        .width = pool->width,
+        .height = pool->height,
+        .buffer = pool->buffers[pool->next],
+    };
+
+    pool->next = (pool->next + 1) % SURFACE_POOL_SIZE;
+    return surface;
+}
+
+static void surface_pool_free(SurfacePool *pool) {
+    for (uint32_t i = 0; i < SURFACE_POOL_SIZE; i++)
+        free(pool->buffers[i]);
+
+    *pool = (SurfacePool){0};
+}
+
 static void surface_clear(Surface *surface) {
-    memset(surface->buffer, EMPTY_CHAR, surface->width * surface->height);
+    memset(surface->buffer, EMPTY_CHAR, (size_t)surface->width * surface->height);
 }
 
-static void surface_set(Surface *surface, int32_t x, int32_t y, char c) {
-    if(x >= surface->width || y >= surface->height) return;
-    if(y * surface->width + x > surface->width * surface->height) return;
+/* The side of a quad from corner (x, y) to the next one. A cell belongs to the quad when its center
+ * is on the inner side of every edge: 'delta_x * (center_y - y) - delta_y * (center_x - x)' is at
+ * least 'bias'. */
+typedef struct {
+    int64_t x;
+    int64_t y;
+    int64_t delta_x;
+    int64_t delta_y;
+    int64_t bias;
+} Edge;
 
-    surface->buffer[y * surface->width + x] = c;
+/* Rounds towards negative infinity, 'divisor' is positive */
+static int64_t floor_div(int64_t dividend, int64_t divisor) {
+    return dividend >= 0 ? dividend / divisor : -((divisor - 1 - dividend) / divisor);
 }
 
-static void surface_draw_cube(Surface *surface, Cube *cube) {
-    for (uint32_t y = 0; y < cube->height; y++) {
-        for (uint32_t x = 0; x < cube->width; x++) {
-            float actual_x = x - cube->pivot_x;
-            float actual_y = y - cube->pivot_y;
-            float pos_x = actual_x * cos(cube->angle) - actual_y * sin(cube->angle) + cube->pivot_x;
-            float pos_y = actual_x * sin(cube->angle) + actual_y * cos(cube->angle) + cube->pivot_y;
+static int64_t ceil_div(int64_t dividend, int64_t divisor) {
+    return -floor_div(-dividend, divisor);
+}
 
-            surface_set(surface, (int)pos_x + cube->offset_x, (int)pos_y + cube->offset_y, '#');
+/* Fills the convex quad with the corners 'x' and 'y', given in subpixels, one span per row. Cells
+ * whose center is exactly on an edge that two quads share are only filled by one of them. */
+static void surface_fill_quad(Surface *surface, const int32_t x[4], const int32_t y[4], char c) {
+    int64_t area = 0;
+    for (uint32_t i = 0; i < 4; i++)
+        area += (int64_t)x[i] * y[(i + 1) % 4] - (int64_t)x[(i + 1) % 4] * y[i];
+    if (area == 0)
+        return;
+
+    /* The inside is left of every edge when going around the corners with a positive area */
+    Edge edges[4];
+    uint32_t edge_count = 0;
+    int64_t min_y = y[0], max_y = y[0];
+    for (uint32_t i = 0; i < 4; i++) {
+        min_y = y[i] < min_y ? y[i] : min_y;
+        max_y = y[i] > max_y ? y[i] : max_y;
+
+        uint32_t from = area > 0 ? i : 3 - i;
+        uint32_t to = area > 0 ? (i + 1) % 4 : (6 - i) % 4;
+        int64_t delta_x = (int64_t)x[to] - x[from], delta_y = (int64_t)y[to] - y[from];
+
+        /* Two corners in the same place, the quad is a triangle. Such an edge bounds nothing. */
+        if (delta_x == 0 && delta_y == 0)
+            continue;
+
+        /* Going the other way, the neighbouring quad gets the opposite bias on a shared edge */
+        edges[edge_count++] = (Edge){
+            .x = x[from],
+            .y = y[from],
+            .delta_x = delta_x,
+            .delta_y = delta_y,
+            .bias = delta_y < 0 || (delta_y == 0 && delta_x > 0) ? 0 : 1,
+        };
+    }
+
+    /* Rows whose centers lie between the highest and the lowest corner */
+    int64_t first_row = ceil_div(min_y - SUBPIXEL_HALF, SUBPIXEL_SCALE);
+    int64_t last_row = floor_div(max_y - SUBPIXEL_HALF, SUBPIXEL_SCALE);
+    first_row = first_row < 0 ? 0 : first_row;
+    last_row = last_row >= surface->height ? (int64_t)surface->height - 1 : last_row;
+
+    for (int64_t row = first_row; row <= last_row; row++) {
+        int64_t center_y = row * SUBPIXEL_SCALE + SUBPIXEL_HALF;
+        int64_t first = 0, last = (int64_t)surface->width - 1;
+
+        /* Every edge bounds the span from one side: With the center at 'column * SUBPIXEL_SCALE +
+         * SUBPIXEL_HALF', 'constant - delta_y * center_x >= 0' has to hold */
+        for (uint32_t i = 0; i < edge_count && first <= last; i++) {
+            const Edge *edge = &edges[i];
+            int64_t constant =
+                edge->delta_x * (center_y - edge->y) + edge->delta_y * edge->x - edge->bias;
+
+            if (edge->delta_y < 0) {
+                int64_t step = -edge->delta_y;
+                int64_t column =
+                    ceil_div(-constant - step * SUBPIXEL_HALF, step * SUBPIXEL_SCALE);
+                first = column > first ? column : first;
+            } else if (edge->delta_y > 0) {
+                int64_t step = edge->delta_y;
+                int64_t column =
+                    floor_div(constant - step * SUBPIXEL_HALF, step * SUBPIXEL_SCALE);
+                last = column < last ? column : last;
+            } else if (constant < 0) {
+                last = -1;
+            }
         }
+
+        if (first <= last)
+            memset(surface->buffer + row * surface->width + first, c, (size_t)(last - first + 1));
     }
 }
 
+/* Only the corners are rotated, the cells in between are filled in by 'surface_fill_quad()' */
+static void surface_draw_cube(Surface *surface, const Cube *cube) {
+    float cos_angle = cosf(cube->angle);
+    float sin_angle = sinf(cube->angle);
+    float corner_x[4] = {0, cube->width, cube->width, 0};
+    float corner_y[4] = {0, 0, cube->height, cube->height};
+
+    int32_t x[4], y[4];
+    for (uint32_t i = 0; i < 4; i++) {
+        float actual_x = corner_x[i] - (float)cube->pivot_x;
+        float actual_y = corner_y[i] - (float)cube->pivot_y;
+        float pos_x = actual_x * cos_angle - actual_y * sin_angle + cube->pivot_x;
+        float pos_y = actual_x * sin_angle + actual_y * cos_angle + cube->pivot_y;
+
+        x[i] = (int32_t)lrintf((pos_x + cube->offset_x) * SUBPIXEL_SCALE);
+        y[i] = (int32_t)lrintf((pos_y + cube->offset_y) * SUBPIXEL_SCALE);
+    }
+
+    surface_fill_quad(surface, x, y, '#');
+}
+
 static void cube_rotate(Cube *cube, uint32_t angle) {
     assert(angle < 360);
     cube->angle = DEGREE_TO_RAD(angle);
 }
 
-static inline void screen_draw(Surface *surface) {
-    for (uint32_t y = 0; y < surface->height * SCREEN_TERM_RATIO; y++) {
-        fwrite(surface->buffer + surface->width * y, 1, surface->width, stdout);
-        putchar('\n');
+static void cube_center(Cube *cube, uint32_t width, uint32_t height) {
+    cube->offset_x = (int32_t)(width / 2) - (int32_t)(cube->width / 2);
+    cube->offset_y = (int32_t)(height / 2) - (int32_t)(cube->height / 2);
+}
+
+/* In cells of the surface */
+static void window_size(int fd, uint32_t *width, uint32_t *height) {
+    struct winsize window;
+    if (ioctl(fd, TIOCGWINSZ, &window) == -1 || window.ws_col == 0 || window.ws_row == 0)
+        window = (struct winsize){.ws_col = DEFAULT_WIDTH, .ws_row = DEFAULT_HEIGHT};
+
+    *width = window.ws_col;
+    *height = window.ws_row / SCREEN_TERM_RATIO;
+}
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static uint32_t random_state = 0x2545f491;
+
+/* xorshift32, the benchmark draws the same cubes on every run */
+static uint32_t random_below(uint32_t limit) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state % limit;
+}
+
+/* Rotates 'cube_count' cubes of random sizes, places and speeds on a 320x180 surface for the given
+ * number of frames, some of them partly outside of it */
+static void bench_cubes(uint32_t frame_count, uint32_t cube_count) {
+    Surface surface = {.width = 320, .height = 180};
+    surface.buffer = malloc(surface.width * surface.height);
+
+    Cube *cubes = malloc(cube_count * sizeof(*cubes));
+    uint32_t *speeds = malloc(cube_count * sizeof(*speeds));
+    if (surface.buffer == NULL || cubes == NULL || speeds == NULL) {
+        fprintf(stderr, "error: Failed to allocate %u cubes\n", cube_count);
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < cube_count; i++) {
+        uint32_t width = 2 + random_below(31), height = 2 + random_below(31);
+        cubes[i] = (Cube){
+            .width = width,
+            .height = height,
+            .pivot_x = width / 2,
+            .pivot_y = height / 2,
+            .offset_x = (int32_t)random_below(surface.width + 32) - 16 - (int32_t)width / 2,
+            .offset_y = (int32_t)random_below(surface.height + 32) - 16 - (int32_t)height / 2,
+        };
+        speeds[i] = 1 + random_below(8);
+    }
+
+    double start = now_seconds();
+    for (uint32_t frame = 0; frame < frame_count; frame++) {
+        surface_clear(&surface);
+        for (uint32_t i = 0; i < cube_count; i++) {
+            cube_rotate(&cubes[i], (frame * speeds[i]) % 360);
+            surface_draw_cube(&surface, &cubes[i]);
+        }
     }
+    double duration = now_seconds() - start;
+
+    uint32_t filled = 0;
+    for (uint32_t i = 0; i < surface.width * surface.height; i++)
+        filled += surface.buffer[i] != EMPTY_CHAR;
+
+    printf("%u frames of %u cubes: %.3f ms per frame, %.1f M cubes/s, %u cells filled at the end\n",
+           frame_count, cube_count, duration * 1e3 / frame_count,
+           (double)frame_count * cube_count / duration / 1e6, filled);
+
+    free(speeds);
+    free(cubes);
+    free(surface.buffer);
 }
 
-static uint8_t is_running = 1;
+static int compare_times(const void *a, const void *b) {
+    double first = *(const double *)a, second = *(const double *)b;
+    return (first > second) - (first < second);
+}
+
+/* Sorts 'times' and returns their 99th percentile */
+static double report_frame_times(const char *name, double *times, uint32_t count) {
+    if (count == 0)
+        return 0;
+
+    qsort(times, count, sizeof(*times), compare_times);
+
+    double total = 0;
+    for (uint32_t i = 0; i < count; i++)
+        total += times[i];
+
+    printf("  %u %s frames: %.3f ms on average, %.3f ms median, %.3f ms p99, %.3f ms max\n", count,
+           name, total * 1e3 / count, times[count / 2] * 1e3, times[count * 99 / 100] * 1e3,
+           times[count - 1] * 1e3);
+
+    return times[count * 99 / 100];
+}
+
+static volatile sig_atomic_t is_running = 1;
 static void restore_terminal(int _) {
     is_running = 0;
 }
 
-int main(void) {
-    struct winsize window;
-    ioctl(0, TIOCGWINSZ, &window);
-    signal(SIGINT, restore_terminal);
+static volatile sig_atomic_t is_resized = 1;
+static void resize_surface(int _) {
+    is_resized = 1;
+}
+
+/* Usage: main
+ *        main present <frames>
+ *        main resize <frames>
+ *        main cubes <frames> <count>
+ * present: Renders the given number of frames of a 160x48 surface without sleeping and presents
+ *        them (see 'present.h') to a pipe. Reports the frame time and the bytes per frame.
+ * resize: Like present, but a timer sends SIGWINCH every STRESS_RESIZE_PERIOD_US and every
+ *        resize picks a random size of up to 400x120. Reports the frame times with and without a
+ *        resize and how often the surfaces were allocated. Exits with 1 if anything was allocated
+ *        after warming up or the p99 of resized frames is more than STRESS_MAX_P99_RATIO times
+ *        that of the others.
+ * cubes: Draws many rotating cubes per frame without presenting them. Reports the frame time. */
+int main(int argc, char **argv) {
+    uint32_t frame_count = 0;
+    uint8_t is_stressed = 0;
+    uint32_t width = 160, height = 48;
+
+    if (argc == 3 && strcmp(argv[1], "present") == 0) {
+        frame_count = (uint32_t)atoi(argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "resize") == 0) {
+        frame_count = (uint32_t)atoi(argv[2]);
+        is_stressed = 1;
+    } else if (argc == 4 && strcmp(argv[1], "cubes") == 0) {
+        bench_cubes((uint32_t)atoi(argv[2]), (uint32_t)atoi(argv[3]));
+        return 0;
+    } else if (argc == 1) {
+        signal(SIGINT, restore_terminal);
+    } else {
+        fprintf(stderr, "Usage: %s [present|resize <frames> | cubes <frames> <count>]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGWINCH, resize_surface);
 
     Cube cube = {
         .width = 20,
@@ -92,35 +396,131 @@ int main(void) {
 
         .pivot_x = 0,
         .pivot_y = 0,
-
-        .offset_x = window.ws_row / 2 - 10,
-        .offset_y = window.ws_col / 2 - 10,
     };
 
-    Surface surface = {
-        .width = window.ws_row,
-        .height = window.ws_col,
-        .buffer = calloc(window.ws_col * window.ws_row, 1),
-    };
+    SurfacePool pool = {0};
+
+    PresentSink sink = {.fd = STDOUT_FILENO};
+    if (frame_count > 0 && present_sink_open(&sink) == -1) {
+        perror("error: Failed to open a pipe to present to");
+        return 1;
+    }
+
+    Presenter presenter;
+    presenter_init(&presenter, sink.fd);
+
+    /* Every frame's time, split by whether it was resized */
+    double *resized_times = NULL, *steady_times = NULL;
+    uint32_t resized_count = 0, steady_count = 0;
+    /* What was allocated once warmed up */
+    uint32_t warm_allocation_count = 0;
+    size_t warm_shown_capacity = 0;
+    timer_t resize_timer;
+
+    if (is_stressed) {
+        resized_times = malloc(frame_count * sizeof(*resized_times));
+        steady_times = malloc(frame_count * sizeof(*steady_times));
+        if (resized_times == NULL || steady_times == NULL) {
+            fprintf(stderr, "error: Failed to allocate the times of %u frames\n", frame_count);
+            return 1;
+        }
 
-    // Clear output buffer
-    printf("\x1b[2J");
+        struct sigevent event = {.sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGWINCH};
+        struct timespec period = {.tv_nsec = STRESS_RESIZE_PERIOD_US * 1000};
+        struct itimerspec schedule = {.it_interval = period, .it_value = period};
+        if (timer_create(CLOCK_MONOTONIC, &event, &resize_timer) == -1 ||
+            timer_settime(resize_timer, 0, &schedule, NULL) == -1) {
+            perror("error: Failed to start the resize timer");
+            return 1;
+        }
+    }
 
     uint32_t angle = 0;
-    while (is_running) {
+    double start = now_seconds();
+    for (uint32_t frame = 0; frame_count > 0 ? frame < frame_count : is_running; frame++) {
+        double frame_start = now_seconds();
+        uint8_t was_resized = is_resized;
+
+        if (is_resized) {
+            is_resized = 0;
+            if (is_stressed) {
+                width = 1 + random_below(400);
+                height = 1 + random_below(120);
+            } else if (frame_count == 0) {
+                window_size(STDOUT_FILENO, &width, &height);
+            }
+
+            surface_pool_resize(&pool, width, height);
+            cube_center(&cube, width, height);
+        }
+
         cube_rotate(&cube, angle);
         angle = (angle + 4) % 360;
 
+        Surface surface = surface_pool_next(&pool);
         surface_clear(&surface);
         surface_draw_cube(&surface, &cube);
+        presenter_present(&presenter, surface.buffer, surface.width,
+                          surface.height * SCREEN_TERM_RATIO);
 
-        printf("\x1b[H");
-        screen_draw(&surface);
+        if (is_stressed) {
+            double frame_time = now_seconds() - frame_start;
+            if (was_resized)
+                resized_times[resized_count++] = frame_time;
+            else
+                steady_times[steady_count++] = frame_time;
 
-        usleep(1000 * 500);
+            if (frame == frame_count / STRESS_WARM_UP_DIVISOR) {
+                warm_allocation_count = pool.allocation_count;
+                warm_shown_capacity = presenter.shown_capacity;
+            }
+        }
+
+        if (frame_count == 0)
+            usleep(1000 * 500);
     }
 
-    free(surface.buffer);
+    if (frame_count > 0) {
+        double duration = now_seconds() - start;
+        printf("%u frames of %s: %.3f ms per frame, %.0f bytes per frame\n", frame_count,
+               is_stressed ? "random sizes" : "160x48", duration * 1e3 / frame_count,
+               (double)presenter.byte_count / frame_count);
+    }
+
+    int status = 0;
+    if (is_stressed) {
+        timer_delete(resize_timer);
+
+        double resized_p99 = report_frame_times("resized", resized_times, resized_count);
+        double steady_p99 = report_frame_times("steady", steady_times, steady_count);
+        printf("  %u surface allocations, %zu cells each, for %u resizes\n",
+               pool.allocation_count, pool.capacity, resized_count);
+
+        if (pool.allocation_count != warm_allocation_count ||
+            presenter.shown_capacity != warm_shown_capacity) {
+            fprintf(stderr, "error: Resizing still allocated after %u frames\n",
+                    frame_count / STRESS_WARM_UP_DIVISOR);
+            status = 1;
+        }
+
+        if (resized_count < STRESS_MIN_SAMPLES || steady_count < STRESS_MIN_SAMPLES) {
+            fprintf(stderr, "error: Too few frames with and without a resize to compare them\n");
+            status = 1;
+        } else if (resized_p99 > STRESS_MAX_P99_RATIO * steady_p99) {
+            fprintf(stderr, "error: Resized frames are unstable, p99 %.3f ms against %.3f ms\n",
+                    resized_p99 * 1e3, steady_p99 * 1e3);
+            status = 1;
+        }
+
+        free(resized_times);
+        free(steady_times);
+    }
+
+    presenter_free(&presenter);
+    if (frame_count > 0)
+        present_sink_close(&sink);
+
+    surface_pool_free(&pool);
 
-    return 0;
+    return status;
 }
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include "present.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#define PRESENT_MIN_CAPACITY 4096
+/* Moving over more unchanged cells than this takes fewer bytes than printing them again, the
+ * shortest move to the right is "\x1b[5C" */
+#define PRESENT_MAX_GAP 4
+#define PRESENT_UNKNOWN UINT32_MAX
+
+#define PRESENT_BLANK ' '
+#define PRESENT_CLEAR "\x1b[?25l\x1b[H\x1b[2J"
+#define PRESENT_SHOW_CURSOR "\x1b[?25h"
+
+static void buffer_append(PresentBuffer *buffer, const char *text, uint32_t length) {
+    if (buffer->capacity - buffer->length < length) {
+        uint32_t capacity =
+            buffer->capacity < PRESENT_MIN_CAPACITY ? PRESENT_MIN_CAPACITY : buffer->capacity;
+        while (capacity - buffer->length < length)
+            capacity *= 2;
+
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "error: Failed to grow the output buffer to %u bytes\n", capacity);
+            abort();
+        }
+
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+static void buffer_append_string(PresentBuffer *buffer, const char *string) {
+    buffer_append(buffer, string, (uint32_t)strlen(string));
+}
+
+void presenter_init(Presenter *presenter, int fd) {
+    *presenter = (Presenter){
+        .fd = fd,
+        .cursor_x = PRESENT_UNKNOWN,
+    };
+}
+
+static void presenter_write(Presenter *presenter) {
+    const char *data = presenter->output.data;
+    uint32_t remaining = presenter->output.length;
+
+    while (remaining > 0) {
+        ssize_t written = write(presenter->fd, data, remaining);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        data += written;
+        remaining -= (uint32_t)written;
+    }
+
+    presenter->byte_count += presenter->output.length;
+    presenter->output.length = 0;
+}
+
+void presenter_free(Presenter *presenter) {
+    if (presenter->is_shown_valid) {
+        char sequence[32];
+        snprintf(sequence, sizeof(sequence), "\x1b[%u;1H", presenter->height + 1);
+        buffer_append_string(&presenter->output, sequence);
+        buffer_append_string(&presenter->output, PRESENT_SHOW_CURSOR);
+        presenter_write(presenter);
+    }
+
+    free(presenter->shown);
+    free(presenter->output.data);
+    presenter_init(presenter, presenter->fd);
+}
+
+void presenter_invalidate(Presenter *presenter) { presenter->is_shown_valid = 0; }
+
+/* Picks the shortest way to get the cursor to column 'x' of row 'y' */
+static void presenter_move(Presenter *presenter, uint32_t x, uint32_t y) {
+    char best[32], candidate[32];
+    int best_length, length;
+
+    if (presenter->cursor_y == y && presenter->cursor_x == x)
+        return;
+
+    best_length = snprintf(best, sizeof(best), "\x1b[%u;%uH", y + 1, x + 1);
+
+    if (presenter->cursor_y == y && presenter->cursor_x < x) {
+        length = snprintf(candidate, sizeof(candidate), "\x1b[%uC", x - presenter->cursor_x);
+        if (length < best_length)
+            best_length = snprintf(best, sizeof(best), "%s", candidate);
+    }
+
+    /* A carriage return also works while the cursor waits to wrap at the end of the row */
+    if (presenter->cursor_y == y || presenter->cursor_y + 1 == y) {
+        const char *line = presenter->cursor_y == y ? "\r" : "\r\n";
+        length = x == 0 ? snprintf(candidate, sizeof(candidate), "%s", line)
+                        : snprintf(candidate, sizeof(candidate), "%s\x1b[%uC", line, x);
+        if (length < best_length)
+            best_length = snprintf(best, sizeof(best), "%s", candidate);
+    }
+
+    buffer_append(&presenter->output, best, (uint32_t)best_length);
+}
+
+/* Returns the first cell from 'x' on that changed, eight at a time while there are enough */
+static uint32_t skip_unchanged(const char *row, const char *shown, uint32_t x, uint32_t width) {
+    for (; x + 8 <= width; x += 8) {
+        uint64_t cells, shown_cells;
+        memcpy(&cells, row + x, 8);
+        memcpy(&shown_cells, shown + x, 8);
+
+        /* The lowest differing byte is the first one on little endian machines */
+        if (cells != shown_cells && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+            return x + (uint32_t)__builtin_ctzll(cells ^ shown_cells) / 8;
+        if (cells != shown_cells)
+            break;
+    }
+
+    while (x < width && row[x] == shown[x])
+        x++;
+
+    return x;
+}
+
+/* Clears the screen and remembers it as blank */
+static void presenter_reset(Presenter *presenter, uint32_t width, uint32_t height) {
+    size_t cells = (size_t)width * height;
+    if (cells > presenter->shown_capacity) {
+        size_t capacity = presenter->shown_capacity < PRESENT_MIN_CAPACITY
+                              ? PRESENT_MIN_CAPACITY
+                              : presenter->shown_capacity;
+        while (capacity < cells)
+            capacity *= 2;
+
+        char *shown = realloc(presenter->shown, capacity);
+        if (shown == NULL) {
+            fprintf(stderr, "error: Failed to allocate a %ux%u frame\n", width, height);
+            abort();
+        }
+
+        presenter->shown = shown;
+        presenter->shown_capacity = capacity;
+    }
+
+    presenter->width = width;
+    presenter->height = height;
+
+    memset(presenter->shown, PRESENT_BLANK, cells);
+    buffer_append_string(&presenter->output, PRESENT_CLEAR);
+    presenter->cursor_x = 0;
+    presenter->cursor_y = 0;
+    presenter->is_shown_valid = 1;
+}
+
+void presenter_present(Presenter *presenter, const char *cells, uint32_t width, uint32_t height) {
+    if (!presenter->is_shown_valid || width != presenter->width || height != presenter->height)
+        presenter_reset(presenter, width, height);
+
+    for (uint32_t y = 0; y < height; y++) {
+        const char *row = cells + (size_t)y * width;
+        char *shown = presenter->shown + (size_t)y * width;
+
+        for (uint32_t x = skip_unchanged(row, shown, 0, width); x < width;
+             x = skip_unchanged(row, shown, x, width)) {
+            /* Extend the run over short gaps of unchanged cells */
+            uint32_t last_changed = x;
+            for (uint32_t end = x + 1; end < width && end - last_changed <= PRESENT_MAX_GAP + 1;
+                 end++) {
+                if (row[end] != shown[end])
+                    last_changed = end;
+            }
+
+            uint32_t end = last_changed + 1;
+            presenter_move(presenter, x, y);
+            buffer_append(&presenter->output, row + x, end - x);
+            memcpy(shown + x, row + x, end - x);
+
+            /* After the last column, the cursor stays there until the next character wraps */
+            presenter->cursor_x = end < width ? end : PRESENT_UNKNOWN;
+            presenter->cursor_y = y;
+            x = end;
+        }
+    }
+
+    presenter->frame_count++;
+    presenter_write(presenter);
+}
+
+int present_sink_open(PresentSink *sink) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        char buffer[1 << 16];
+        close(fds[1]);
+        while (read(fds[0], buffer, sizeof(buffer)) > 0)
+            ;
+        _exit(0);
+    }
+
+    close(fds[0]);
+    *sink = (PresentSink){.fd = fds[1], .drain = pid};
+    return 0;
+}
+
+void present_sink_close(PresentSink *sink) {
+    close(sink->fd);
+    waitpid(sink->drain, NULL, 0);
+}
@@ -0,0 +1,65 @@
+#ifndef _PRESENT_H_
+#define _PRESENT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Puts frames of single byte cells onto the terminal.
+ *
+ * The presenter remembers what the terminal shows and only sends the cells that changed: Every
+ * run of changed cells is preceded by a cursor move, whatever is shortest of a line break, a move
+ * to the right or an absolute position. Runs that are only a few unchanged cells apart are joined,
+ * reprinting those cells is cheaper than moving over them. The whole frame goes out with a single
+ * write(), so the terminal never shows half of it.
+ *
+ * The first frame, and the first one after the size changed or 'presenter_invalidate()', clears
+ * the screen and draws everything that is not blank. The cursor is hidden until
+ * 'presenter_free()'. */
+
+typedef struct {
+    char *data;
+    uint32_t length;
+    uint32_t capacity;
+} PresentBuffer;
+
+typedef struct {
+    int fd;
+    /* What the terminal shows, only valid with 'is_shown_valid' set. Doubles when it has
+     * to grow and never shrinks, so resizing mostly allocates nothing. */
+    char *shown;
+    size_t shown_capacity;
+    uint32_t width;
+    uint32_t height;
+    uint8_t is_shown_valid;
+    /* Where the cursor is, the column is UINT32_MAX if that is not known */
+    uint32_t cursor_x;
+    uint32_t cursor_y;
+    PresentBuffer output;
+
+    /* For benchmarks */
+    uint64_t frame_count;
+    uint64_t byte_count;
+} Presenter;
+
+void presenter_init(Presenter *presenter, int fd);
+/* Shows the cursor again and moves it below the frame */
+void presenter_free(Presenter *presenter);
+
+/* 'cells' holds 'height' rows of 'width' bytes */
+void presenter_present(Presenter *presenter, const char *cells, uint32_t width, uint32_t height);
+
+/* Nothing is known about the screen anymore, the next frame is drawn from scratch */
+void presenter_invalidate(Presenter *presenter);
+
+/* For benchmarks: A pipe that a child process reads and drops everything from, so presenting a
+ * frame costs what it would with a terminal, minus the terminal. */
+typedef struct {
+    int fd;
+    pid_t drain;
+} PresentSink;
+
+/* Returns -1 with errno set on failure */
+int present_sink_open(PresentSink *sink);
+void present_sink_close(PresentSink *sink);
+
+#endif
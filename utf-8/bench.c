@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "corpus.h"
+#include "utf8.h"
+
+/* Usage: bench [size in MiB] [error rate]
+ * Every validator runs over every kind of corpus. On an error, validation resumes one byte
+ * behind it, so invalid inputs are processed completely as well. The best of BENCH_RUNS runs is
+ * reported. */
+
+#define BENCH_RUNS 8
+#define DEFAULT_SIZE_MIB 64
+#define DEFAULT_ERROR_RATE 0.001
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static size_t validate_all(utf8_validate_func validate, const uint8_t *buffer, size_t size) {
+    size_t errors = 0, offset = 0;
+
+    while (offset < size) {
+        offset += validate(buffer + offset, size - offset);
+        if (offset < size) {
+            errors++;
+            offset++;
+        }
+    }
+
+    return errors;
+}
+
+/* Stores the best time of BENCH_RUNS runs of 'expression' in 'best' */
+#define BENCH_BEST(best, expression)                      \
+    do {                                                  \
+        (best) = UINT64_MAX;                              \
+        for (uint32_t run = 0; run < BENCH_RUNS; run++) { \
+            uint64_t start = now_ns();                    \
+            expression;                                   \
+            uint64_t duration = now_ns() - start;         \
+            if (duration < (best))                        \
+                (best) = duration ? duration : 1;         \
+        }                                                 \
+    } while (0)
+
+/* Returns the throughput in GB/s */
+static double bench_validator(utf8_validate_func validate, const uint8_t *buffer, size_t size,
+                              size_t *errors) {
+    uint64_t best;
+    BENCH_BEST(best, *errors = validate_all(validate, buffer, size));
+
+    return (double)size / (double)best;
+}
+
+/* The utility functions run over the mixed corpus, which has the most variation in sequence
+ * length */
+static void bench_kernels(uint8_t *buffer, size_t size, CorpusRng *rng) {
+    corpus_generate(buffer, size, CORPUS_MIXED, 0, rng);
+
+    volatile size_t sink;
+    uint64_t scalar, vector;
+
+    printf("\n%-10s%10s%10s  (GB/s)\n", "kernel", "scalar", "vector");
+
+    BENCH_BEST(scalar, sink = utf8_count_codepoints_scalar(buffer, size));
+    BENCH_BEST(vector, sink = utf8_count_codepoints(buffer, size));
+    printf("%-10s%10.2f%10.2f\n", "count", (double)size / (double)scalar,
+           (double)size / (double)vector);
+
+    /* Cut off the last codepoint, so the whole buffer has to be scanned */
+    size_t max_codepoints = utf8_count_codepoints(buffer, size) - 1;
+    BENCH_BEST(scalar, sink = utf8_truncate_scalar(buffer, size, max_codepoints));
+    BENCH_BEST(vector, sink = utf8_truncate(buffer, size, max_codepoints));
+    printf("%-10s%10.2f%10.2f\n", "truncate", (double)size / (double)scalar,
+           (double)size / (double)vector);
+
+    (void)sink;
+}
+
+/* Sanitizes the invalid corpus at different error rates. The in-place version gets a fresh copy
+ * of the input for every run, which is not part of the measurement. */
+static void bench_sanitize(uint8_t *buffer, size_t size, CorpusRng *rng) {
+    static const double error_rates[] = {0, 0.001, 0.1};
+
+    uint8_t *output = malloc(UTF8_SANITIZE_BOUND(size));
+    if (output == NULL) {
+        fprintf(stderr, "error: Failed to allocate %zu bytes\n", UTF8_SANITIZE_BOUND(size));
+        return;
+    }
+
+    printf("\n%-10s%10s%10s%10s  (GB/s)\n", "sanitize", "scalar", "runs", "inplace");
+
+    for (uint32_t i = 0; i < sizeof(error_rates) / sizeof(error_rates[0]); i++) {
+        size_t errors = corpus_generate(buffer, size, CORPUS_INVALID, error_rates[i], rng);
+        uint64_t scalar, runs, inplace = UINT64_MAX;
+        volatile size_t sink;
+
+        BENCH_BEST(scalar, sink = utf8_sanitize_scalar(buffer, size, output));
+        BENCH_BEST(runs, sink = utf8_sanitize(buffer, size, output));
+
+        for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+            memcpy(output, buffer, size);
+
+            uint64_t start = now_ns();
+            sink = utf8_sanitize_inplace(output, size, UTF8_SANITIZE_BOUND(size));
+            uint64_t duration = now_ns() - start;
+
+            if (duration < inplace)
+                inplace = duration ? duration : 1;
+        }
+        (void)sink;
+
+        char name[16];
+        snprintf(name, sizeof(name), "%g%%", error_rates[i] * 100);
+        printf("%-10s%10.2f%10.2f%10.2f  (%zu errors)\n", name, (double)size / (double)scalar,
+               (double)size / (double)runs, (double)size / (double)inplace, errors);
+    }
+
+    free(output);
+}
+
+int main(int argc, char **argv) {
+    size_t size = (size_t)(argc > 1 ? atof(argv[1]) : DEFAULT_SIZE_MIB) * 1024 * 1024;
+    double error_rate = argc > 2 ? atof(argv[2]) : DEFAULT_ERROR_RATE;
+
+    uint8_t *buffer = malloc(size);
+    if (buffer == NULL) {
+        fprintf(stderr, "error: Failed to allocate %zu bytes\n", size);
+        return 1;
+    }
+
+    CorpusRng rng = {.state = 0x5EED};
+
+    printf("%-10s", "corpus");
+    for (uint32_t i = 0; i < utf8_validators_count; i++)
+        printf("%10s", utf8_validators[i].name);
+    printf("  (GB/s, %zu MiB, error rate %g)\n", size / (1024 * 1024), error_rate);
+
+    for (uint32_t kind = 0; kind < CORPUS_KIND_COUNT; kind++) {
+        corpus_generate(buffer, size, kind, error_rate, &rng);
+        printf("%-10s", corpus_kind_names[kind]);
+
+        size_t reference_errors = 0;
+        for (uint32_t i = 0; i < utf8_validators_count; i++) {
+            size_t errors = 0;
+            double throughput = bench_validator(utf8_validators[i].validate, buffer, size, &errors);
+            printf("%10.2f", throughput);
+            fflush(stdout);
+
+            if (i == 0) {
+                reference_errors = errors;
+            } else if (errors != reference_errors) {
+                printf("\nerror: '%s' found %zu errors, '%s' found %zu\n", utf8_validators[i].name,
+                       errors, utf8_validators[0].name, reference_errors);
+                return 1;
+            }
+        }
+
+        printf("  (%zu errors)\n", reference_errors);
+    }
+
+    bench_kernels(buffer, size, &rng);
+    bench_sanitize(buffer, size, &rng);
+
+    free(buffer);
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "corpus.h"
+#include "utf8.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+const char *corpus_kind_names[CORPUS_KIND_COUNT] = {
+    [CORPUS_ASCII] = "ascii",
+    [CORPUS_MIXED] = "mixed",
+    [CORPUS_RANDOM] = "random",
+    [CORPUS_INVALID] = "invalid",
+};
+
+/* xorshift64*, see: https://en.wikipedia.org/wiki/Xorshift#xorshift* */
+uint64_t corpus_rng_next(CorpusRng *rng) {
+    if (rng->state == 0)
+        rng->state = 0x9E3779B97F4A7C15ULL;
+
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t rng_range(CorpusRng *rng, uint32_t min, uint32_t max) {
+    return min + (uint32_t)(corpus_rng_next(rng) % (max - min + 1));
+}
+
+static double rng_double(CorpusRng *rng) { return (corpus_rng_next(rng) >> 11) * 0x1.0p-53; }
+
+static uint32_t random_ascii(CorpusRng *rng) { return rng_range(rng, 0x20, 0x7E); }
+
+static uint32_t random_codepoint(CorpusRng *rng) {
+    switch (rng_range(rng, 1, 4)) {
+    case 1:
+        return rng_range(rng, 0x00, 0x7F);
+    case 2:
+        return rng_range(rng, 0x80, 0x7FF);
+    case 3: {
+        uint32_t codepoint = rng_range(rng, 0x800, 0xFFFF - 0x800);
+        /* Skip the surrogates */
+        return codepoint < 0xD800 ? codepoint : codepoint + 0x800;
+    }
+    default:
+        return rng_range(rng, 0x10000, 0x10FFFF);
+    }
+}
+
+/* Words of a single script, separated by spaces and the occasional newline */
+static uint32_t mixed_codepoint(CorpusRng *rng, uint32_t *word_left, uint32_t *script) {
+    if (*word_left == 0) {
+        *word_left = rng_range(rng, 1, 8);
+
+        uint32_t roll = rng_range(rng, 0, 99);
+        if (roll < 60)
+            *script = 0;
+        else if (roll < 75)
+            *script = 1;
+        else if (roll < 85)
+            *script = 2;
+        else if (roll < 95)
+            *script = 3;
+        else
+            *script = 4;
+
+        return rng_range(rng, 0, 15) == 0 ? '\n' : ' ';
+    }
+
+    *word_left -= 1;
+
+    switch (*script) {
+    case 0:
+        return rng_range(rng, 'a', 'z');
+    case 1: /* Latin-1 Supplement and Latin Extended */
+        return rng_range(rng, 0xC0, 0x24F);
+    case 2: /* Cyrillic */
+        return rng_range(rng, 0x410, 0x44F);
+    case 3: /* CJK Unified Ideographs */
+        return rng_range(rng, 0x4E00, 0x9FFF);
+    default: /* Emoticons */
+        return rng_range(rng, 0x1F600, 0x1F64F);
+    }
+}
+
+/* Every one of these is ill-formed when surrounded by well-formed sequences */
+static uint8_t random_error(CorpusRng *rng, uint8_t *out) {
+    static const struct {
+        uint8_t length;
+        uint8_t bytes[4];
+    } errors[] = {
+        {1, {0x80}},                   /* stray continuation byte */
+        {1, {0xBF}},                   /* " */
+        {1, {0xFF}},                   /* invalid byte */
+        {1, {0xF8}},                   /* " */
+        {2, {0xC0, 0xAF}},             /* overlong '/' */
+        {3, {0xE0, 0x80, 0xAF}},       /* " */
+        {4, {0xF0, 0x80, 0x80, 0xAF}}, /* " */
+        {3, {0xED, 0xA0, 0x80}},       /* surrogate */
+        {3, {0xED, 0xBF, 0xBF}},       /* " */
+        {4, {0xF4, 0x90, 0x80, 0x80}}, /* above U+10FFFF */
+        {1, {0xC3}},                   /* truncated */
+        {2, {0xE2, 0x82}},             /* " */
+        {3, {0xF0, 0x9F, 0x98}},       /* " */
+    };
+
+    uint32_t index = rng_range(rng, 0, sizeof(errors) / sizeof(errors[0]) - 1);
+    memcpy(out, errors[index].bytes, errors[index].length);
+    return errors[index].length;
+}
+
+size_t corpus_generate(uint8_t *buffer, size_t size, CorpusKind kind, double error_rate,
+                       CorpusRng *rng) {
+    size_t offset = 0, errors = 0;
+    double next_error = (double)size;
+    uint32_t word_left = 0, script = 0;
+    bool last_was_error = false;
+
+    /* Errors are spaced uniformly in [0, 2 / error_rate), which gives us the expected average */
+    if (kind == CORPUS_INVALID && error_rate > 0)
+        next_error = rng_double(rng) * 2 / error_rate;
+
+    while (offset < size) {
+        uint8_t sequence[4];
+        uint8_t length;
+        /* Two errors in a row could form a valid sequence, e.g. a truncated one followed by a
+         * stray continuation byte */
+        bool is_error = offset >= next_error && !last_was_error;
+
+        if (is_error) {
+            length = random_error(rng, sequence);
+            next_error = (double)offset + rng_double(rng) * 2 / error_rate;
+        } else {
+            uint32_t codepoint;
+            switch (kind) {
+            case CORPUS_ASCII:
+                codepoint = random_ascii(rng);
+                break;
+            case CORPUS_MIXED:
+                codepoint = mixed_codepoint(rng, &word_left, &script);
+                break;
+            default:
+                codepoint = random_codepoint(rng);
+                break;
+            }
+
+            length = utf8_encode(codepoint, sequence);
+        }
+
+        /* Whatever does not fit is padded with ASCII */
+        if (offset + length > size) {
+            memset(buffer + offset, ' ', size - offset);
+            break;
+        }
+
+        memcpy(buffer + offset, sequence, length);
+        offset += length;
+        errors += is_error;
+        last_was_error = is_error;
+    }
+
+    return errors;
+}
@@ -0,0 +1,35 @@
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Synthetic inputs for the benchmark and the fuzz harness */
+
+typedef enum {
+    /* Printable ASCII only */
+    CORPUS_ASCII,
+    /* Mostly ASCII text, mixed with latin, cyrillic, CJK and emoji */
+    CORPUS_MIXED,
+    /* Uniformly distributed sequence lengths with random codepoints */
+    CORPUS_RANDOM,
+    /* Like CORPUS_RANDOM, but with an ill-formed sequence every 1/error_rate bytes on average */
+    CORPUS_INVALID,
+
+    CORPUS_KIND_COUNT,
+} CorpusKind;
+
+typedef struct {
+    uint64_t state;
+} CorpusRng;
+
+extern const char *corpus_kind_names[CORPUS_KIND_COUNT];
+
+uint64_t corpus_rng_next(CorpusRng *rng);
+
+/* Fills exactly 'size' bytes. 'error_rate' is only used for CORPUS_INVALID and is the number of
+ * injected errors per byte. The number of injected errors is returned. */
+size_t corpus_generate(uint8_t *buffer, size_t size, CorpusKind kind, double error_rate,
+                       CorpusRng *rng);
+
+#endif
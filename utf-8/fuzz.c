@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+#include "utf8.h"
+
+/* Differential fuzzing: Every validator, as well as the chunked parallel validation, has to agree
+ * with the scalar reference on the offset of the first error. The vectorized utility functions
+ * and the sanitizer are compared against their scalar counterparts.
+ *
+ * With clang, this builds as a libFuzzer target ('make fuzz'). Seeds for its corpus directory can
+ * be written with 'fuzz_standalone -o <directory>'. Without any arguments, 'fuzz_standalone' runs
+ * on generated and randomly mutated inputs by itself, any other arguments are treated as files to
+ * replay (e.g. crashes found by libFuzzer). */
+
+#define STANDALONE_ITERATIONS 200000
+#define STANDALONE_MAX_SIZE 4096
+#define SEED_COUNT 64
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    size_t expected = utf8_validate_scalar(data, size);
+
+    for (uint32_t i = 1; i < utf8_validators_count; i++) {
+        size_t offset = utf8_validators[i].validate(data, size);
+
+        if (offset != expected) {
+            fprintf(stderr, "error: '%s' stopped at %zu, '%s' at %zu (size: %zu)\n",
+                    utf8_validators[i].name, offset, utf8_validators[0].name, expected, size);
+            abort();
+        }
+    }
+
+    /* Tiny chunks, so most sequences end up on a chunk boundary. Spawning threads is rather slow,
+     * the single threaded version goes through the same chunking and reconciliation. */
+    size_t chunk_size = size ? 1 + data[0] % 16 : 1;
+    uint32_t threads = size % 4 == 0 ? 2 : 1;
+    size_t offset = utf8_validate_parallel(data, size, threads, chunk_size, NULL);
+    if (offset != expected) {
+        fprintf(stderr, "error: 'parallel' (chunk size %zu) stopped at %zu, '%s' at %zu\n",
+                chunk_size, offset, utf8_validators[0].name, expected);
+        abort();
+    }
+
+    if (utf8_count_codepoints(data, size) != utf8_count_codepoints_scalar(data, size)) {
+        fprintf(stderr, "error: 'count_codepoints' differs from the scalar version\n");
+        abort();
+    }
+
+    size_t max_codepoints = size ? data[size - 1] : 0;
+    if (utf8_truncate(data, size, max_codepoints) !=
+        utf8_truncate_scalar(data, size, max_codepoints)) {
+        fprintf(stderr, "error: 'truncate' differs from the scalar version\n");
+        abort();
+    }
+
+    uint8_t *expected_output = malloc(UTF8_SANITIZE_BOUND(size) + 1);
+    uint8_t *output = malloc(UTF8_SANITIZE_BOUND(size) + 1);
+    size_t expected_length = utf8_sanitize_scalar(data, size, expected_output);
+
+    size_t output_length = utf8_sanitize(data, size, output);
+    if (output_length != expected_length || memcmp(output, expected_output, output_length) != 0 ||
+        utf8_validate_scalar(output, output_length) != output_length) {
+        fprintf(stderr, "error: 'sanitize' differs from the scalar version\n");
+        abort();
+    }
+
+    memcpy(output, data, size);
+    output_length = utf8_sanitize_inplace(output, size, UTF8_SANITIZE_BOUND(size));
+    if (output_length != expected_length || memcmp(output, expected_output, output_length) != 0) {
+        fprintf(stderr, "error: 'sanitize_inplace' differs from the scalar version\n");
+        abort();
+    }
+
+    free(expected_output);
+    free(output);
+
+    return 0;
+}
+
+#if defined(FUZZ_STANDALONE)
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *buffer = malloc(length > 0 ? (size_t)length : 1);
+    *size = fread(buffer, 1, (size_t)(length > 0 ? length : 0), file);
+    fclose(file);
+
+    return buffer;
+}
+
+static void generate_input(CorpusRng *rng, uint8_t *buffer, size_t *size) {
+    CorpusKind kind = (CorpusKind)(corpus_rng_next(rng) % CORPUS_KIND_COUNT);
+    double error_rate = (double)(corpus_rng_next(rng) % 1000) / 10000.0;
+
+    *size = corpus_rng_next(rng) % (STANDALONE_MAX_SIZE + 1);
+    corpus_generate(buffer, *size, kind, error_rate, rng);
+}
+
+static int write_seeds(const char *directory) {
+    static uint8_t buffer[STANDALONE_MAX_SIZE];
+    CorpusRng rng = {.state = 0x5EED};
+
+    for (uint32_t i = 0; i < SEED_COUNT; i++) {
+        size_t size;
+        generate_input(&rng, buffer, &size);
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/seed-%02u", directory, i);
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "error: Failed to open '%s'\n", path);
+            return 1;
+        }
+
+        fwrite(buffer, 1, size, file);
+        fclose(file);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "-o") == 0)
+        return write_seeds(argv[2]);
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            size_t size = 0;
+            uint8_t *buffer = read_file(argv[i], &size);
+            if (buffer == NULL) {
+                fprintf(stderr, "error: Failed to read '%s'\n", argv[i]);
+                return 1;
+            }
+
+            LLVMFuzzerTestOneInput(buffer, size);
+            free(buffer);
+        }
+
+        return 0;
+    }
+
+    static uint8_t buffer[STANDALONE_MAX_SIZE];
+    CorpusRng rng = {.state = 0xF022};
+
+    for (uint32_t iteration = 0; iteration < STANDALONE_ITERATIONS; iteration++) {
+        size_t size;
+        generate_input(&rng, buffer, &size);
+
+        /* Flip a few random bytes, to get errors the generator does not know about */
+        uint32_t mutations = size ? (uint32_t)(corpus_rng_next(&rng) % 4) : 0;
+        for (uint32_t i = 0; i < mutations; i++)
+            buffer[corpus_rng_next(&rng) % size] = (uint8_t)corpus_rng_next(&rng);
+
+        /* Start at an arbitrary offset, so errors end up everywhere within a vector */
+        size_t start = size ? corpus_rng_next(&rng) % size : 0;
+        LLVMFuzzerTestOneInput(buffer, size);
+        LLVMFuzzerTestOneInput(buffer + start, size - start);
+    }
+
+    printf("%u iterations, %u validators: OK\n", STANDALONE_ITERATIONS, utf8_validators_count);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,830 @@
+#include "utf8.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Unicode
+ * - Bytes are collected into a 32bit 'value' and compared to a bitmask:
+ *      - The mask 'mask' validates the starting sequence byte. The result must match 'pattern'
+ *      - The mask 'expect' ensures that the codepoint value is within the min/max range
+ *
+ * surrogate    : U+D800 - U+DFFF
+ * 1 byte
+ * range   : U+0000 - U+007F
+ * min     : .0000000 (0x00)
+ * max     : .1111111 (0x7f)
+ * mask    : 1....... (0x80)
+ * pattern : 0....... (0x00)
+ *
+ * 2 bytes
+ * invalid      : 0xC0, 0xC1
+ * range        : U+0080 - U+07FF
+ * layout       : 110xxxyy 10yyzzzz
+ * min          : ...00010 ..000000
+ * max          : ...11111 ..111111
+ * code_mask    : ...1111. ........ (0x1E)
+ * pattern      : 110..... 10...... (0xC0, 0x80)
+ * mask         : 111..... 11...... (0xE0, 0xC0)
+ *
+ * 3 bytes
+ * range        : U+0800 - U+FFFF
+ * layout       : 1110wwww 10xxxxyy 10yyzzzz
+ * min          : ....0000 ..100000 ..000000
+ * max          : ....1111 ..111111 ..111111
+ * code_mask    : ....1111 ..100000 ........ (0x0F, 0x20, 0x00)
+ * surr_mask    : 11101101 10100000
+ * pattern      : 1110.... 10...... 10...... (0xE0, 0x80, 0x80)
+ * mask         : 1111.... 11...... 11...... (0xF0, 0xC0, 0xC0)
+ *
+ * 4 bytes
+ * range        : U+01000000 - U+10FFFF
+ * layout       : 11110uvv 10vvwwww 10xxxxyy 10yyzzzz
+ * min          : ........ ...10000 ..000000 ..000000
+ * max          : .....100 ..001111 ..111111 ..111111
+ * code_mask    : .....111 ..11.... ........ ........ (0x07, 0x30)
+ * pattern      : 11110... 10...... 10...... 10...... (0xF0, 0x80, 0x80, 0x80)
+ * mask         : 11111... 11...... 11...... 11...... (0xF8, 0xC0, 0xC0, 0xC0)
+ * */
+
+uint8_t is_valid(uint8_t *buffer, uint32_t buffer_size) {
+    if (buffer_size == 0) {
+        return 0;
+    }
+
+    static const uint32_t mask_table[4] = {
+        0x80000000UL,
+        0xE0C00000UL,
+        0xF0C0C000UL,
+        0xF8C0C0C0UL,
+    };
+
+    /* Check basic layout */
+    static const uint32_t pattern_table[4] = {
+        0x00000000UL,
+        0xC0800000UL,
+        0xE0808000UL,
+        0xF0808080UL,
+    };
+
+    /* Check for overlong encoding */
+    static const uint32_t code_table[4] = {
+        0x00000000UL,
+        0x1E000000UL,
+        0x0F200000UL,
+        0x07300000UL,
+    };
+
+    /* The top for bits of the starting byte encode the type of the starting byte and therefore the
+     * length of the sequence */
+    static const uint8_t length_table[16] = {
+        1, 1, 1, 1, 1, 1, 1, 1, /* 0... */
+        1, 1, 1, 1,             /* 10.. invalid */
+        2, 2,                   /* 110. */
+        3,                      /* 1110 */
+        4,                      /* 1111 or invalid? */
+    };
+
+    enum {
+        SEQ_ONE,
+        SEQ_TWO,
+        SEQ_THREE,
+        SEQ_FOUR,
+    };
+
+    uint32_t value = 0;
+    /* The 4 most significant bytes encode the length of the sequence */
+    uint8_t length = length_table[buffer[0] >> 4];
+
+    switch (length < buffer_size ? length : buffer_size) {
+    case 4:
+        value |= ((uint32_t)buffer[3] << 0);
+    case 3:
+        value |= ((uint32_t)buffer[2] << 8);
+    case 2:
+        value |= ((uint32_t)buffer[1] << 16);
+    case 1:
+        value |= ((uint32_t)buffer[0] << 24);
+        break;
+    default:
+        return 0;
+    }
+
+    /* Surrogates are UTF-16 codepoints that do not belong in UTF-8, but some implementations don't
+     * care */
+    /* They start with 0xED, followed by 0xA0 - 0xBF */
+    uint32_t has_surrogate = length == 3 && (value >> 21) == (0xEDA0 >> 5);
+    /* Everything above U+10FFFF (0xF4 0x8F ...) */
+    uint32_t out_of_range = length == 4 && (value >> 16) > 0xF48F;
+    uint32_t masked = value & mask_table[length - 1];
+    uint32_t code = value & code_table[length - 1];
+
+    /* A single byte can not be overlong */
+    if (masked == pattern_table[length - 1] && (length == 1 || code) && !has_surrogate &&
+        !out_of_range) {
+        return length;
+    }
+
+    return 0;
+}
+
+bool test_string(char *string, uint32_t string_length) {
+    return utf8_validate_mask((uint8_t *)string, string_length) == string_length;
+}
+
+
+static inline bool utf8_is_continuation(uint8_t byte) { return (byte & 0xC0) == 0x80; }
+
+/* Returns the length of the sequence at the start of 'buffer', or 0 if it is ill-formed.
+ * The second byte has a narrower range for some lead bytes, which takes care of overlong
+ * encodings, surrogates and codepoints above U+10FFFF:
+ *
+ * lead         : second     : length
+ * 0x00 - 0x7F  :            : 1
+ * 0xC2 - 0xDF  : 0x80 - 0xBF: 2
+ * 0xE0         : 0xA0 - 0xBF: 3
+ * 0xE1 - 0xEC  : 0x80 - 0xBF: 3
+ * 0xED         : 0x80 - 0x9F: 3
+ * 0xEE - 0xEF  : 0x80 - 0xBF: 3
+ * 0xF0         : 0x90 - 0xBF: 4
+ * 0xF1 - 0xF3  : 0x80 - 0xBF: 4
+ * 0xF4         : 0x80 - 0x8F: 4 */
+static inline uint8_t utf8_sequence_length(const uint8_t *buffer, size_t remaining) {
+    uint8_t lead = buffer[0];
+    uint8_t length, low = 0x80, high = 0xBF;
+
+    if (lead < 0x80) {
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        if (lead == 0xE0)
+            low = 0xA0;
+        if (lead == 0xED)
+            high = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        if (lead == 0xF0)
+            low = 0x90;
+        if (lead == 0xF4)
+            high = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (remaining < length)
+        return 0;
+    if (buffer[1] < low || buffer[1] > high)
+        return 0;
+
+    for (uint8_t i = 2; i < length; i++) {
+        if (!utf8_is_continuation(buffer[i]))
+            return 0;
+    }
+
+    return length;
+}
+
+size_t utf8_validate_scalar(const uint8_t *buffer, size_t length) {
+    size_t i = 0;
+
+    while (i < length) {
+        uint8_t sequence_length = utf8_sequence_length(buffer + i, length - i);
+        if (sequence_length == 0)
+            return i;
+
+        i += sequence_length;
+    }
+
+    return length;
+}
+
+size_t utf8_validate_mask(const uint8_t *buffer, size_t length) {
+    size_t i = 0;
+
+    while (i < length) {
+        size_t remaining = length - i;
+        uint8_t sequence_length =
+            is_valid((uint8_t *)buffer + i, remaining > UINT32_MAX ? UINT32_MAX : remaining);
+        if (sequence_length == 0)
+            return i;
+
+        i += sequence_length;
+    }
+
+    return length;
+}
+
+#define ASCII_MASK_64 0x8080808080808080ULL
+
+size_t utf8_validate_swar(const uint8_t *buffer, size_t length) {
+    size_t i = 0;
+
+    while (i < length) {
+        if (i + 8 <= length) {
+            uint64_t word;
+            memcpy(&word, buffer + i, sizeof(word));
+
+            if ((word & ASCII_MASK_64) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        uint8_t sequence_length = utf8_sequence_length(buffer + i, length - i);
+        if (sequence_length == 0)
+            return i;
+
+        i += sequence_length;
+    }
+
+    return length;
+}
+
+/* The vectorized implementations only tell us, that a block contains an error. They resume
+ * serially from the last sequence boundary before 'offset' to find its exact location.
+ * Every sequence before 'offset' has been validated at this point, except for an incomplete one
+ * right before it. Backing up to its lead byte gives us a position from which a serial scan
+ * yields the same result as one from the start of the buffer. */
+static size_t utf8_resync(const uint8_t *buffer, size_t length, size_t offset) {
+    size_t start = offset;
+
+    if (start > 0) {
+        start--;
+        while (start > 0 && offset - start < 4 && utf8_is_continuation(buffer[start]))
+            start--;
+    }
+
+    return start + utf8_validate_scalar(buffer + start, length - start);
+}
+
+/* Vectorized validation, as described in "Validating UTF-8 In Less Than One Instruction Per Byte"
+ * by John Keiser and Daniel Lemire (https://arxiv.org/abs/2010.03090).
+ *
+ * Every byte is classified together with its predecessor: The high nibble of the previous byte,
+ * its low nibble and the high nibble of the current byte are each looked up in a 16 entry table.
+ * Every bit of a table entry stands for one kind of error, and the error is present if all three
+ * lookups agree on it (bitwise and). Only the 3rd and 4th byte of a sequence can not be checked
+ * this way, those are tracked separately by looking 2 and 3 bytes back. */
+#define TOO_SHORT (1 << 0)  /* 11______ 0_______, 11______ 11______ */
+#define TOO_LONG (1 << 1)   /* 0_______ 10______ */
+#define OVERLONG_3 (1 << 2) /* 11100000 100_____ */
+#define TOO_LARGE (1 << 3)  /* 11110100 1001____, 11110100 101_____, 11110101+ 1001____ ... */
+#define SURROGATE (1 << 4)  /* 11101101 101_____ */
+#define OVERLONG_2 (1 << 5) /* 1100000_ 10______ */
+#define TOO_LARGE_1000 (1 << 6) /* 11110101+ 1000____ */
+#define OVERLONG_4 (1 << 6)     /* 11110000 1000____ */
+#define TWO_CONTS (1 << 7)      /* 10______ 10______ */
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+static const uint8_t byte_1_high_table[16] = {
+    /* 0_______ ________ */
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    /* 10______ ________ */
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    /* 1100____ ________ */
+    TOO_SHORT | OVERLONG_2,
+    /* 1101____ ________ */
+    TOO_SHORT,
+    /* 1110____ ________ */
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    /* 1111____ ________ */
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+static const uint8_t byte_1_low_table[16] = {
+    /* ____0000 ________ */
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    /* ____0001 ________ */
+    CARRY | OVERLONG_2,
+    /* ____001_ ________ */
+    CARRY,
+    CARRY,
+    /* ____0100 ________ */
+    CARRY | TOO_LARGE,
+    /* ____0101 ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____011_ ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____1___ ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    /* ____1101 ________ */
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+static const uint8_t byte_2_high_table[16] = {
+    /* ________ 0_______ */
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    /* ________ 1000____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    /* ________ 1001____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    /* ________ 101_____ */
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    /* ________ 11______ */
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+/* A block that ends with one of these bytes needs more continuation bytes from the next one */
+static const uint8_t incomplete_table[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+#endif
+
+#if defined(__SSSE3__)
+typedef struct {
+    __m128i byte_1_high;
+    __m128i byte_1_low;
+    __m128i byte_2_high;
+    __m128i incomplete;
+} Ssse3Tables;
+
+static inline __m128i ssse3_check_block(const Ssse3Tables *tables, __m128i input,
+                                        __m128i prev_input) {
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+
+    __m128i byte_1_high = _mm_shuffle_epi8(
+        tables->byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble_mask));
+    __m128i byte_1_low = _mm_shuffle_epi8(tables->byte_1_low, _mm_and_si128(prev1, nibble_mask));
+    __m128i byte_2_high = _mm_shuffle_epi8(
+        tables->byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble_mask));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    /* Only 111_____ and 1111____ end up >= 0x80 */
+    __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte),
+                                                 _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must_be_continuation, special);
+}
+
+static inline bool ssse3_is_zero(__m128i value) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(value, _mm_setzero_si128())) == 0xFFFF;
+}
+
+size_t utf8_validate_ssse3(const uint8_t *buffer, size_t length) {
+    const Ssse3Tables tables = {
+        .byte_1_high = _mm_loadu_si128((const __m128i *)byte_1_high_table),
+        .byte_1_low = _mm_loadu_si128((const __m128i *)byte_1_low_table),
+        .byte_2_high = _mm_loadu_si128((const __m128i *)byte_2_high_table),
+        .incomplete = _mm_loadu_si128((const __m128i *)(incomplete_table + 16)),
+    };
+
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    size_t i = 0;
+
+    /* Errors are only checked once per 64 bytes */
+    for (; i + 64 <= length; i += 64) {
+        __m128i input[4];
+        for (uint32_t j = 0; j < 4; j++)
+            input[j] = _mm_loadu_si128((const __m128i *)(buffer + i + 16 * j));
+
+        __m128i any = _mm_or_si128(_mm_or_si128(input[0], input[1]),
+                                   _mm_or_si128(input[2], input[3]));
+        __m128i error = _mm_setzero_si128();
+
+        if (_mm_movemask_epi8(any) == 0) {
+            error = prev_incomplete;
+        } else {
+            for (uint32_t j = 0; j < 4; j++) {
+                error = _mm_or_si128(error, ssse3_check_block(&tables, input[j], prev_input));
+                prev_input = input[j];
+            }
+            prev_incomplete = _mm_subs_epu8(input[3], tables.incomplete);
+        }
+
+        if (!ssse3_is_zero(error))
+            return utf8_resync(buffer, length, i);
+
+        prev_input = input[3];
+    }
+
+    return utf8_resync(buffer, length, i);
+}
+#endif
+
+#if defined(__AVX2__)
+typedef struct {
+    __m256i byte_1_high;
+    __m256i byte_1_low;
+    __m256i byte_2_high;
+    __m256i incomplete;
+} Avx2Tables;
+
+static inline __m256i avx2_check_block(const Avx2Tables *tables, __m256i input,
+                                       __m256i prev_input) {
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+
+    /* 'alignr' works on 128 bit lanes, the upper half of 'prev_input' is moved in front of the
+     * lower half of 'input' first */
+    __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 16 - 1);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 16 - 2);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 16 - 3);
+
+    __m256i byte_1_high = _mm256_shuffle_epi8(
+        tables->byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble_mask));
+    __m256i byte_1_low =
+        _mm256_shuffle_epi8(tables->byte_1_low, _mm256_and_si256(prev1, nibble_mask));
+    __m256i byte_2_high = _mm256_shuffle_epi8(
+        tables->byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_be_continuation = _mm256_and_si256(
+        _mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must_be_continuation, special);
+}
+
+size_t utf8_validate_avx2(const uint8_t *buffer, size_t length) {
+    const Avx2Tables tables = {
+        .byte_1_high = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)byte_1_high_table)),
+        .byte_1_low = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)byte_1_low_table)),
+        .byte_2_high = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)byte_2_high_table)),
+        .incomplete = _mm256_loadu_si256((const __m256i *)incomplete_table),
+    };
+
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        __m256i input_low = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i input_high = _mm256_loadu_si256((const __m256i *)(buffer + i + 32));
+        __m256i error;
+
+        if (_mm256_movemask_epi8(_mm256_or_si256(input_low, input_high)) == 0) {
+            error = prev_incomplete;
+        } else {
+            error = _mm256_or_si256(avx2_check_block(&tables, input_low, prev_input),
+                                    avx2_check_block(&tables, input_high, input_low));
+            prev_incomplete = _mm256_subs_epu8(input_high, tables.incomplete);
+        }
+
+        if (!_mm256_testz_si256(error, error))
+            return utf8_resync(buffer, length, i);
+
+        prev_input = input_high;
+    }
+
+    return utf8_resync(buffer, length, i);
+}
+#endif
+
+const utf8_Validator utf8_validators[] = {
+    {"scalar", utf8_validate_scalar},
+    {"mask", utf8_validate_mask},
+    {"swar", utf8_validate_swar},
+#if defined(__SSSE3__)
+    {"ssse3", utf8_validate_ssse3},
+#endif
+#if defined(__AVX2__)
+    {"avx2", utf8_validate_avx2},
+#endif
+};
+
+const uint32_t utf8_validators_count = sizeof(utf8_validators) / sizeof(utf8_validators[0]);
+
+size_t utf8_validate(const uint8_t *buffer, size_t length) {
+#if defined(__AVX2__)
+    return utf8_validate_avx2(buffer, length);
+#elif defined(__SSSE3__)
+    return utf8_validate_ssse3(buffer, length);
+#else
+    return utf8_validate_swar(buffer, length);
+#endif
+}
+
+uint8_t utf8_encode(uint32_t codepoint, uint8_t *out) {
+    if (codepoint < 0x80) {
+        out[0] = (uint8_t)codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = (uint8_t)(0xC0 | (codepoint >> 6));
+        out[1] = (uint8_t)(0x80 | (codepoint & 0x3F));
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = (uint8_t)(0xE0 | (codepoint >> 12));
+        out[1] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+        out[2] = (uint8_t)(0x80 | (codepoint & 0x3F));
+        return 3;
+    }
+
+    out[0] = (uint8_t)(0xF0 | (codepoint >> 18));
+    out[1] = (uint8_t)(0x80 | ((codepoint >> 12) & 0x3F));
+    out[2] = (uint8_t)(0x80 | ((codepoint >> 6) & 0x3F));
+    out[3] = (uint8_t)(0x80 | (codepoint & 0x3F));
+    return 4;
+}
+
+/* Codepoints are counted by counting every byte that is not a continuation byte (10______).
+ * In a 64 bit word, the top bit of each byte is set for those bytes by: !b7 | b6 */
+#define LSB_MASK_64 0x0101010101010101ULL
+
+static inline uint32_t swar_count_leading(uint64_t word) {
+    return (uint32_t)__builtin_popcountll(((~word >> 7) | (word >> 6)) & LSB_MASK_64);
+}
+
+size_t utf8_count_codepoints_scalar(const uint8_t *buffer, size_t length) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; i++)
+        count += !utf8_is_continuation(buffer[i]);
+
+    return count;
+}
+
+#if defined(__AVX2__)
+/* As signed bytes, continuation bytes are the only ones below -64 */
+static inline __m256i avx2_is_continuation(__m256i input) {
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8(-64), input);
+}
+#elif defined(__SSE2__)
+static inline __m128i sse2_is_continuation(__m128i input) {
+    return _mm_cmplt_epi8(input, _mm_set1_epi8(-64));
+}
+#endif
+
+size_t utf8_count_codepoints(const uint8_t *buffer, size_t length) {
+    size_t continuations = 0, i = 0;
+
+#if defined(__AVX2__)
+    /* The compare results (0 or -1) are summed up per byte, which overflows after 255 rounds.
+     * The byte counters are then added up horizontally with 'sad'. */
+    while (i + 32 <= length) {
+        __m256i counters = _mm256_setzero_si256();
+        size_t rounds = (length - i) / 32 < 255 ? (length - i) / 32 : 255;
+
+        for (size_t round = 0; round < rounds; round++, i += 32) {
+            __m256i input = _mm256_loadu_si256((const __m256i *)(buffer + i));
+            counters = _mm256_sub_epi8(counters, avx2_is_continuation(input));
+        }
+
+        __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+        continuations += (size_t)_mm256_extract_epi64(sums, 0) +
+                         (size_t)_mm256_extract_epi64(sums, 1) +
+                         (size_t)_mm256_extract_epi64(sums, 2) +
+                         (size_t)_mm256_extract_epi64(sums, 3);
+    }
+#elif defined(__SSE2__)
+    while (i + 16 <= length) {
+        __m128i counters = _mm_setzero_si128();
+        size_t rounds = (length - i) / 16 < 255 ? (length - i) / 16 : 255;
+
+        for (size_t round = 0; round < rounds; round++, i += 16) {
+            __m128i input = _mm_loadu_si128((const __m128i *)(buffer + i));
+            counters = _mm_sub_epi8(counters, sse2_is_continuation(input));
+        }
+
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        continuations += (size_t)_mm_cvtsi128_si64(sums) +
+                         (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+#endif
+
+    size_t count = i - continuations;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        count += swar_count_leading(word);
+    }
+
+    return count + utf8_count_codepoints_scalar(buffer + i, length - i);
+}
+
+size_t utf8_truncate_scalar(const uint8_t *buffer, size_t length, size_t max_codepoints) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        if (utf8_is_continuation(buffer[i]))
+            continue;
+        if (count == max_codepoints)
+            return i;
+        count++;
+    }
+
+    return length;
+}
+
+size_t utf8_truncate(const uint8_t *buffer, size_t length, size_t max_codepoints) {
+    size_t count = 0, i = 0;
+
+    /* Skip whole blocks, as long as they fit. The block that does not is finished serially. */
+#if defined(__AVX2__)
+    for (; i + 32 <= length; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        uint32_t continuations = (uint32_t)_mm256_movemask_epi8(avx2_is_continuation(input));
+        size_t block_count = 32 - (size_t)__builtin_popcount(continuations);
+
+        if (count + block_count > max_codepoints)
+            break;
+        count += block_count;
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i *)(buffer + i));
+        uint32_t continuations = (uint32_t)_mm_movemask_epi8(sse2_is_continuation(input));
+        size_t block_count = 16 - (size_t)__builtin_popcount(continuations);
+
+        if (count + block_count > max_codepoints)
+            break;
+        count += block_count;
+    }
+#endif
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        size_t block_count = swar_count_leading(word);
+
+        if (count + block_count > max_codepoints)
+            break;
+        count += block_count;
+    }
+
+    return i + utf8_truncate_scalar(buffer + i, length - i, max_codepoints - count);
+}
+
+size_t utf8_find_boundary(const uint8_t *buffer, size_t length, size_t offset) {
+    if (offset >= length)
+        return length;
+
+    size_t start = offset;
+    while (start > 0 && offset - start < 3 && utf8_is_continuation(buffer[start]))
+        start--;
+
+    return start;
+}
+
+/* Returns the length of the maximal subpart of the ill-formed sequence at the start of 'buffer':
+ * The longest prefix of a well-formed sequence, or 1 if there is none.
+ * See: Unicode Standard, Chapter 3.9 "U+FFFD Substitution of Maximal Subparts" */
+static uint8_t utf8_maximal_subpart(const uint8_t *buffer, size_t remaining) {
+    uint8_t lead = buffer[0];
+    uint8_t length, low = 0x80, high = 0xBF;
+
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        if (lead == 0xE0)
+            low = 0xA0;
+        if (lead == 0xED)
+            high = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        if (lead == 0xF0)
+            low = 0x90;
+        if (lead == 0xF4)
+            high = 0x8F;
+    } else {
+        return 1;
+    }
+
+    if (remaining < 2 || buffer[1] < low || buffer[1] > high)
+        return 1;
+
+    uint8_t subpart = 2;
+    while (subpart < length && subpart < remaining && utf8_is_continuation(buffer[subpart]))
+        subpart++;
+
+    return subpart;
+}
+
+static const uint8_t replacement_character[3] = {0xEF, 0xBF, 0xBD};
+
+size_t utf8_sanitize_scalar(const uint8_t *input, size_t length, uint8_t *output) {
+    size_t in = 0, out = 0;
+
+    while (in < length) {
+        uint8_t sequence_length = utf8_sequence_length(input + in, length - in);
+
+        if (sequence_length == 0) {
+            in += utf8_maximal_subpart(input + in, length - in);
+            memcpy(output + out, replacement_character, sizeof(replacement_character));
+            out += sizeof(replacement_character);
+            continue;
+        }
+
+        memcpy(output + out, input + in, sequence_length);
+        in += sequence_length;
+        out += sequence_length;
+    }
+
+    return out;
+}
+
+/* Valid runs are found by the vectorized validator and copied in bulk. Starting it up for very
+ * short runs costs more than it saves, so after an error the input is handled serially, until
+ * SANITIZE_SERIAL_WINDOW bytes in a row were valid. Where errors are dense, that is all of it.
+ * 'output' may overlap with 'input', as long as it never overtakes it. Without an 'output', only
+ * the length of the result is calculated. */
+#define SANITIZE_SERIAL_WINDOW 16
+
+static size_t sanitize_runs(const uint8_t *input, size_t length, uint8_t *output) {
+    size_t in = 0, out = 0;
+
+    while (in < length) {
+        size_t valid = utf8_validate(input + in, length - in);
+
+        if (output != NULL && output + out != input + in)
+            memmove(output + out, input + in, valid);
+        in += valid;
+        out += valid;
+
+        size_t window_end = in;
+
+        while (in < length && in <= window_end) {
+            uint8_t sequence_length = utf8_sequence_length(input + in, length - in);
+
+            if (sequence_length == 0) {
+                in += utf8_maximal_subpart(input + in, length - in);
+                if (output != NULL)
+                    memcpy(output + out, replacement_character, sizeof(replacement_character));
+                out += sizeof(replacement_character);
+                window_end = in + SANITIZE_SERIAL_WINDOW;
+                continue;
+            }
+
+            if (output == NULL) {
+                in += sequence_length;
+                out += sequence_length;
+                continue;
+            }
+
+            /* Copying forwards is safe, 'out' never overtakes 'in' */
+            for (uint8_t i = 0; i < sequence_length; i++)
+                output[out++] = input[in++];
+        }
+    }
+
+    return out;
+}
+
+size_t utf8_sanitize(const uint8_t *input, size_t length, uint8_t *output) {
+    return sanitize_runs(input, length, output);
+}
+
+size_t utf8_sanitized_length(const uint8_t *input, size_t length) {
+    return sanitize_runs(input, length, NULL);
+}
+
+/* A maximal subpart is at most 3 bytes long, so replacing it never shrinks the output. As long as
+ * every subpart is 3 bytes long, the replacements are written over them. Behind the first shorter
+ * one, the difference between the output and the input position only grows and ends up at
+ * 'sanitized - length'. After moving the input that far back, the output can never overtake it.
+ * That part costs two passes and a move: One pass for the length, which has to be known before
+ * anything is moved, the move and the actual sanitizing. With dense errors, in place is therefore
+ * about half as fast as 'utf8_sanitize()'. */
+size_t utf8_sanitize_inplace(uint8_t *buffer, size_t length, size_t capacity) {
+    size_t valid = 0;
+
+    for (;;) {
+        valid += utf8_validate(buffer + valid, length - valid);
+        if (valid == length)
+            return length;
+
+        uint8_t subpart = utf8_maximal_subpart(buffer + valid, length - valid);
+        if (subpart < sizeof(replacement_character))
+            break;
+
+        memcpy(buffer + valid, replacement_character, sizeof(replacement_character));
+        valid += subpart;
+    }
+
+    size_t sanitized = valid + utf8_sanitized_length(buffer + valid, length - valid);
+    if (sanitized > capacity)
+        return sanitized;
+
+    size_t shift = sanitized - length;
+    if (shift > 0)
+        memmove(buffer + valid + shift, buffer + valid, length - valid);
+
+    return valid + sanitize_runs(buffer + valid + shift, length - valid, buffer + valid);
+}
@@ -0,0 +1,82 @@
+#ifndef _UTF8_H_
+#define _UTF8_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* All 'utf8_validate_*' functions share the same contract: They return 'length' if the whole
+ * buffer is valid UTF-8. Otherwise the offset of the first byte of the first ill-formed
+ * sequence is returned, which is exactly where a serial, byte-by-byte decoder would stop. */
+typedef size_t (*utf8_validate_func)(const uint8_t *buffer, size_t length);
+
+typedef struct {
+    const char *name;
+    utf8_validate_func validate;
+} utf8_Validator;
+
+/* The straight forward implementation of the "Well-Formed UTF-8 Byte Sequences" table
+ * (Unicode Standard, Table 3-7). Every other implementation is checked against this one. */
+size_t utf8_validate_scalar(const uint8_t *buffer, size_t length);
+/* Loops over 'is_valid()' */
+size_t utf8_validate_mask(const uint8_t *buffer, size_t length);
+/* Skips 8 bytes at a time, as long as they are ASCII */
+size_t utf8_validate_swar(const uint8_t *buffer, size_t length);
+#if defined(__SSSE3__)
+size_t utf8_validate_ssse3(const uint8_t *buffer, size_t length);
+#endif
+#if defined(__AVX2__)
+size_t utf8_validate_avx2(const uint8_t *buffer, size_t length);
+#endif
+
+/* Every implementation that was compiled in, the scalar reference being the first one */
+extern const utf8_Validator utf8_validators[];
+extern const uint32_t utf8_validators_count;
+
+/* The fastest available implementation */
+size_t utf8_validate(const uint8_t *buffer, size_t length);
+
+/* Validates the buffer in chunks of roughly 'chunk_size' bytes (0 picks a size) on up to
+ * 'threads' threads. The result is the same as the one of any serial implementation. Unless it is
+ * NULL, 'threads_used' receives the number of threads that actually ran, which is never more than
+ * the number of chunks. */
+size_t utf8_validate_parallel(const uint8_t *buffer, size_t length, uint32_t threads,
+                              size_t chunk_size, uint32_t *threads_used);
+
+/* The following functions only look at the lead bytes and expect valid input. There is no need
+ * to decode anything, every byte that is not a continuation byte starts a new codepoint. */
+
+/* Returns the number of codepoints in the buffer */
+size_t utf8_count_codepoints(const uint8_t *buffer, size_t length);
+size_t utf8_count_codepoints_scalar(const uint8_t *buffer, size_t length);
+
+/* Returns the length of the longest prefix that contains at most 'max_codepoints' codepoints */
+size_t utf8_truncate(const uint8_t *buffer, size_t length, size_t max_codepoints);
+size_t utf8_truncate_scalar(const uint8_t *buffer, size_t length, size_t max_codepoints);
+
+/* Returns the offset of the first byte of the codepoint that contains the byte at 'offset'.
+ * Offsets at or behind the end of the buffer return 'length'. */
+size_t utf8_find_boundary(const uint8_t *buffer, size_t length, size_t offset);
+
+/* Every maximal subpart of an ill-formed sequence is replaced by U+FFFD, following the WHATWG
+ * encoding standard. An invalid byte turns into 3 bytes at worst. */
+#define UTF8_SANITIZE_BOUND(length) ((length) * 3)
+
+/* Writes the sanitized input to 'output', which needs room for UTF8_SANITIZE_BOUND(length) bytes.
+ * Returns the number of bytes written. */
+size_t utf8_sanitize(const uint8_t *input, size_t length, uint8_t *output);
+size_t utf8_sanitize_scalar(const uint8_t *input, size_t length, uint8_t *output);
+/* Returns the length 'utf8_sanitize()' would produce */
+size_t utf8_sanitized_length(const uint8_t *input, size_t length);
+/* Sanitizes 'buffer' in place and returns its new length. 'capacity' is the size of the
+ * underlying allocation. If the result does not fit, the buffer is left untouched and the required
+ * capacity (> 'capacity') is returned. */
+size_t utf8_sanitize_inplace(uint8_t *buffer, size_t length, size_t capacity);
+
+/* Encodes 'codepoint' into 'out' (at least 4 bytes) and returns the number of bytes written */
+uint8_t utf8_encode(uint32_t codepoint, uint8_t *out);
+
+uint8_t is_valid(uint8_t *buffer, uint32_t buffer_size);
+bool test_string(char *string, uint32_t string_length);
+
+#endif
@@ -0,0 +1,141 @@
+#include "utf8.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* The buffer is cut into fixed size chunks, which are handed out to the worker threads in order.
+ * Every chunk boundary is moved forward to the next byte that is not a continuation byte, so no
+ * sequence is split between two chunks. A well-formed sequence has at most 3 continuation
+ * bytes, if there are more, the boundary stays at the 4th one.
+ *
+ * Reconciling the results is simple: If every chunk before chunk 'k' is valid, the serial scan
+ * reaches the start of chunk 'k' exactly at a sequence boundary. It then behaves just like the
+ * scan of chunk 'k' on its own. The first error of the first invalid chunk is therefore the first
+ * error of the whole buffer. This also holds for a boundary that was stuck on a continuation byte,
+ * both scans report it as the error.
+ * Chunks behind the first known invalid one can not change the result and are skipped. */
+
+#define DEFAULT_CHUNKS_PER_THREAD 8
+#define MIN_CHUNK_SIZE (1024 * 1024)
+#define NO_ERROR SIZE_MAX
+
+typedef struct {
+    const uint8_t *buffer;
+    size_t length;
+    size_t chunk_size;
+    size_t chunk_count;
+
+    atomic_size_t next_chunk;
+    atomic_size_t first_invalid_chunk;
+    /* The absolute offset of the first error for each chunk */
+    size_t *chunk_errors;
+} ParallelState;
+
+static size_t chunk_start(const ParallelState *state, size_t chunk) {
+    size_t nominal = chunk * state->chunk_size;
+    size_t start = nominal;
+
+    if (chunk == 0)
+        return 0;
+    if (start >= state->length)
+        return state->length;
+
+    while (start < state->length && start - nominal < 3 && (state->buffer[start] & 0xC0) == 0x80)
+        start++;
+
+    return start;
+}
+
+static void *parallel_worker(void *userdata) {
+    ParallelState *state = userdata;
+
+    while (1) {
+        size_t chunk = atomic_fetch_add(&state->next_chunk, 1);
+        if (chunk >= state->chunk_count)
+            break;
+
+        if (chunk > atomic_load(&state->first_invalid_chunk))
+            continue;
+
+        size_t start = chunk_start(state, chunk);
+        size_t end = chunk_start(state, chunk + 1);
+        size_t offset = start + utf8_validate(state->buffer + start, end - start);
+
+        if (offset == end)
+            continue;
+
+        state->chunk_errors[chunk] = offset;
+
+        size_t first = atomic_load(&state->first_invalid_chunk);
+        while (chunk < first &&
+               !atomic_compare_exchange_weak(&state->first_invalid_chunk, &first, chunk)) {
+        }
+    }
+
+    return NULL;
+}
+
+size_t utf8_validate_parallel(const uint8_t *buffer, size_t length, uint32_t threads,
+                              size_t chunk_size, uint32_t *threads_used) {
+    if (threads_used != NULL)
+        *threads_used = 1;
+
+    if (threads == 0)
+        threads = 1;
+
+    if (chunk_size == 0) {
+        chunk_size = length / ((size_t)threads * DEFAULT_CHUNKS_PER_THREAD);
+        if (chunk_size < MIN_CHUNK_SIZE)
+            chunk_size = MIN_CHUNK_SIZE;
+    }
+
+    ParallelState state = {
+        .buffer = buffer,
+        .length = length,
+        .chunk_size = chunk_size,
+        .chunk_count = (length + chunk_size - 1) / chunk_size,
+    };
+
+    if (state.chunk_count <= 1)
+        return utf8_validate(buffer, length);
+
+    atomic_init(&state.next_chunk, 0);
+    atomic_init(&state.first_invalid_chunk, NO_ERROR);
+
+    state.chunk_errors = malloc(state.chunk_count * sizeof(*state.chunk_errors));
+    if (state.chunk_errors == NULL)
+        return utf8_validate(buffer, length);
+
+    for (size_t i = 0; i < state.chunk_count; i++)
+        state.chunk_errors[i] = NO_ERROR;
+
+    if (threads > state.chunk_count)
+        threads = (uint32_t)state.chunk_count;
+
+    /* The calling thread is one of the workers */
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    uint32_t started = 0;
+
+    for (uint32_t i = 1; workers != NULL && i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, parallel_worker, &state) != 0)
+            break;
+        started++;
+    }
+
+    parallel_worker(&state);
+
+    if (threads_used != NULL)
+        *threads_used = started + 1;
+
+    for (uint32_t i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    size_t first_invalid = atomic_load(&state.first_invalid_chunk);
+    size_t result = first_invalid == NO_ERROR ? length : state.chunk_errors[first_invalid];
+
+    free(workers);
+    free(state.chunk_errors);
+
+    return result;
+}
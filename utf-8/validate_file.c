@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utf8.h"
+
+/* Chunks smaller than this only add overhead, so smaller sizes are raised to it */
+#define MIN_CHUNK_SIZE (64 * 1024)
+#define MAX_THREADS 4096
+
+/* Usage: validate_file [-j threads] [-c chunk size in MiB] <file>
+ * Exits with 0 if the file is valid UTF-8. Otherwise the offset of the first error is printed and
+ * the exit status is 1. Chunks are at least 64 KiB, smaller sizes are raised to that. */
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-j threads] [-c chunk size in MiB] <file>\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunk_size = 0;
+    int option;
+    char *end;
+
+    while ((option = getopt(argc, argv, "j:c:")) != -1) {
+        switch (option) {
+        case 'j':
+            errno = 0;
+            threads = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || errno != 0 || threads < 1 ||
+                threads > MAX_THREADS)
+                usage(argv[0]);
+            break;
+        case 'c': {
+            errno = 0;
+            double mebibytes = strtod(optarg, &end);
+            /* Also rejects NaN, which fails every comparison */
+            if (end == optarg || *end != '\0' || errno != 0 || !(mebibytes > 0) ||
+                !(mebibytes * 1024 * 1024 < (double)(SIZE_MAX / 2)))
+                usage(argv[0]);
+
+            chunk_size = (size_t)(mebibytes * 1024 * 1024);
+            if (chunk_size < MIN_CHUNK_SIZE)
+                chunk_size = MIN_CHUNK_SIZE;
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "error: Failed to open '%s': %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+
+    struct stat input_stat;
+    if (fstat(fd, &input_stat) == -1) {
+        fprintf(stderr, "error: Failed to stat '%s': %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+
+    size_t length = (size_t)input_stat.st_size;
+    uint8_t *buffer = NULL;
+
+    if (length > 0) {
+        buffer = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buffer == MAP_FAILED) {
+            fprintf(stderr, "error: Failed to map '%s': %s\n", argv[optind], strerror(errno));
+            return 2;
+        }
+
+        /* Every thread reads its chunks front to back */
+        madvise(buffer, length, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+
+    uint32_t threads_used;
+    uint64_t start = now_ns();
+    size_t offset = utf8_validate_parallel(buffer, length, threads > 0 ? (uint32_t)threads : 1,
+                                           chunk_size, &threads_used);
+    uint64_t duration = now_ns() - start;
+
+    fprintf(stderr, "%zu bytes in %.3f ms (%.2f GB/s, %u threads)\n", length,
+            (double)duration / 1e6, (double)length / (double)(duration ? duration : 1),
+            threads_used);
+
+    if (length > 0)
+        munmap(buffer, length);
+
+    if (offset != length) {
+        printf("%s: invalid UTF-8 at byte %zu\n", argv[optind], offset);
+        return 1;
+    }
+
+    return 0;
+}